@@ -45,12 +45,6 @@
 #define NST_CACHE_DEFAULT_PURGE_METHOD       "PURGE"
 #define NST_CACHE_DEFAULT_PURGE_METHOD_SIZE   16
 
-struct nst_cache_element {
-    struct nst_str            msg;
-
-    struct nst_cache_element *next;
-};
-
 /*
  * A nst_cache_data contains a complete http response data,
  * and is pointed by nst_cache_entry->data.
@@ -59,7 +53,7 @@ struct nst_cache_element {
 struct nst_cache_data {
     int                       clients;
     int                       invalid;
-    struct nst_cache_element *element;
+    struct nst_data_element  *element;
 
     struct nst_cache_data    *next;
 };
@@ -74,6 +68,41 @@ enum {
     NST_CACHE_ENTRY_STATE_EXPIRED,
 };
 
+/*
+ * Secondary indexes of the entries, so that a purge by host, path or rule
+ * only walks the matching entries
+ */
+enum {
+    NST_CACHE_INDEX_HOST = 0,
+    NST_CACHE_INDEX_PATH,
+    NST_CACHE_INDEX_RULE,
+    NST_CACHE_INDEX_MAX,
+};
+
+#define NST_CACHE_INDEX_SIZE                  4096
+
+struct nst_cache_index_link {
+    struct nst_cache_entry *next;
+    struct nst_cache_entry *prev;
+};
+
+/*
+ * A tag of an entry, linked in the tag index bucket of its hash and in the
+ * tag list of its entry
+ */
+#define NST_CACHE_TAGS                        64
+
+struct nst_cache_tag {
+    struct nst_cache_entry *entry;       /* NULL once dropped while pinned */
+    struct nst_cache_tag   *next;
+    struct nst_cache_tag   *prev;
+    struct nst_cache_tag   *sibling;     /* next tag of the same entry */
+    uint64_t                hash;
+    int                     pinned;
+    int                     len;
+    char                    data[0];
+};
+
 struct nst_cache_entry {
     int                     state;
     struct buffer          *key;
@@ -102,9 +131,69 @@ struct nst_cache_entry {
     /* extended count  */
     int                     extended;
 
+    /* purges walking an index from this entry, do not free it */
+    int                     pinned;
+
+    /* queued in the expire journal */
+    int                     journaled;
+
+    /* the checksum of file was checked, or file was written by us */
+    int                     verified;
+
+    /* a hit is checking the checksum, the others miss meanwhile */
+    int                     verifying;
+
+    /* file removed by disk-size, do not save it again */
+    int                     evicted;
+
+    /* disk tier: cached by a tier rule, hits since cached or demoted */
+    int                     tier;
+    uint32_t                hits;
+
+    /* queued in the promote queue */
+    int                     promoting;
+
+    struct nst_cache_index_link index[NST_CACHE_INDEX_MAX];
+
+    struct nst_cache_tag   *tags;
+
     struct nst_cache_entry *next;
 };
 
+/*
+ * Entries whose expire changed while they are persisted, the file is updated
+ * later by the housekeeping, out of the dict lock. Queued entries are pinned.
+ */
+#define NST_CACHE_JOURNAL_SIZE                1024
+#define NST_CACHE_JOURNAL_BATCH               32
+
+struct nst_cache_journal {
+    struct nst_cache_entry *entry[NST_CACHE_JOURNAL_SIZE];
+    int                     head;
+    int                     count;
+    uint64_t                dropped;     /* updates lost as the journal was full */
+};
+
+/*
+ * Over disk-size, the least recently used of the files of the next
+ * SAMPLES entries having one is removed, at most BATCH per housekeeping.
+ */
+#define NST_CACHE_EVICT_SAMPLES               16
+#define NST_CACHE_EVICT_BATCH                 32
+
+/*
+ * disk tier: from HIGH percent of the memory zone in use down to LOW, the
+ * entry with the fewest hits of the next SAMPLES in memory is moved to disk.
+ * An entry on disk hit PROMOTE times is queued, in a journal like the expire
+ * one, and loaded back to memory if less than LOW percent is in use.
+ */
+#define NST_CACHE_TIER_HIGH                   90
+#define NST_CACHE_TIER_LOW                    80
+#define NST_CACHE_TIER_SAMPLES                16
+#define NST_CACHE_TIER_PROMOTE                2
+#define NST_CACHE_TIER_BATCH                  8
+#define NST_CACHE_TIER_BLOCK                  8192
+
 struct nst_cache_dict {
     struct nst_cache_entry **entry;
     uint64_t                 size;      /* number of entries */
@@ -143,7 +232,7 @@ struct nst_cache_ctx {
 
     struct nst_cache_entry   *entry;
     struct nst_cache_data    *data;
-    struct nst_cache_element *element;
+    struct nst_data_element  *element;
 
     struct {
         int                   scheme;
@@ -211,14 +300,29 @@ struct nst_cache {
     /* persist async index */
     int                    persist_idx;
 
-    /* for disk_loader and disk_cleaner */
-    struct {
-        int                loaded;
-        int                idx;
-        DIR               *dir;
-        struct dirent     *de;
-        char              *file;
-    } disk;
+    /* defrag index */
+    int                    defrag_idx;
+
+    /* disk-size eviction index */
+    uint64_t               evict_idx;
+
+    /* NST_CACHE_INDEX_* buckets */
+    struct nst_cache_entry **index[NST_CACHE_INDEX_MAX];
+    uint64_t                 index_size[NST_CACHE_INDEX_MAX];
+
+    /* tag index buckets */
+    struct nst_cache_tag   **tag;
+    uint64_t                 tag_size;
+
+    struct nst_cache_journal journal;
+
+    /* disk tier */
+    struct nst_cache_journal promote;
+    uint64_t               tier_idx;
+    uint64_t               promoted;
+    uint64_t               demoted;
+
+    struct nst_persist_disk disk;
 };
 
 extern struct flt_ops  nst_cache_filter_ops;
@@ -233,6 +337,7 @@ enum {
     NST_CACHE_PURGE_HOST,
     NST_CACHE_PURGE_PATH_HOST,
     NST_CACHE_PURGE_REGEX_HOST,
+    NST_CACHE_PURGE_TAG,
 };
 
 enum {
@@ -248,8 +353,15 @@ struct nst_cache_entry *nst_cache_dict_get(struct buffer *key, uint64_t hash);
 struct nst_cache_entry *nst_cache_dict_set(struct nst_cache_ctx *ctx);
 void nst_cache_dict_rehash();
 void nst_cache_dict_cleanup();
+void nst_cache_dict_defrag();
 int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
-        struct nst_str *host, struct nst_str *path);
+        struct nst_str *host, struct nst_str *path, struct nst_str *tags);
+struct nst_cache_entry *nst_cache_index_first(int type, uint64_t hash);
+void nst_cache_tag_set(struct nst_cache_entry *entry, struct ist *tags,
+        int count);
+int nst_cache_tag_parse(char *p, char *end, struct ist *tags, int count);
+struct nst_cache_tag *nst_cache_tag_first(uint64_t hash);
+struct nst_cache_tag *nst_cache_tag_unpin(struct nst_cache_tag *tag);
 
 /* engine */
 void nst_cache_init();
@@ -269,6 +381,7 @@ void nst_cache_finish(struct nst_cache_ctx *ctx);
 void nst_cache_abort(struct nst_cache_ctx *ctx);
 int nst_cache_exists(struct nst_cache_ctx *ctx, struct nst_rule *rule);
 struct nst_cache_data *nst_cache_data_new();
+void nst_cache_data_release(struct nst_cache_data *data);
 void nst_cache_hit(struct stream *s, struct stream_interface *si,
         struct channel *req, struct channel *res, struct nst_cache_data *data);
 
@@ -282,6 +395,10 @@ int nst_cache_check_uri(struct http_msg *msg);
 void nst_cache_persist_cleanup();
 void nst_cache_persist_load();
 void nst_cache_persist_async();
+void nst_cache_persist_journal();
+int nst_cache_persist_evict();
+void nst_cache_tier_promote();
+void nst_cache_tier_demote();
 void nst_cache_build_etag(struct nst_cache_ctx *ctx, struct stream *s,
         struct http_msg *msg);
 
@@ -333,11 +450,10 @@ static inline int nst_cache_entry_invalid(struct nst_cache_entry *entry) {
     return nst_cache_entry_expired(entry);
 }
 
-#define nst_cache_key_init() nst_key_init(global.nuster.cache.memory)
-#define nst_cache_key_advance(key, step)                                      \
-    nst_key_advance(global.nuster.cache.memory, key, step)
+#define nst_cache_key_init() nst_key_scratch()
+#define nst_cache_key_advance(key, step) nst_key_advance(NULL, key, step)
 #define nst_cache_key_append(key, str, len)                                   \
-    nst_key_append(global.nuster.cache.memory, key, str, len)
+    nst_key_append(NULL, key, str, len)
 #define nst_cache_memory_alloc(size)                                          \
     nst_memory_alloc(global.nuster.cache.memory, size)
 #define nst_cache_memory_free(p) nst_memory_free(global.nuster.cache.memory, p);
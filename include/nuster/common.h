@@ -39,6 +39,7 @@
 #endif
 
 #include <common/mini-clist.h>
+#include <common/ist.h>
 #include <types/acl.h>
 
 #define NST_OK          0
@@ -53,6 +54,11 @@
 #define NST_DEFAULT_DISK_CLEANER        100
 #define NST_DEFAULT_DISK_LOADER         100
 #define NST_DEFAULT_DISK_SAVER          100
+#define NST_DEFAULT_DISK_FDS            64
+#define NST_DEFAULT_REPLICATION_JOURNAL 1024
+#define NST_DEFAULT_REPLICATION_TIMEOUT 1000
+
+#define NST_SHARD_HEADER                "x-nuster-shard"
 
 enum {
     NST_STATUS_UNDEFINED = -1,
@@ -65,6 +71,11 @@ enum {
     NST_MODE_NOSQL,
 };
 
+enum {
+    NST_REPLICATION_ASYNC = 0,
+    NST_REPLICATION_SYNC,
+};
+
 #define nst_str_set(str)     { (char *) str, sizeof(str) - 1 }
 
 struct nst_str {
@@ -72,6 +83,15 @@ struct nst_str {
     int   len;
 };
 
+/*
+ * A cached HTX block, msg.len is the block info. Shared by cache and nosql
+ * so that both store, send and persist data the same way.
+ */
+struct nst_data_element {
+    struct nst_data_element *next;
+    struct nst_str           msg;
+};
+
 enum nst_rule_key_type {
     /* method: GET, POST... */
     NST_RULE_KEY_METHOD = 1,
@@ -110,8 +130,21 @@ enum nst_rule_key_type {
 struct nst_rule_key {
     enum nst_rule_key_type  type;
     char                   *data;
+    int                     len;    /* length of data */
+    int                     idx;    /* header/param slot, -1 for others */
 };
 
+/*
+ * A header or param value found by nst_key_collect(), idx is the slot of the
+ * rule key component it belongs to
+ */
+struct nst_key_value {
+    int       idx;
+    struct ist value;
+};
+
+#define NST_KEY_VALUES    32
+
 struct nst_rule_code {
     struct nst_rule_code *next;
     int                   code;
@@ -134,6 +167,9 @@ enum {
 
     /* cache in memory first and persist on disk later */
     NST_DISK_ASYNC,
+
+    /* cache in memory, moved to disk when memory is short, back when hot */
+    NST_DISK_TIER,
 };
 
 struct nst_rule {
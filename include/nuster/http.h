@@ -145,4 +145,18 @@ static inline void nst_res_simple(struct stream_interface *si, int status,
 int nst_req_find_param(char *query_beg, char *query_end,
         char *name, char **value, int *value_len);
 
+static inline uint32_t nst_data_element_size(struct nst_data_element *element) {
+    uint32_t info = element->msg.len;
+    enum htx_blk_type type = (info >> 28);
+
+    return ((type == HTX_BLK_HDR || type == HTX_BLK_TLR)
+            ? (info & 0xff) + ((info >> 8) & 0xfffff)
+            : info & 0xfffffff);
+}
+
+int nst_data_element_to_htx(struct nst_data_element *element, struct htx *htx);
+void nst_res_send_persist(struct stream_interface *si, struct htx *htx,
+        unsigned int *state, int fd, int header_len, uint64_t *offset,
+        int *splice, struct nst_persist_file *cached);
+
 #endif /* _NUSTER_HTTP_H */
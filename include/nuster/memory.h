@@ -32,6 +32,52 @@
 #define NST_MEMORY_BLOCK_MAX_SHIFT     21
 #define NST_MEMORY_INFO_BITMAP_BITS    32
 
+/*
+ * Chunk sizes, 4 size classes per doubling of the chunk size, but never
+ * closer than 8 bytes so that chunks stay aligned:
+ * 32 | 40 48 56 64 | 80 96 112 128 | 160 ... block_size
+ */
+#define NST_MEMORY_CLASS_STEPS         4
+#define NST_MEMORY_CLASS_MIN_SHIFT     3
+#define NST_MEMORY_CLASS_MAX           80
+
+/*
+ * Allocations larger than block_size take a span of contiguous blocks.
+ * Freed spans are kept in runs of free blocks, indexed by log2 of their
+ * length, and merged with the runs next to them.
+ */
+#define NST_MEMORY_TYPE_SPAN           0xFF /* first block of a span */
+#define NST_MEMORY_TYPE_SPAN_BODY      0xFE /* other blocks of a span */
+#define NST_MEMORY_TYPE_RUN            0xFD /* first block of a free run */
+#define NST_MEMORY_TYPE_RUN_TAIL       0xFC /* last block of a free run */
+#define NST_MEMORY_RUN_BUCKETS         32
+
+/*
+ * Defrag moves chunks out of blocks with at most 1/SPARSE of their chunks
+ * in use, into one of the first TRIES blocks of the chunk list
+ */
+#define NST_MEMORY_DEFRAG_SPARSE       4
+#define NST_MEMORY_DEFRAG_TRIES        8
+
+#define NST_MEMORY_HUGEPAGE_OFF        0
+#define NST_MEMORY_HUGEPAGE_ON         1    /* MAP_HUGETLB */
+#define NST_MEMORY_HUGEPAGE_THP        2    /* madvise(MADV_HUGEPAGE) */
+
+#define NST_MEMORY_NUMA_DEFAULT        0
+#define NST_MEMORY_NUMA_BIND           1
+#define NST_MEMORY_NUMA_INTERLEAVE     2
+
+/*
+ * Per-thread magazines of free chunks, only for the small chunk sizes.
+ * They are refilled from and flushed to the zone BATCH chunks at a time,
+ * so the zone lock is taken once per BATCH allocations or frees.
+ */
+#define NST_MEMORY_MAGAZINE_ZONES      4
+#define NST_MEMORY_MAGAZINE_CLASSES    21   /* up to 1KB with 32B chunks */
+#define NST_MEMORY_MAGAZINE_SIZE       32
+#define NST_MEMORY_MAGAZINE_BATCH      16
+#define NST_MEMORY_MAGAZINE_THREADS    128  /* parked slots per zone */
+
 
 /* start                                 alignment                   stop
  * |                                     |   |                       |
@@ -46,7 +92,10 @@
  * info:
  * | bitmap: 32 | reserved: 16 | 5 | full: 1 | bitmap: 1 | inited: 1 | type: 8 |
  * bitmap: points to bitmap area, doesn't change once set
- * chunk size[n]: 1<<(NST_MEMORY_CHUNK_MIN_SHIFT + n)
+ * type: size class, chunk size is memory->class[type].size
+ * bits past the last chunk of a block are always set
+ *
+ * span, run and run tail blocks keep the number of blocks in bitmap: 32
  */
 struct nst_memory_ctrl {
     uint64_t                info;
@@ -56,6 +105,22 @@ struct nst_memory_ctrl {
     struct nst_memory_ctrl *next;
 };
 
+struct nst_memory_class {
+    uint32_t                 size;        /* chunk size */
+    uint32_t                 per_block;   /* chunks in one block */
+    uint64_t                 requested;   /* bytes asked, since start */
+    uint64_t                 allocs;      /* allocations, since start */
+};
+
+/*
+ * Bytes in the magazines of a thread, only written by it and read by any
+ * process, one cache line each.
+ */
+struct nst_memory_parked {
+    uint64_t                 bytes;
+    uint8_t                  pad[56];
+};
+
 struct nst_memory {
     uint8_t                 *start;
     uint8_t                 *stop;
@@ -73,13 +138,30 @@ struct nst_memory {
     int                      chunk_shift;
     int                      block_shift;
 
-    int                      chunks;
+    int                      chunks;      /* number of size classes */
     int                      blocks;
     struct nst_memory_ctrl **chunk;
     struct nst_memory_ctrl  *block;
     struct nst_memory_ctrl  *empty;
     struct nst_memory_ctrl  *full;
 
+    uint64_t                 used;        /* bytes allocated, in chunk size */
+    int                      zone;        /* magazine index, -1 if none */
+    uint64_t                 page_size;   /* effective page size */
+    int                      hugepage;    /* NST_MEMORY_HUGEPAGE_* in effect */
+
+    struct nst_memory_class  class[NST_MEMORY_CLASS_MAX];
+    uint8_t                  class_base[32];  /* first class above 1<<n */
+
+    struct nst_memory_ctrl  *run[NST_MEMORY_RUN_BUCKETS];
+    uint64_t                 span_blocks; /* blocks in spans */
+    uint64_t                 run_blocks;  /* blocks in free runs */
+    uint64_t                 moved;       /* chunks moved by defrag */
+
+    /* chunks in magazines are in used but not in use */
+    int                      parked_slots;
+    struct nst_memory_parked parked[NST_MEMORY_MAGAZINE_THREADS];
+
     struct {
         uint8_t             *begin;
         uint8_t             *free;
@@ -97,6 +179,14 @@ _nst_memory_block_set_type(struct nst_memory_ctrl *block, uint8_t type) {
     *(uint8_t *)(&block->info) = type;
 }
 
+static inline uint8_t _nst_memory_block_type(struct nst_memory_ctrl *block) {
+    return block->info & 0xFF;
+}
+
+static inline uint32_t _nst_memory_block_len(struct nst_memory_ctrl *block) {
+    return block->info >> 32;
+}
+
 static inline void _nst_memory_block_set_inited(struct nst_memory_ctrl *block) {
     bit_set(block->info, 9);
 }
@@ -121,10 +211,33 @@ static inline void _nst_memory_block_clear_full(struct nst_memory_ctrl *block) {
     bit_clear(block->info, 11);
 }
 
-struct nst_memory *nst_memory_create(char *name, uint64_t size,
-        uint32_t block_size, uint32_t chunk_size);
+struct nst_memory_magazine {
+    int                      count;
+    void                    *chunk[NST_MEMORY_MAGAZINE_SIZE];
 
+    /* not yet added to the class */
+    uint32_t                 requested;
+    uint32_t                 allocs;
+};
+
+struct nst_memory_conf;
+struct buffer;
+
+struct nst_memory *nst_memory_create(char *name, uint64_t size,
+        uint32_t block_size, uint32_t chunk_size, struct nst_memory_conf *conf);
+int nst_memory_parse_nodes(const char *str, unsigned long *nodes);
+const char *nst_memory_hugepage_str(struct nst_memory *memory);
+void nst_memory_stats_dump(struct buffer *buf, struct nst_memory *memory,
+        const char *prefix);
+
+int nst_memory_magazine_init();
+void nst_memory_magazine_flush();
+uint64_t nst_memory_in_use(struct nst_memory *memory);
+
+void *nst_memory_alloc_locked(struct nst_memory *memory, int size);
+void nst_memory_free_locked(struct nst_memory *memory, void *p);
 void *nst_memory_alloc(struct nst_memory *memory, int size);
 void nst_memory_free(struct nst_memory *memory, void *p);
+void *nst_memory_defrag(struct nst_memory *memory, void *p);
 
 #endif /* _NUSTER_MEMORY_H */
@@ -23,11 +23,20 @@
 #define _NUSTER_NOSQL_H
 
 #include <nuster/common.h>
+#include <nuster/persist.h>
 
 #define NST_NOSQL_DEFAULT_CHUNK_SIZE            32
 #define NST_NOSQL_DEFAULT_LOAD_FACTOR           0.75
 #define NST_NOSQL_DEFAULT_GROWTH_FACTOR         2
 #define NST_NOSQL_DEFAULT_KEY_SIZE              128
+#define NST_NOSQL_DEFAULT_PACK_SIZE             256
+#define NST_NOSQL_DEFAULT_INLINE_SIZE           256
+#define NST_NOSQL_REPLICATION_INTERVAL          100     /* ms */
+#define NST_NOSQL_REPLICATION_RETRY             1000    /* ms */
+#define NST_NOSQL_REPLICATION_POLL              10      /* ms */
+#define NST_NOSQL_REPLICATION_HEADER            "x-nuster-replica"
+#define NST_NOSQL_INGEST_TIMEOUT                1000    /* ms */
+#define NST_NOSQL_INGEST_POLL                   10      /* ms */
 
 
 enum {
@@ -44,11 +53,8 @@ enum {
     NST_NOSQL_APPCTX_STATE_EMPTY,
     NST_NOSQL_APPCTX_STATE_FULL,
     NST_NOSQL_APPCTX_STATE_HIT_DISK,
-};
-
-struct nst_nosql_element {
-    struct nst_nosql_element *next;
-    struct nst_str            msg;
+    NST_NOSQL_APPCTX_STATE_TIMEOUT,
+    NST_NOSQL_APPCTX_STATE_NOT_REPLICATED,
 };
 
 /*
@@ -57,11 +63,13 @@ struct nst_nosql_element {
  * All nst_nosql_data are stored in a circular singly linked list
  */
 #define NST_NOSQL_DATA_FLAG_CHUNKED    0x00000001
+#define NST_NOSQL_DATA_FLAG_PACKED     0x00000002  /* elements in one chunk */
+#define NST_NOSQL_DATA_FLAG_COPY       0x00000004  /* of an inline entry */
 
 struct nst_nosql_data {
     int                       clients;
     int                       invalid;
-    struct nst_nosql_element *element;
+    struct nst_data_element  *element;
     struct nst_nosql_data    *next;
 
     struct {
@@ -82,20 +90,30 @@ enum {
     NST_NOSQL_ENTRY_STATE_EXPIRED,
 };
 
+/*
+ * The key is stored right after the entry, in the same allocation. Once
+ * complete, a small value of a memory only rule is moved after the key, the
+ * entry is then inline and has no data. The inline area is 2 bytes of value
+ * length, 1 byte of content type length, the content type and the value.
+ */
+#define NST_NOSQL_ENTRY_FLAG_INLINE    0x01
+#define NST_NOSQL_ENTRY_FLAG_VERIFIED  0x02  /* file checksum checked */
+#define NST_NOSQL_ENTRY_FLAG_VERIFYING 0x04  /* checked by a hit */
+#define NST_NOSQL_ENTRY_FLAG_ASYNC     0x08  /* saved by the disk saver */
+
+#define NST_NOSQL_ENTRY_INLINE_HEADER  3
+#define NST_NOSQL_ENTRY_INLINE_MAX     (NST_NOSQL_ENTRY_INLINE_HEADER + 255 \
+        + NST_NOSQL_DEFAULT_INLINE_SIZE)
+
 struct nst_nosql_entry {
-    int                     state;
-    struct buffer          *key;
+    struct nst_nosql_entry *next;
     uint64_t                hash;
     struct nst_nosql_data  *data;
-    uint64_t                expire;
-    uint64_t                atime;
-    struct nst_str          host;
-    struct nst_str          path;
-    struct nst_nosql_entry *next;
-    struct nst_rule        *rule;        /* rule */
-    int                     pid;         /* proxy uuid */
     char                   *file;
-    int                     header_len;
+    uint32_t                expire;      /* seconds, 0 never expires */
+    uint16_t                key_len;
+    uint8_t                 state;
+    uint8_t                 flags;
 };
 
 struct nst_nosql_dict {
@@ -123,6 +141,7 @@ enum {
     NST_NOSQL_CTX_STATE_PASS,       /* rule passed */
     NST_NOSQL_CTX_STATE_HIT_DISK,
     NST_NOSQL_CTX_STATE_CHECK_PERSIST,
+    NST_NOSQL_CTX_STATE_BYPASS,     /* forwarded to shard owner */
 };
 
 struct nst_nosql_ctx {
@@ -134,7 +153,7 @@ struct nst_nosql_ctx {
 
     struct nst_nosql_entry   *entry;
     struct nst_nosql_data    *data;
-    struct nst_nosql_element *element;
+    struct nst_data_element  *element;
 
     struct {
         int                   scheme;
@@ -155,10 +174,29 @@ struct nst_nosql_ctx {
     uint64_t                  cache_len2;
 
     struct persist            disk;
+
+    /*
+     * The body is copied into extents of half a buffer, reserved upfront
+     * from Content-Length, and written to disk one extent at a time.
+     */
+    struct {
+        struct nst_data_element  *extent;  /* being filled */
+        struct nst_data_element  *prev;    /* element before extent */
+        uint32_t                  used;    /* bytes filled in extent */
+        char                     *stage;   /* extent of disk only rules */
+        int                       exp;     /* wait for memory expiration */
+    } ingest;
+
+    struct {
+        int                   skip;        /* sent by a primary */
+        uint64_t              seq;         /* journal record to wait for */
+        int                   exp;         /* sync wait expiration */
+        struct nst_str        uri;         /* copied, the htx one is gone */
+    } replication;
 };
 
 struct nst_nosql_stats {
-    uint64_t        used_mem;
+    uint64_t        base_mem;   /* memory used by dict and nosql itself */
 
 #if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
     pthread_mutex_t mutex;
@@ -168,6 +206,73 @@ struct nst_nosql_stats {
 
 };
 
+/*
+ * Writes and deletes are appended to a ring of journal records, which
+ * is replayed to every replica by the first worker. Record seq is
+ * stored at record[seq % size], a replica that falls more than size
+ * records behind loses the overwritten ones.
+ */
+enum {
+    NST_NOSQL_JOURNAL_SET = 1,
+    NST_NOSQL_JOURNAL_DELETE,
+};
+
+struct nst_nosql_journal_record {
+    uint64_t                seq;
+    uint64_t                hash;
+    int                     op;
+    int                     key_len;
+    int                     host_len;
+    int                     uri_len;
+    int                     failed;     /* dropped or rejected by a replica */
+    char                   *buf;        /* key, host and uri */
+};
+
+struct nst_nosql_journal {
+    uint64_t                         head;     /* seq of the last record */
+    uint64_t                         acked;    /* acked by all replicas */
+    uint64_t                         sent;
+    uint64_t                         failed;
+    uint64_t                         lost;
+    uint64_t                         lost_seq; /* last seq lost */
+    int                              size;
+    struct nst_nosql_journal_record *record;
+
+#if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
+    pthread_mutex_t                  mutex;
+#else
+    unsigned int                     waiters;
+#endif
+
+};
+
+enum {
+    NST_NOSQL_REPLICATION_APPCTX_STATE_HEADER = 0,
+    NST_NOSQL_REPLICATION_APPCTX_STATE_BODY,
+    NST_NOSQL_REPLICATION_APPCTX_STATE_STATUS,
+    NST_NOSQL_REPLICATION_APPCTX_STATE_END,
+};
+
+/*
+ * Process local, only used by the first worker
+ */
+struct nst_nosql_replica {
+    struct server            *srv;
+    uint64_t                  cursor;   /* last acked seq */
+    uint64_t                  seq;      /* seq being sent */
+    uint64_t                  hash;
+    int                       op;
+    int                       busy;
+    int                       status;   /* response status, 0 if none */
+    int                       rejected; /* could not be sent, not retried */
+    int                       retry;    /* tick of next attempt */
+    struct buffer             key;
+    struct buffer             req;      /* request line and headers */
+    struct nst_nosql_data    *data;
+    struct nst_data_element  *element;
+    uint32_t                  offset;   /* sent bytes of element */
+};
+
 struct nst_nosql {
     /* 0: using, 1: rehashing */
     struct nst_nosql_dict  dict[2];
@@ -192,14 +297,10 @@ struct nst_nosql {
 
     int                    persist_idx;
 
-    /* for disk_loader and disk_cleaner */
-    struct {
-        int                loaded;
-        int                idx;
-        DIR               *dir;
-        struct dirent     *de;
-        char              *file;
-    } disk;
+    struct nst_persist_disk disk;
+
+    /* NULL if replication is not enabled */
+    struct nst_nosql_journal *journal;
 };
 
 extern struct flt_ops  nst_nosql_filter_ops;
@@ -211,6 +312,8 @@ int nst_nosql_check_applet(struct stream *s, struct channel *req,
         struct proxy *px);
 
 struct nst_nosql_data *nst_nosql_data_new();
+struct nst_nosql_data *nst_nosql_data_copy(uint8_t *inl);
+void nst_nosql_data_release(struct nst_nosql_data *data);
 int nst_nosql_prebuild_key(struct nst_nosql_ctx *ctx, struct stream *s,
         struct http_msg *msg);
 
@@ -244,13 +347,24 @@ int nst_nosql_dict_init();
 struct nst_nosql_entry *nst_nosql_dict_get(struct buffer *key, uint64_t hash);
 struct nst_nosql_entry *nst_nosql_dict_set(struct nst_nosql_ctx *ctx);
 int nst_nosql_dict_set_from_disk(char *file, char *meta, struct buffer *key);
+struct nst_nosql_entry *nst_nosql_dict_inline(struct nst_nosql_entry *entry,
+        struct nst_str *type, uint32_t len);
 void nst_nosql_dict_rehash();
 void nst_nosql_dict_cleanup();
 
+/* replication */
+int nst_nosql_replication_init();
+int nst_nosql_replication_prepare(struct nst_nosql_ctx *ctx, struct stream *s);
+uint64_t nst_nosql_replication_append(struct nst_nosql_ctx *ctx, int op,
+        struct buffer *key);
+int nst_nosql_replicated(uint64_t seq);
+void nst_nosql_replication_dump(struct buffer *buf);
+
 /* stats */
-void nst_nosql_stats_update_used_mem(int i);
 int nst_nosql_stats_init();
 int nst_nosql_stats_full();
+uint64_t nst_nosql_stats_used_mem();
+void nst_nosql_stats_dump(struct buffer *buf);
 
 static inline int nst_nosql_dict_entry_expired(struct nst_nosql_entry *entry) {
 
@@ -262,6 +376,40 @@ static inline int nst_nosql_dict_entry_expired(struct nst_nosql_entry *entry) {
 
 }
 
+static inline char *nst_nosql_entry_key(struct nst_nosql_entry *entry) {
+    return (char *)(entry + 1);
+}
+
+static inline uint8_t *nst_nosql_entry_inline(struct nst_nosql_entry *entry) {
+    return (uint8_t *)nst_nosql_entry_key(entry) + entry->key_len;
+}
+
+static inline uint32_t
+nst_nosql_entry_value_len(struct nst_nosql_entry *entry) {
+    uint8_t *p = nst_nosql_entry_inline(entry);
+
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t nst_nosql_entry_type_len(struct nst_nosql_entry *entry) {
+    return nst_nosql_entry_inline(entry)[2];
+}
+
+static inline char *nst_nosql_entry_type(struct nst_nosql_entry *entry) {
+    return (char *)nst_nosql_entry_inline(entry)
+        + NST_NOSQL_ENTRY_INLINE_HEADER;
+}
+
+static inline char *nst_nosql_entry_value(struct nst_nosql_entry *entry) {
+    return nst_nosql_entry_type(entry) + nst_nosql_entry_type_len(entry);
+}
+
+static inline uint32_t
+nst_nosql_entry_inline_len(struct nst_nosql_entry *entry) {
+    return NST_NOSQL_ENTRY_INLINE_HEADER + nst_nosql_entry_type_len(entry)
+        + nst_nosql_entry_value_len(entry);
+}
+
 static inline int nst_nosql_entry_invalid(struct nst_nosql_entry *entry) {
 
     /* check state */
@@ -27,6 +27,7 @@
     "2017-present, Jiang Wenyuan, <koubunen AT gmail DOT com >"
 
 #include <common/chunk.h>
+#include <common/htx.h>
 #include <types/applet.h>
 #include <import/xxhash.h>
 
@@ -43,6 +44,7 @@ struct nuster {
         struct applet cache_stats;
         struct applet nosql_engine;
         struct applet cache_disk_engine;
+        struct applet nosql_replication;
     } applet;
 };
 
@@ -72,15 +74,31 @@ static inline int nuster_check_applet(struct stream *s, struct channel *req,
 
 int nst_test_rule(struct nst_rule *rule, struct stream *s, int res);
 
+int nst_trusted_source(struct stream *s, struct proxy *be);
+void nst_strip_header(struct http_msg *msg, const char *name);
+
+struct nst_rule *nst_shard_rule(struct proxy *p);
+struct server *nst_shard_owner(struct stream *s, struct http_msg *msg,
+        uint64_t hash);
+
+int nst_shard_forward(struct stream *s, struct http_msg *msg,
+        struct server *srv);
+
 static inline uint64_t nst_hash(const char *buf, size_t len) {
     return XXH64(buf, len, 0);
 }
 
+struct buffer *nst_key_scratch();
 struct buffer *nst_key_init(struct nst_memory *memory);
+struct buffer *nst_key_copy(struct nst_memory *memory, struct buffer *key);
+void nst_key_free(struct nst_memory *memory, struct buffer *key);
 int nst_key_advance(struct nst_memory *memory, struct buffer *key, int step);
 int nst_key_append(struct nst_memory *memory, struct buffer *key, char *str,
         int len);
 
+int nst_key_collect(struct htx *htx, char *query, int query_len,
+        struct nst_rule_key **pck, struct nst_key_value *vals, int max);
+
 int nst_ci_send(struct channel *chn, int len);
 
 #endif /* _NUSTER_H */
@@ -27,15 +27,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <nuster/common.h>
 
-#define NST_PERSIST_VERSION  4
+#define NST_PERSIST_VERSION  5
 
 /*
    Offset              Length(bytes)           Content
    0                   6                       NUSTER
-   6                   1                       mode: NUSTER_DISK_*, 1, 2, 3
+   6                   1                       mode: NUSTER_DISK_*, 1, 2, 3, 4
    7                   1                       version
    8 * 1               8                       hash
    8 * 2               8                       expire time
@@ -47,13 +50,21 @@
    8 * 8               8                       etag length
    8 * 9               8                       last-modified length
    8 * 10              8                       ttl: 4, extend: 4
-   8 * 11              40                      reserved
+   8 * 11              8                       checksum, v5
+   8 * 12              8                       checked length, v5
+   8 * 13              8                       tags length, v5
+   8 * 14              16                      reserved
    8 * 16              key_len                 key
    + key_len           host_len                host
    + host_len          path_len                path
    + path_len          etag_len                etag
    + etag_len          last_modified_len       last_modified
-   + last_modified_len cache_len               cache
+   + last_modified_len tags_len                tags, separated by spaces
+   + tags_len          cache_len               cache
+
+   v5 checksum is the crc32c of everything after the meta, followed by the
+   meta itself with expire and checksum zeroed, expire is updated in place.
+   Files are written to a temporary name and renamed once complete.
  */
 
 #define NST_PERSIST_META_POS_HASH               8 * 1
@@ -66,11 +77,47 @@
 #define NST_PERSIST_META_POS_ETAG_LEN           8 * 8
 #define NST_PERSIST_META_POS_LAST_MODIFIED_LEN  8 * 9
 #define NST_PERSIST_META_POS_TTL_EXTEND         8 * 10
+#define NST_PERSIST_META_POS_CHECKSUM           8 * 11
+#define NST_PERSIST_META_POS_CHECK_LEN          8 * 12
+#define NST_PERSIST_META_POS_TAGS_LEN           8 * 13
 
 
 #define NST_PERSIST_META_SIZE                   8 * 16
 #define NST_PERSIST_POS_KEY                     NST_PERSIST_META_SIZE
 
+#define NST_PERSIST_TMP_SUFFIX                  ".tmp"
+#define NST_PERSIST_TMP_SUFFIX_LEN              4
+#define NST_PERSIST_TMP_TTL                     3600 /* s, then a leftover */
+
+/* read size when verifying a checksum */
+#define NST_PERSIST_VERIFY_SIZE                 262144
+
+/* files whose checksum was checked, by hash of their path */
+#define NST_PERSIST_VERIFIED                    1024
+
+/* small writes are gathered per thread, larger ones go out with them */
+#define NST_PERSIST_BUF_SIZE                    16384
+
+/* splice size per call when tune.pipesize is not set */
+#define NST_PERSIST_SPLICE_SIZE                 65536
+
+/* bloom filter of the files on disk: counters, hashes per file */
+#define NST_PERSIST_BLOOM_SIZE                  (1 << 22)
+#define NST_PERSIST_BLOOM_HASHES                4
+#define NST_PERSIST_BLOOM_SCAN                  16   /* directories per call */
+
+#define NST_PERSIST_LOAD_BATCH                  16   /* files per dict lock */
+
+/* state of the 256 directories of the first byte of the hash */
+#define NST_PERSIST_PREFIX_SCANNED              0x01 /* in the bloom filter */
+#define NST_PERSIST_PREFIX_LOADED               0x02 /* in the disk usage */
+
+/* disk-sync */
+#define NST_PERSIST_SYNC_OFF                    0
+#define NST_PERSIST_SYNC_ON                     1    /* fdatasync each file */
+#define NST_PERSIST_SYNC_EVERY                  2    /* syncfs every n files */
+#define NST_PERSIST_SYNC_INTERVAL               3    /* syncfs every n ms */
+
 enum {
     NST_PERSIST_APPLET_ERROR   = -1,
     NST_PERSIST_APPLET_DONE    =  0,
@@ -79,11 +126,100 @@ enum {
     NST_PERSIST_APPLET_EOM,
 };
 
+/* for disk_loader and disk_cleaner */
+struct nst_persist_disk {
+    int                loaded;
+    int                idx;
+    DIR               *dir;
+    struct dirent     *de;
+    char              *file;
+    unsigned int       dirty;       /* files written since the last sync */
+    uint64_t           synced;      /* time of the last sync, in ms */
+    uint64_t           syncs;
+
+    /* files written or loaded, less the ones removed */
+    int64_t            used;        /* bytes */
+    int64_t            files;
+    uint64_t           evicted;     /* files removed by disk-size */
+    uint64_t           errors;      /* files which could not be written */
+    uint64_t           unlinked;    /* files removed, to check open ones */
+
+    /* files are never rewritten, each one is checked once */
+    uint64_t           verified[NST_PERSIST_VERIFIED];
+
+    /* counting bloom filter of the hashes on disk, of the prefixes scanned */
+    uint8_t           *bloom;
+    int                bloom_idx;     /* next prefix to scan */
+    int                bloom_scanned;
+    uint64_t           bloom_skipped; /* misses which skipped the disk */
+
+    /* loader progress */
+    uint8_t            prefix[16 * 16]; /* NST_PERSIST_PREFIX_* */
+    int                load_dirs;     /* prefixes loaded */
+    uint64_t           load_files;    /* files read */
+    uint64_t           load_entries;  /* files added to the dict */
+    uint64_t           load_errors;   /* files which could not be read */
+    uint64_t           load_window;   /* second << 32 | files read in it */
+    DIR               *load_dir;      /* hash directory left at the rate */
+    char               load_path[PATH_MAX];
+
+    struct nst_persist_loader *loader; /* disk-loader-threads, in master */
+};
+
+/*
+ * A file read by the loader, the key, host and path are allocated by the
+ * engine and owned by the dict once added. key is NULL if not to be added.
+ */
+struct nst_persist_item {
+    char               file[PATH_MAX];
+    char               meta[NST_PERSIST_META_SIZE];
+    struct buffer     *key;
+    struct nst_str     host;
+    struct nst_str     path;
+    struct nst_str     tags;
+};
+
+/* reads a file opened by the loader, adds a batch of them to the dict */
+struct nst_persist_loader_ops {
+    int              (*read)(struct nst_persist_item *item, int fd);
+    int              (*add)(struct nst_persist_item *item, int n);
+};
+
+struct nst_persist_loader {
+    char                          *root;
+    struct nst_persist_disk       *disk;
+    struct nst_persist_loader_ops *ops;
+    int                            rate;
+    int                            running;
+    int                            threads;
+    pthread_t                      thread[0];
+};
+
+/*
+ * A file kept open by disk-fds, per thread. The meta and key were checked
+ * when it was opened, later hits on the same file skip it.
+ */
+struct nst_persist_file {
+    char     *file;
+    char     *addr;         /* the file mapped by disk-mmap, or NULL */
+    uint64_t  size;
+    uint64_t  hash;
+    uint64_t  stamp;        /* last hit, the lowest is replaced first */
+    uint64_t  unlinked;     /* nst_persist_disk.unlinked when checked */
+    int       fd;
+    int       users;        /* hits being served from it */
+    char      meta[NST_PERSIST_META_SIZE];
+};
+
 struct persist {
-    char *file;             /* cache file */
-    int   fd;
-    int   offset;
-    char  meta[NST_PERSIST_META_SIZE];
+    char     *file;         /* cache file */
+    int       fd;           /* owned by cached if set */
+    struct nst_persist_file *cached;
+    int       offset;
+    uint32_t  crc;          /* of what was written after the meta */
+    uint64_t  crc_len;
+    int       error;        /* a write failed */
+    char      meta[NST_PERSIST_META_SIZE];
 };
 
 /* /0/00: 5 */
@@ -104,9 +240,29 @@ static inline int nst_persist_path_file_len(char *root) {
 int nst_persist_mkdir(char *path);
 int nst_persist_init(char *root, char *path, uint64_t hash);
 
-static inline int nst_persist_create(const char *pathname) {
-    return open(pathname, O_CREAT | O_WRONLY, 0600);
-}
+/* name.tmp, being written or left by a crash */
+static inline int nst_persist_is_tmp(const char *name) {
+    int len = strlen(name);
+
+    return len > NST_PERSIST_TMP_SUFFIX_LEN
+        && !memcmp(name + len - NST_PERSIST_TMP_SUFFIX_LEN,
+                NST_PERSIST_TMP_SUFFIX, NST_PERSIST_TMP_SUFFIX_LEN);
+}
+
+int nst_persist_create(struct persist *disk);
+int nst_persist_write(struct persist *disk, char *buf, int len);
+int nst_persist_flush(struct persist *disk);
+int nst_persist_write_meta(struct persist *disk);
+int nst_persist_commit(struct persist *disk, struct nst_persist_disk *shared,
+        int sync);
+int nst_persist_verify(struct persist *disk, struct nst_persist_disk *shared);
+int nst_persist_unlink(struct nst_persist_disk *shared, const char *path);
+int nst_persist_bloom_init(struct nst_persist_disk *shared);
+int nst_persist_bloom_miss(struct nst_persist_disk *shared, uint64_t hash);
+void nst_persist_stats_dump(struct buffer *buf,
+        struct nst_persist_disk *shared, const char *name);
+void nst_persist_sync(char *root, struct nst_persist_disk *shared, int sync,
+        unsigned int value);
 
 static inline int nst_persist_open(const char *pathname) {
     return open(pathname, O_RDONLY);
@@ -116,6 +272,10 @@ static inline void nst_persist_meta_set_hash(char *p, uint64_t v) {
     *(uint64_t *)(p + NST_PERSIST_META_POS_HASH) = v;
 }
 
+static inline int nst_persist_meta_get_mode(char *p) {
+    return p[6];
+}
+
 static inline uint64_t nst_persist_meta_get_hash(char *p) {
     return *(uint64_t *)(p + NST_PERSIST_META_POS_HASH);
 }
@@ -206,12 +366,37 @@ static inline uint64_t nst_persist_meta_get_ttl_extend(char *p) {
     return *(uint64_t *)(p + NST_PERSIST_META_POS_TTL_EXTEND);
 }
 
+static inline void nst_persist_meta_set_checksum(char *p, uint64_t v) {
+    *(uint64_t *)(p + NST_PERSIST_META_POS_CHECKSUM) = v;
+}
+
+static inline uint64_t nst_persist_meta_get_checksum(char *p) {
+    return *(uint64_t *)(p + NST_PERSIST_META_POS_CHECKSUM);
+}
+
+static inline void nst_persist_meta_set_check_len(char *p, uint64_t v) {
+    *(uint64_t *)(p + NST_PERSIST_META_POS_CHECK_LEN) = v;
+}
+
+static inline uint64_t nst_persist_meta_get_check_len(char *p) {
+    return *(uint64_t *)(p + NST_PERSIST_META_POS_CHECK_LEN);
+}
+
+static inline void nst_persist_meta_set_tags_len(char *p, uint64_t v) {
+    *(uint64_t *)(p + NST_PERSIST_META_POS_TAGS_LEN) = v;
+}
+
+static inline uint64_t nst_persist_meta_get_tags_len(char *p) {
+    return *(uint64_t *)(p + NST_PERSIST_META_POS_TAGS_LEN);
+}
+
 static inline int nst_persist_get_header_pos(char *p) {
     return (int)(NST_PERSIST_META_SIZE + nst_persist_meta_get_key_len(p)
             + nst_persist_meta_get_host_len(p)
             + nst_persist_meta_get_path_len(p)
             + nst_persist_meta_get_etag_len(p)
-            + nst_persist_meta_get_last_modified_len(p));
+            + nst_persist_meta_get_last_modified_len(p)
+            + nst_persist_meta_get_tags_len(p));
 }
 
 static inline void
@@ -220,6 +405,7 @@ nst_persist_meta_init(char *p, char mode, uint64_t hash, uint64_t expire,
         uint64_t host_len, uint64_t path_len, uint64_t etag_len,
         uint64_t last_modified_len, uint64_t ttl_extend) {
 
+    memset(p, 0, NST_PERSIST_META_SIZE);
     memcpy(p, "NUSTER", 6);
     p[6] = mode;
     p[7] = (char)NST_PERSIST_VERSION;
@@ -237,24 +423,7 @@ nst_persist_meta_init(char *p, char mode, uint64_t hash, uint64_t expire,
 }
 
 int nst_persist_exists(char *root, struct persist *disk, struct buffer *key,
-        uint64_t hash);
-
-static inline int nst_persist_write(struct persist *disk, char *buf, int len) {
-    ssize_t ret = pwrite(disk->fd, buf, len, disk->offset);
-
-    if(ret != len) {
-        return NST_ERR;
-    }
-
-    disk->offset += len;
-
-    return NST_OK;
-}
-
-static inline int nst_persist_write_meta(struct persist *disk) {
-    disk->offset = 0;
-    return nst_persist_write(disk, disk->meta, NST_PERSIST_META_SIZE);
-}
+        uint64_t hash, struct nst_persist_disk *shared);
 
 static inline int
 nst_persist_write_key(struct persist *disk, struct buffer *key) {
@@ -305,7 +474,22 @@ nst_persist_write_last_modified(struct persist *disk, struct nst_str *lm) {
     return nst_persist_write(disk, lm->data, lm->len);
 }
 
-void nst_persist_load(char *path, struct dirent *de1, char **meta, char **key);
+static inline int
+nst_persist_write_tags(struct persist *disk, char *tags, int len) {
+
+    disk->offset = NST_PERSIST_POS_KEY
+        + nst_persist_meta_get_key_len(disk->meta)
+        + nst_persist_meta_get_host_len(disk->meta)
+        + nst_persist_meta_get_path_len(disk->meta)
+        + nst_persist_meta_get_etag_len(disk->meta)
+        + nst_persist_meta_get_last_modified_len(disk->meta);
+
+    return nst_persist_write(disk, tags, len);
+}
+
+void nst_persist_disk_load(char *root, struct nst_persist_disk *disk,
+        struct nst_persist_loader_ops *ops, int threads, int rate);
+void nst_persist_disk_cleanup(char *root, struct nst_persist_disk *disk);
 int nst_persist_get_meta(int fd, char *meta);
 int nst_persist_get_key(int fd, char *meta, struct buffer *key);
 int nst_persist_get_host(int fd, char *meta, struct nst_str *host);
@@ -313,14 +497,19 @@ int nst_persist_get_path(int fd, char *meta, struct nst_str *path);
 int nst_persist_get_etag(int fd, char *meta, struct nst_str *etag);
 int nst_persist_get_last_modified(int fd, char *meta,
         struct nst_str *last_modified);
+int nst_persist_get_tags(int fd, char *meta, struct nst_str *tags);
 
 DIR *nst_persist_opendir_by_idx(char *root, char *path, int idx);
-void nst_persist_cleanup(char *root, char *path, struct dirent *de);
+void nst_persist_cleanup(char *root, char *path, struct dirent *de,
+        struct nst_persist_disk *shared);
 struct dirent *nst_persist_dir_next(DIR *dir);
 int nst_persist_valid(struct persist *disk, struct buffer *key, uint64_t hash);
+int nst_persist_file_get(struct persist *disk, struct buffer *key,
+        uint64_t hash, int verify, struct nst_persist_disk *shared);
+void nst_persist_file_put(struct nst_persist_file *file);
 int nst_persist_purge_by_key(char *root, struct persist *disk,
-        struct buffer *key, uint64_t hash);
-int nst_persist_purge_by_path(char *path);
+        struct buffer *key, uint64_t hash, struct nst_persist_disk *shared);
+int nst_persist_purge_by_path(char *path, struct nst_persist_disk *shared);
 void nst_persist_update_expire(char *file, uint64_t expire);
 
 #endif /* _NUSTER_PERSIST_H */
@@ -81,26 +81,36 @@ struct appctx {
 			struct {
 				struct nst_cache_entry   *entry;
 				struct nst_cache_data    *data;
-				struct nst_cache_element *element;
+				struct nst_data_element  *element;
 			} cache_engine;
 			struct {
 				struct nst_str   host;
 				struct nst_str   path;
 				struct my_regex *regex;
+				struct nst_cache_entry *cursor;
+				uint64_t         hash;
+				struct nst_str   tag;
+				struct nst_cache_tag *tag_cursor;
 			} cache_manager;
 			struct {
 				struct nst_nosql_entry   *entry;
 				struct nst_nosql_data    *data;
-				struct nst_nosql_element *element;
+				struct nst_data_element  *element;
 				int fd;
 				int header_len;
 				uint64_t offset;
+				int splice;
 			} nosql_engine;
 			struct {
 				int fd;
 				int header_len;
 				uint64_t offset;
+				int splice;
+				struct nst_persist_file *cached;
 			} cache_disk_engine;
+			struct {
+				struct nst_nosql_replica *replica;
+			} nosql_replication;
 		} nuster;
 		struct {
 			void *ptr;              /* current peer or NULL, do not use for something else */
@@ -81,6 +81,14 @@ enum {
 	SSL_SERVER_VERIFY_REQUIRED = 1,
 };
 
+/* backing of a nuster memory zone, see nst_memory_create() */
+struct nst_memory_conf {
+	int           hugepage;                /* off, on or thp */
+	int           prefault;                /* touch every page at startup */
+	int           numa;                    /* default, bind or interleave */
+	unsigned long nodes;                   /* numa nodes mask */
+};
+
 /* FIXME : this will have to be redefined correctly */
 struct global {
 	int uid;
@@ -183,14 +191,25 @@ struct global {
 			char     *root;                        /* persist root directory */
 			uint64_t  data_size;                   /* max memory used by data, in bytes */
 			uint64_t  dict_size;                   /* max memory used by dict, in bytes */
+			uint64_t  disk_size;                   /* max size of the files under root, 0: unlimited */
 			int       share;
 			char     *purge_method;
 			char     *uri;                         /* the uri used for stats and manager */
+			char     *tag_header;                  /* response header listing the tags, NULL: off */
 			int       dict_cleaner;                /* the number of entries checked once */
 			int       data_cleaner;                /* the number of data checked once */
 			int       disk_cleaner;                /* the number of files checked once */
 			int       disk_loader;                 /* the number of files load once */
+			int       disk_loader_threads;         /* the number of loader threads, 0: off */
+			int       disk_loader_rate;            /* the number of files loaded per second, 0: unlimited */
 			int       disk_saver;                  /* the number of entries checked once for persist_async */
+			int       defragger;                   /* the number of entries defragmented once, 0: off */
+			int       disk_fds;                    /* the number of files kept open per thread, 0: off */
+			int       disk_mmap;                   /* map the files kept open */
+			int       tier;                        /* a rule uses disk tier */
+			int       disk_sync;                   /* NST_PERSIST_SYNC_* */
+			unsigned  disk_sync_value;             /* files or ms between two syncs */
+			struct nst_memory_conf zone;           /* memory zone backing */
 
 			struct {
 				struct pool_head *stash;
@@ -213,7 +232,16 @@ struct global {
 			int       data_cleaner;                /* the number of data checked once */
 			int       disk_cleaner;                /* the number of files checked once */
 			int       disk_loader;                 /* the number of files load once */
+			int       disk_loader_threads;         /* the number of loader threads, 0: off */
+			int       disk_loader_rate;            /* the number of files loaded per second, 0: unlimited */
 			int       disk_saver;                  /* the number of entries checked once for persist_async */
+			int       disk_sync;                   /* NST_PERSIST_SYNC_* */
+			unsigned  disk_sync_value;             /* files or ms between two syncs */
+			char     *replication;                 /* backend of replicas */
+			int       replication_mode;            /* async or sync */
+			int       replication_journal;         /* the number of journal records */
+			int       replication_timeout;         /* sync wait, in ms */
+			struct nst_memory_conf zone;           /* memory zone backing */
 
 			struct {
 				struct pool_head *stash;
@@ -490,6 +490,11 @@ struct proxy {
 	struct {
 		int mode;
 		struct list rules;              /* nuster rules */
+		struct {
+			char *name;             /* backend of all nodes, hash-type consistent */
+			struct proxy *be;
+			struct server *self;    /* server named after global.node */
+		} shard;
 	} nuster;
 	__decl_hathreads(HA_SPINLOCK_T lock);   /* may be taken under the server's lock */
 };
@@ -211,6 +211,8 @@ struct global global = {
 			.disk_cleaner = NST_DEFAULT_DISK_CLEANER,
 			.disk_loader  = NST_DEFAULT_DISK_LOADER,
 			.disk_saver   = NST_DEFAULT_DISK_SAVER,
+			.replication_journal = NST_DEFAULT_REPLICATION_JOURNAL,
+			.replication_timeout = NST_DEFAULT_REPLICATION_TIMEOUT,
 		},
 	},
 	/* others NULL OK */
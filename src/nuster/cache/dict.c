@@ -51,42 +51,294 @@ static int _nst_cache_dict_resize(uint64_t size) {
 static int _nst_cache_dict_alloc(uint64_t size) {
     int i;
     int entry_size = sizeof(struct nst_cache_entry*);
-    int block_size = global.nuster.cache.memory->block_size;
 
     nuster.cache->dict[0].size  = size / entry_size;
     nuster.cache->dict[0].used  = 0;
-    nuster.cache->dict[0].entry = nst_cache_memory_alloc(block_size);
+    nuster.cache->dict[0].entry = nst_cache_memory_alloc(size);
 
     if(!nuster.cache->dict[0].entry) {
         return NST_ERR;
     }
 
-    for(i = 1; i < size / block_size; i++) {
+    for(i = 0; i < nuster.cache->dict[0].size; i++) {
+        nuster.cache->dict[0].entry[i] = NULL;
+    }
+
+    return nst_shctx_init((&nuster.cache->dict[0]));
+}
+
+/*
+ * The path index has as many buckets as the dict, hosts and rules are far
+ * fewer than entries
+ */
+static int _nst_cache_index_init() {
+    int i, j;
+
+    for(i = 0; i < NST_CACHE_INDEX_MAX; i++) {
+        uint64_t size = nuster.cache->dict[0].size;
+
+        if(i != NST_CACHE_INDEX_PATH && size > NST_CACHE_INDEX_SIZE) {
+            size = NST_CACHE_INDEX_SIZE;
+        }
 
-        if(!nst_cache_memory_alloc(block_size)) {
+        nuster.cache->index[i] = nst_cache_memory_alloc(
+                size * sizeof(struct nst_cache_entry *));
+
+        if(!nuster.cache->index[i]) {
             return NST_ERR;
         }
+
+        for(j = 0; j < size; j++) {
+            nuster.cache->index[i][j] = NULL;
+        }
+
+        nuster.cache->index_size[i] = size;
     }
 
-    for(i = 0; i < nuster.cache->dict[0].size; i++) {
-        nuster.cache->dict[0].entry[i] = NULL;
+    nuster.cache->tag_size = nuster.cache->dict[0].size;
+    nuster.cache->tag      = nst_cache_memory_alloc(
+            nuster.cache->tag_size * sizeof(struct nst_cache_tag *));
+
+    if(!nuster.cache->tag) {
+        return NST_ERR;
     }
 
-    return nst_shctx_init((&nuster.cache->dict[0]));
+    for(j = 0; j < nuster.cache->tag_size; j++) {
+        nuster.cache->tag[j] = NULL;
+    }
+
+    return NST_OK;
 }
 
 int nst_cache_dict_init() {
+    int ret;
 
     if(global.nuster.cache.share) {
         int block_size = global.nuster.cache.memory->block_size;
         int dict_size = global.nuster.cache.dict_size;
         int size = (block_size + dict_size - 1) / block_size * block_size;
 
-        return _nst_cache_dict_alloc(size);
+        ret = _nst_cache_dict_alloc(size);
     } else {
-        return _nst_cache_dict_resize(NST_DEFAULT_DICT_SIZE);
+        ret = _nst_cache_dict_resize(NST_DEFAULT_DICT_SIZE);
+    }
+
+    if(ret != NST_OK) {
+        return ret;
+    }
+
+    return _nst_cache_index_init();
+}
+
+static int _nst_cache_index_has(struct nst_cache_entry *entry, int type) {
+
+    switch(type) {
+        case NST_CACHE_INDEX_HOST:
+            return entry->host.data != NULL;
+        case NST_CACHE_INDEX_PATH:
+            return entry->path.data != NULL;
+        default:
+            return entry->rule != NULL;
     }
+}
 
+static uint64_t _nst_cache_index_hash(struct nst_cache_entry *entry, int type) {
+
+    switch(type) {
+        case NST_CACHE_INDEX_HOST:
+            return nst_hash(entry->host.data, entry->host.len);
+        case NST_CACHE_INDEX_PATH:
+            return nst_hash(entry->path.data, entry->path.len);
+        default:
+            return entry->rule->id;
+    }
+}
+
+static struct nst_cache_entry **_nst_cache_index_head(int type, uint64_t hash) {
+    return &nuster.cache->index[type][hash % nuster.cache->index_size[type]];
+}
+
+/*
+ * Get the first entry of the index bucket of hash, the host or path hash is
+ * nst_hash() of the host or path, the rule hash is the rule id.
+ * Entries are linked through entry->index[type].
+ */
+struct nst_cache_entry *nst_cache_index_first(int type, uint64_t hash) {
+    return *_nst_cache_index_head(type, hash);
+}
+
+static void _nst_cache_index_add(struct nst_cache_entry *entry) {
+    int i;
+
+    for(i = 0; i < NST_CACHE_INDEX_MAX; i++) {
+        struct nst_cache_entry **head;
+
+        entry->index[i].next = NULL;
+        entry->index[i].prev = NULL;
+
+        if(!_nst_cache_index_has(entry, i)) {
+            continue;
+        }
+
+        head = _nst_cache_index_head(i, _nst_cache_index_hash(entry, i));
+
+        if(*head) {
+            (*head)->index[i].prev = entry;
+        }
+
+        entry->index[i].next = *head;
+        *head = entry;
+    }
+}
+
+static void _nst_cache_index_remove(struct nst_cache_entry *entry) {
+    int i;
+
+    for(i = 0; i < NST_CACHE_INDEX_MAX; i++) {
+
+        if(!_nst_cache_index_has(entry, i)) {
+            continue;
+        }
+
+        if(entry->index[i].prev) {
+            entry->index[i].prev->index[i].next = entry->index[i].next;
+        } else {
+            *_nst_cache_index_head(i, _nst_cache_index_hash(entry, i)) =
+                entry->index[i].next;
+        }
+
+        if(entry->index[i].next) {
+            entry->index[i].next->index[i].prev = entry->index[i].prev;
+        }
+    }
+}
+
+static void _nst_cache_tag_unlink(struct nst_cache_tag *tag) {
+
+    if(tag->prev) {
+        tag->prev->next = tag->next;
+    } else {
+        nuster.cache->tag[tag->hash % nuster.cache->tag_size] = tag->next;
+    }
+
+    if(tag->next) {
+        tag->next->prev = tag->prev;
+    }
+
+    nst_cache_memory_free(tag);
+}
+
+/*
+ * Remove the tags of entry, a tag a purge resumes from stays in its bucket
+ * without entry until the purge unpins it
+ */
+static void _nst_cache_tag_drop(struct nst_cache_entry *entry) {
+    struct nst_cache_tag *tag = entry->tags;
+
+    while(tag) {
+        struct nst_cache_tag *sibling = tag->sibling;
+
+        if(tag->pinned) {
+            tag->entry = NULL;
+        } else {
+            _nst_cache_tag_unlink(tag);
+        }
+
+        tag = sibling;
+    }
+
+    entry->tags = NULL;
+}
+
+/*
+ * Replace the tags of entry, tags that do not fit in memory are skipped
+ */
+void nst_cache_tag_set(struct nst_cache_entry *entry, struct ist *tags,
+        int count) {
+
+    int i;
+
+    _nst_cache_tag_drop(entry);
+
+    for(i = 0; i < count; i++) {
+        struct nst_cache_tag **head;
+        struct nst_cache_tag *tag;
+
+        tag = nst_cache_memory_alloc(sizeof(*tag) + tags[i].len);
+
+        if(!tag) {
+            break;
+        }
+
+        memcpy(tag->data, tags[i].ptr, tags[i].len);
+
+        tag->len     = tags[i].len;
+        tag->hash    = nst_hash(tag->data, tag->len);
+        tag->entry   = entry;
+        tag->pinned  = 0;
+        tag->prev    = NULL;
+        tag->sibling = entry->tags;
+        entry->tags  = tag;
+
+        head = &nuster.cache->tag[tag->hash % nuster.cache->tag_size];
+
+        if(*head) {
+            (*head)->prev = tag;
+        }
+
+        tag->next = *head;
+        *head     = tag;
+    }
+}
+
+/*
+ * Add the tags separated by spaces in p up to end to the count tags already
+ * in tags, returns the new count, at most NST_CACHE_TAGS
+ */
+int nst_cache_tag_parse(char *p, char *end, struct ist *tags, int count) {
+
+    while(p < end && count < NST_CACHE_TAGS) {
+        char *q;
+
+        while(p < end && HTTP_IS_LWS(*p)) {
+            p++;
+        }
+
+        q = p;
+
+        while(q < end && !HTTP_IS_LWS(*q)) {
+            q++;
+        }
+
+        if(q > p) {
+            tags[count++] = ist2(p, q - p);
+        }
+
+        p = q;
+    }
+
+    return count;
+}
+
+struct nst_cache_tag *nst_cache_tag_first(uint64_t hash) {
+    return nuster.cache->tag[hash % nuster.cache->tag_size];
+}
+
+/*
+ * Release the pin of a purge on tag, return the tag to resume from
+ */
+struct nst_cache_tag *nst_cache_tag_unpin(struct nst_cache_tag *tag) {
+    struct nst_cache_tag *next = tag->next;
+
+    tag->pinned--;
+
+    if(tag->entry || tag->pinned) {
+        return tag;
+    }
+
+    _nst_cache_tag_unlink(tag);
+
+    return next;
 }
 
 static int _nst_cache_dict_rehashing() {
@@ -180,7 +432,21 @@ void nst_cache_dict_cleanup() {
 
     while(entry) {
 
-        if(nst_cache_entry_invalid(entry)) {
+        /* keep disk only entries as the index of their files */
+        if(entry->state == NST_CACHE_ENTRY_STATE_INVALID && entry->file
+                && !nst_cache_entry_expired(entry)) {
+
+            if(entry->data) {
+                entry->data->invalid = 1;
+                entry->data          = NULL;
+            }
+
+            prev  = entry;
+            entry = entry->next;
+            continue;
+        }
+
+        if(nst_cache_entry_invalid(entry) && !entry->pinned) {
             struct nst_cache_entry *tmp = entry;
 
             if(entry->data) {
@@ -196,6 +462,8 @@ void nst_cache_dict_cleanup() {
             }
 
             entry = entry->next;
+            _nst_cache_index_remove(tmp);
+            _nst_cache_tag_drop(tmp);
             nst_cache_memory_free(tmp->key->area);
             nst_cache_memory_free(tmp->key);
             nst_cache_memory_free(tmp->host.data);
@@ -218,6 +486,55 @@ void nst_cache_dict_cleanup() {
 
 }
 
+/*
+ * Move the data of the entries in one bucket out of sparse memory blocks.
+ * Only data nobody is reading, new readers wait for the dict lock.
+ */
+void nst_cache_dict_defrag() {
+    struct nst_cache_entry *entry =
+        nuster.cache->dict[0].entry[nuster.cache->defrag_idx];
+
+    while(entry) {
+
+        if(entry->state == NST_CACHE_ENTRY_STATE_VALID && entry->data
+                && !entry->data->clients) {
+
+            struct nst_data_element **link = &entry->data->element;
+            struct nst_data_element *element;
+            char *data;
+
+            while(*link) {
+                element = nst_memory_defrag(global.nuster.cache.memory, *link);
+
+                if(element) {
+                    *link = element;
+                }
+
+                element = *link;
+
+                if(element->msg.data) {
+                    data = nst_memory_defrag(global.nuster.cache.memory,
+                            element->msg.data);
+
+                    if(data) {
+                        element->msg.data = data;
+                    }
+                }
+
+                link = &element->next;
+            }
+        }
+
+        entry = entry->next;
+    }
+
+    nuster.cache->defrag_idx++;
+
+    if(nuster.cache->defrag_idx == nuster.cache->dict[0].size) {
+        nuster.cache->defrag_idx = 0;
+    }
+}
+
 /*
  * Add a new nst_cache_entry to cache_dict
  */
@@ -238,10 +555,19 @@ struct nst_cache_entry *nst_cache_dict_set(struct nst_cache_ctx *ctx) {
 
     memset(entry, 0, sizeof(*entry));
 
+    /* the request key only lives in local memory until now */
+    entry->key = nst_key_copy(global.nuster.cache.memory, ctx->key);
+
+    if(!entry->key) {
+        nst_cache_memory_free(entry);
+        return NULL;
+    }
+
     if(ctx->rule->disk != NST_DISK_ONLY) {
         data = nst_cache_data_new();
 
         if(!data) {
+            nst_key_free(global.nuster.cache.memory, entry->key);
             nst_cache_memory_free(entry);
             return NULL;
         }
@@ -256,14 +582,13 @@ struct nst_cache_entry *nst_cache_dict_set(struct nst_cache_ctx *ctx) {
     /* init entry */
     entry->data   = data;
     entry->state  = NST_CACHE_ENTRY_STATE_CREATING;
-    entry->key    = ctx->key;
-    ctx->key      = NULL;
     entry->hash   = ctx->hash;
     entry->expire = 0;
     entry->rule   = ctx->rule;
     entry->pid    = ctx->pid;
     entry->file   = NULL;
     entry->ttl    = *ctx->rule->ttl;
+    entry->tier   = (ctx->rule->disk == NST_DISK_TIER);
 
     entry->extend[0] = ctx->rule->extend[0];
     entry->extend[1] = ctx->rule->extend[1];
@@ -288,12 +613,39 @@ struct nst_cache_entry *nst_cache_dict_set(struct nst_cache_ctx *ctx) {
     entry->last_modified.len    = ctx->res.last_modified.len;
     ctx->res.last_modified.data = NULL;
 
+    _nst_cache_index_add(entry);
+
     return entry;
 }
 
 /*
  * Get entry
  */
+/*
+ * Queue the expire update of a persisted entry, an entry is queued once
+ * however many times it is extended before the housekeeping writes it
+ */
+static void _nst_cache_journal_append(struct nst_cache_entry *entry) {
+    struct nst_cache_journal *journal = &nuster.cache->journal;
+
+    if(entry->journaled) {
+        return;
+    }
+
+    if(journal->count == NST_CACHE_JOURNAL_SIZE) {
+        journal->dropped++;
+        return;
+    }
+
+    journal->entry[(journal->head + journal->count) % NST_CACHE_JOURNAL_SIZE] =
+        entry;
+
+    journal->count++;
+
+    entry->journaled = 1;
+    entry->pinned++;
+}
+
 struct nst_cache_entry *nst_cache_dict_get(struct buffer *key, uint64_t hash) {
     int i, idx;
     struct nst_cache_entry *entry = NULL;
@@ -334,7 +686,7 @@ struct nst_cache_entry *nst_cache_dict_get(struct buffer *key, uint64_t hash) {
                     entry->extended  += 1;
 
                     if(entry->file) {
-                        nst_persist_update_expire(entry->file, entry->expire);
+                        _nst_cache_journal_append(entry);
                     }
 
                     expired = 0;
@@ -373,10 +725,11 @@ struct nst_cache_entry *nst_cache_dict_get(struct buffer *key, uint64_t hash) {
 }
 
 int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
-        struct nst_str *host, struct nst_str *path) {
+        struct nst_str *host, struct nst_str *path, struct nst_str *tags) {
 
     struct nst_cache_dict  *dict  = NULL;
     struct nst_cache_entry *entry = NULL;
+    struct ist list[NST_CACHE_TAGS];
     int idx;
     uint64_t hash = nst_persist_meta_get_hash(meta);
 
@@ -393,9 +746,10 @@ int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
 
     memset(entry, 0, sizeof(*entry));
 
-    entry->file = nst_cache_memory_alloc(strlen(file));
+    entry->file = nst_cache_memory_alloc(strlen(file) + 1);
 
     if(!entry->file) {
+        nst_cache_memory_free(entry);
         return NST_ERR;
     }
 
@@ -410,7 +764,8 @@ int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
     entry->key    = key;
     entry->hash   = hash;
     entry->expire = nst_persist_meta_get_expire(meta);
-    memcpy(entry->file, file, strlen(file));
+    entry->tier   = (nst_persist_meta_get_mode(meta) == NST_DISK_TIER);
+    memcpy(entry->file, file, strlen(file) + 1);
 
     entry->header_len = nst_persist_meta_get_header_len(meta);
 
@@ -427,6 +782,11 @@ int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
 
     entry->ttl = ttl_extend >> 32;
 
+    _nst_cache_index_add(entry);
+
+    nst_cache_tag_set(entry, list,
+            nst_cache_tag_parse(tags->data, tags->data + tags->len, list, 0));
+
     return NST_OK;
 }
 
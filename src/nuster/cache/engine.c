@@ -31,50 +31,46 @@
 #include <nuster/persist.h>
 
 /*
- * The cache applet acts like the backend to send cached http data
+ * Drop a reference taken by nst_cache_exists, the housekeeping frees invalid
+ * data once no client is left
  */
-static int _nst_cache_element_to_htx(struct nst_cache_element *element,
-        struct htx *htx) {
-
-    struct htx_blk *blk;
-    char *ptr;
-    uint32_t blksz, sz, info;
-    enum htx_blk_type type;
+void nst_cache_data_release(struct nst_cache_data *data) {
+    nst_shctx_lock(&nuster.cache->dict[0]);
+    data->clients--;
+    nst_shctx_unlock(&nuster.cache->dict[0]);
+}
 
-    info = element->msg.len;
-    type = (info >> 28);
-    blksz = ((type == HTX_BLK_HDR || type == HTX_BLK_TLR)
-            ? (info & 0xff) + ((info >> 8) & 0xfffff)
-            : info & 0xfffffff);
+/*
+ * The applet releases its reference exactly once, whichever of the end of
+ * message, the disconnection or the release callback comes first
+ */
+static void _nst_cache_engine_release_data(struct appctx *appctx) {
 
-    blk = htx_add_blk(htx, type, blksz);
+    if(appctx->ctx.nuster.cache_engine.data) {
+        nst_cache_data_release(appctx->ctx.nuster.cache_engine.data);
 
-    if(!blk) {
-        return NST_ERR;
+        appctx->ctx.nuster.cache_engine.data    = NULL;
+        appctx->ctx.nuster.cache_engine.element = NULL;
     }
-
-    blk->info = info;
-    ptr = htx_get_blk_ptr(htx, blk);
-    sz = htx_get_blksz(blk);
-    memcpy(ptr, element->msg.data, sz);
-
-    return NST_OK;
 }
 
+/*
+ * The cache applet acts like the backend to send cached http data
+ */
 static void nst_cache_engine_handler(struct appctx *appctx) {
     struct stream_interface *si = appctx->owner;
     struct channel *req = si_oc(si);
     struct channel *res = si_ic(si);
     struct htx *req_htx, *res_htx;
     struct buffer *errmsg;
-    struct nst_cache_element *element = NULL;
+    struct nst_data_element *element = NULL;
     int total = 0;
 
     res_htx = htxbuf(&res->buf);
     total = res_htx->data;
 
     if(unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO)) {
-        appctx->ctx.nuster.cache_engine.data->clients--;
+        _nst_cache_engine_release_data(appctx);
         goto err;
     }
 
@@ -92,7 +88,7 @@ static void nst_cache_engine_handler(struct appctx *appctx) {
         element = appctx->ctx.nuster.cache_engine.element;
 
         while(element) {
-            if(_nst_cache_element_to_htx(element, res_htx) != NST_OK) {
+            if(nst_data_element_to_htx(element, res_htx) != NST_OK) {
                 si_rx_room_blk(si);
                 goto out;
             }
@@ -101,14 +97,14 @@ static void nst_cache_engine_handler(struct appctx *appctx) {
 
         }
 
-    } else {
+    } else if(appctx->ctx.nuster.cache_engine.data) {
 
         if (!htx_add_endof(res_htx, HTX_BLK_EOM)) {
             si_rx_room_blk(si);
             goto out;
         }
 
-        appctx->ctx.nuster.cache_engine.data->clients--;
+        _nst_cache_engine_release_data(appctx);
 
         if (!(res->flags & CF_SHUTR) ) {
             res->flags |= CF_READ_NULL;
@@ -141,22 +137,31 @@ err:
     total = 0;
 }
 
+static void nst_cache_engine_release_handler(struct appctx *appctx) {
+    _nst_cache_engine_release_data(appctx);
+}
+
+static void nst_cache_disk_engine_release_handler(struct appctx *appctx) {
+
+    if(appctx->ctx.nuster.cache_disk_engine.cached) {
+        nst_persist_file_put(appctx->ctx.nuster.cache_disk_engine.cached);
+        appctx->ctx.nuster.cache_disk_engine.cached = NULL;
+    } else if(appctx->st0 == NST_PERSIST_APPLET_HEADER
+            || appctx->st0 == NST_PERSIST_APPLET_PAYLOAD) {
+
+        /* released before the file was sent */
+        close(appctx->ctx.nuster.cache_disk_engine.fd);
+    }
+}
+
 /*
  * The cache disk applet acts like the backend to send cached http data
  */
 static void nst_cache_disk_engine_handler(struct appctx *appctx) {
     struct stream_interface *si = appctx->owner;
-
-    struct channel *req = si_oc(si);
     struct channel *res = si_ic(si);
-    struct htx *req_htx, *res_htx;
+    struct htx *res_htx;
     int total = 0;
-    int ret;
-    int max;
-
-    int fd = appctx->ctx.nuster.cache_disk_engine.fd;
-    int header_len = appctx->ctx.nuster.cache_disk_engine.header_len;
-    uint64_t offset = appctx->ctx.nuster.cache_disk_engine.offset;
 
     res_htx = htxbuf(&res->buf);
     total = res_htx->data;
@@ -171,127 +176,20 @@ static void nst_cache_disk_engine_handler(struct appctx *appctx) {
         return;
     }
 
-    /* check that the output is not closed */
-    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
-        appctx->st0 = NST_PERSIST_APPLET_DONE;
+    if(appctx->st0 == NST_PERSIST_APPLET_ERROR) {
+        return;
     }
 
-    switch(appctx->st0) {
-        case NST_PERSIST_APPLET_HEADER:
-            {
-                char *p = trash.area;
-                ret = pread(fd, p, header_len, offset);
-
-                if(ret != header_len) {
-                    appctx->st0 = NST_PERSIST_APPLET_ERROR;
-                    break;
-                }
-
-                while(header_len != 0) {
-                    struct htx_blk *blk;
-                    char *ptr;
-                    uint32_t blksz, sz, info;
-                    enum htx_blk_type type;
-
-                    info = *(uint32_t *)p;
-                    type = (info >> 28);
-                    blksz = (info & 0xff) + ((info >> 8) & 0xfffff);
-
-                    blk = htx_add_blk(res_htx, type, blksz);
-
-                    if(!blk) {
-                        appctx->st0 = NST_PERSIST_APPLET_ERROR;
-                        break;
-                    }
-
-                    blk->info = info;
-                    ptr = htx_get_blk_ptr(res_htx, blk);
-                    sz = htx_get_blksz(blk);
-                    p += 4;
-                    memcpy(ptr, p, sz);
-                    p += sz;
-
-                    header_len -= 4 + sz;
-                }
-
-                appctx->st0 = NST_PERSIST_APPLET_PAYLOAD;
-                offset += ret;
-                appctx->ctx.nuster.cache_disk_engine.offset = offset;
-            }
-
-        case NST_PERSIST_APPLET_PAYLOAD:
-            max = htx_get_max_blksz(res_htx, channel_htx_recv_max(res, res_htx));
-            ret = pread(fd, trash.area, max, offset);
-
-            if(ret == -1) {
-                appctx->st0 = NST_PERSIST_APPLET_ERROR;
-                break;
-            }
-
-            if(ret > 0) {
-                struct htx_blk *blk;
-                char *ptr;
-                uint32_t blksz, sz, info;
-                enum htx_blk_type type;
-
-                type = HTX_BLK_DATA;
-                info = (type << 28) + ret;
-                blksz = info & 0xfffffff;
-
-                blk = htx_add_blk(res_htx, type, blksz);
-
-                if(!blk) {
-                    appctx->st0 = NST_PERSIST_APPLET_ERROR;
-                    break;
-                }
-
-                blk->info = info;
-                ptr = htx_get_blk_ptr(res_htx, blk);
-                sz = htx_get_blksz(blk);
-                memcpy(ptr, trash.area, sz);
-
-                appctx->ctx.nuster.cache_disk_engine.offset += ret;
-                break;
-            }
-
-            close(fd);
-
-            appctx->st0 = NST_PERSIST_APPLET_EOM;
-
-        case NST_PERSIST_APPLET_EOM:
-
-            if (!htx_add_endof(res_htx, HTX_BLK_EOM)) {
-                si_rx_room_blk(si);
-                goto out;
-            }
-
-            appctx->st0 = NST_PERSIST_APPLET_DONE;
-        case NST_PERSIST_APPLET_DONE:
+    nst_res_send_persist(si, res_htx, &appctx->st0,
+            appctx->ctx.nuster.cache_disk_engine.fd,
+            appctx->ctx.nuster.cache_disk_engine.header_len,
+            &appctx->ctx.nuster.cache_disk_engine.offset,
+            &appctx->ctx.nuster.cache_disk_engine.splice,
+            appctx->ctx.nuster.cache_disk_engine.cached);
 
-            if (!(res->flags & CF_SHUTR) ) {
-                res->flags |= CF_READ_NULL;
-                si_shutr(si);
-            }
-
-            if (co_data(req)) {
-                req_htx = htx_from_buf(&req->buf);
-                co_htx_skip(req, req_htx, co_data(req));
-                htx_to_buf(req_htx, &req->buf);
-            }
-
-            break;
-        case NST_PERSIST_APPLET_ERROR:
-            si_shutr(si);
-            res->flags |= CF_READ_NULL;
-            close(fd);
-            return;
-    }
-
-out:
     total = res_htx->data - total;
     channel_add_input(res, total);
     htx_to_buf(res_htx, &res->buf);
-    return;
 }
 
 /*
@@ -303,8 +201,14 @@ struct nst_rule_stash *nst_cache_stash_rule(struct nst_cache_ctx *ctx,
     struct nst_rule_stash *stash = pool_alloc(global.nuster.cache.pool.stash);
 
     if(stash) {
+        stash->key  = nst_key_copy(NULL, ctx->key);
+
+        if(!stash->key) {
+            pool_free(global.nuster.cache.pool.stash, stash);
+            return NULL;
+        }
+
         stash->rule = rule;
-        stash->key  = ctx->key;
         stash->hash = ctx->hash;
 
         if(ctx->stash) {
@@ -424,10 +328,10 @@ static void _nst_cache_data_cleanup() {
     }
 
     if(data) {
-        struct nst_cache_element *element = data->element;
+        struct nst_data_element *element = data->element;
 
         while(element) {
-            struct nst_cache_element *tmp = element;
+            struct nst_data_element *tmp = element;
             element                       = element->next;
 
             if(tmp->msg.data) {
@@ -451,6 +355,7 @@ void nst_cache_housekeeping() {
         int disk_cleaner = global.nuster.cache.disk_cleaner;
         int disk_loader  = global.nuster.cache.disk_loader;
         int disk_saver   = global.nuster.cache.disk_saver;
+        int defragger    = global.nuster.cache.defragger;
 
         while(dict_cleaner--) {
             nst_cache_dict_rehash();
@@ -479,13 +384,44 @@ void nst_cache_housekeeping() {
             nst_shctx_unlock(&nuster.cache->dict[0]);
         }
 
+        nst_cache_persist_journal();
+
+        nst_cache_tier_demote();
+        nst_cache_tier_promote();
+
+        /* the usage is only complete once all files are loaded */
+        if(global.nuster.cache.disk_size && nuster.cache->disk.loaded) {
+            int evictor = NST_CACHE_EVICT_BATCH;
+
+            while(evictor--
+                    && nuster.cache->disk.used
+                    > (int64_t)global.nuster.cache.disk_size
+                    && nst_cache_persist_evict() == NST_OK) {
+            }
+        }
+
+        if(global.nuster.cache.root) {
+            nst_persist_sync(global.nuster.cache.root, &nuster.cache->disk,
+                    global.nuster.cache.disk_sync,
+                    global.nuster.cache.disk_sync_value);
+        }
+
+        while(defragger-- > 0) {
+            nst_shctx_lock(&nuster.cache->dict[0]);
+            nst_cache_dict_defrag();
+            nst_shctx_unlock(&nuster.cache->dict[0]);
+        }
+
     }
 }
 
 void nst_cache_init() {
 
     nuster.applet.cache_engine.fct = nst_cache_engine_handler;
+    nuster.applet.cache_engine.release = nst_cache_engine_release_handler;
     nuster.applet.cache_disk_engine.fct = nst_cache_disk_engine_handler;
+    nuster.applet.cache_disk_engine.release =
+        nst_cache_disk_engine_release_handler;
 
     if(global.nuster.cache.status == NST_STATUS_ON) {
 
@@ -507,6 +443,11 @@ void nst_cache_init() {
             }
         }
 
+        /* the mappings are those of the files kept open */
+        if(global.nuster.cache.disk_mmap && !global.nuster.cache.disk_fds) {
+            global.nuster.cache.disk_fds = NST_DEFAULT_DISK_FDS;
+        }
+
         global.nuster.cache.pool.stash = create_pool("cp.stash",
                 sizeof(struct nst_rule_stash), MEM_F_SHARED);
 
@@ -517,7 +458,8 @@ void nst_cache_init() {
             global.nuster.cache.memory = nst_memory_create("cache.shm",
                     global.nuster.cache.dict_size
                     + global.nuster.cache.data_size, global.tune.bufsize,
-                    NST_CACHE_DEFAULT_CHUNK_SIZE);
+                    NST_CACHE_DEFAULT_CHUNK_SIZE,
+                    &global.nuster.cache.zone);
 
             if(!global.nuster.cache.memory) {
                 goto shm_err;
@@ -531,7 +473,7 @@ void nst_cache_init() {
 
         } else {
             global.nuster.cache.memory = nst_memory_create("cache.shm",
-                    NST_DEFAULT_DATA_SIZE, 0, 0);
+                    NST_DEFAULT_DATA_SIZE, 0, 0, NULL);
 
             if(!global.nuster.cache.memory) {
                 goto shm_err;
@@ -545,7 +487,7 @@ void nst_cache_init() {
                     sizeof(struct nst_cache_data), MEM_F_SHARED);
 
             global.nuster.cache.pool.element = create_pool("cp.element",
-                    sizeof(struct nst_cache_element), MEM_F_SHARED);
+                    sizeof(struct nst_data_element), MEM_F_SHARED);
 
             global.nuster.cache.pool.chunk   = create_pool("cp.chunk",
                     global.tune.bufsize, MEM_F_SHARED);
@@ -569,6 +511,10 @@ void nst_cache_init() {
             if(!nuster.cache->disk.file) {
                 goto err;
             }
+
+            if(nst_persist_bloom_init(&nuster.cache->disk) != NST_OK) {
+                goto err;
+            }
         }
 
         if(nst_shctx_init(nuster.cache) != NST_OK) {
@@ -705,6 +651,8 @@ int nst_cache_build_key(struct nst_cache_ctx *ctx, struct nst_rule_key **pck,
 
     struct http_txn *txn = s->txn;
     struct nst_rule_key *ck = NULL;
+    struct nst_key_value vals[NST_KEY_VALUES];
+    int nvals;
 
     ctx->key = nst_cache_key_init();
 
@@ -712,6 +660,9 @@ int nst_cache_build_key(struct nst_cache_ctx *ctx, struct nst_rule_key **pck,
         return NST_ERR;
     }
 
+    nvals = nst_key_collect(htxbuf(&s->req.buf), ctx->req.query.data,
+            ctx->req.query.len, pck, vals, NST_KEY_VALUES);
+
     nst_debug(s, "[cache] Calculate key: ");
 
     while((ck = *pck++)) {
@@ -792,7 +743,23 @@ int nst_cache_build_key(struct nst_cache_ctx *ctx, struct nst_rule_key **pck,
             case NST_RULE_KEY_PARAM:
                 nst_debug2("param_%s.", ck->data);
 
-                if(ctx->req.query.data && ctx->req.query.len) {
+                if(nvals >= 0) {
+                    int i;
+
+                    for(i = 0; i < nvals; i++) {
+
+                        if(vals[i].idx == ck->idx) {
+                            break;
+                        }
+                    }
+
+                    if(i < nvals) {
+                        ret = nst_cache_key_append(ctx->key,
+                                vals[i].value.ptr, vals[i].value.len);
+                        break;
+                    }
+
+                } else if(ctx->req.query.data && ctx->req.query.len) {
                     char *v = NULL;
                     int v_l = 0;
 
@@ -814,14 +781,28 @@ int nst_cache_build_key(struct nst_cache_ctx *ctx, struct nst_rule_key **pck,
                     struct http_hdr_ctx hdr = { .blk = NULL };
                     struct ist h = {
                         .ptr = ck->data,
-                        .len = strlen(ck->data),
+                        .len = ck->len,
                     };
 
                     nst_debug2("header_%s.", ck->data);
 
-                    while (http_find_header(htx, h, &hdr, 0)) {
-                        ret = nst_cache_key_append(ctx->key, hdr.value.ptr,
-                                hdr.value.len);
+                    if(nvals >= 0) {
+                        int i;
+
+                        for(i = 0; i < nvals; i++) {
+
+                            if(vals[i].idx == ck->idx) {
+                                ret = nst_cache_key_append(ctx->key,
+                                        vals[i].value.ptr, vals[i].value.len);
+                            }
+                        }
+
+                    } else {
+
+                        while (http_find_header(htx, h, &hdr, 0)) {
+                            ret = nst_cache_key_append(ctx->key,
+                                    hdr.value.ptr, hdr.value.len);
+                        }
                     }
 
                     ret = ret == NST_OK && nst_cache_key_advance(ctx->key,
@@ -838,7 +819,7 @@ int nst_cache_build_key(struct nst_cache_ctx *ctx, struct nst_rule_key **pck,
 
                     if(http_extract_cookie_value(ctx->req.cookie.data,
                                 ctx->req.cookie.data + ctx->req.cookie.len,
-                                ck->data, strlen(ck->data), 1, &v, &v_l)) {
+                                ck->data, ck->len, 1, &v, &v_l)) {
 
                         ret = nst_cache_key_append(ctx->key, v, v_l);
                         break;
@@ -875,6 +856,12 @@ int nst_cache_build_key(struct nst_cache_ctx *ctx, struct nst_rule_key **pck,
         }
     }
 
+    /*
+     * hash the whole key in one go while it is still hot, the one-shot XXH64
+     * is faster than feeding its streaming state component by component
+     */
+    ctx->hash = nst_hash(ctx->key->area, ctx->key->data);
+
     nst_debug2("\n");
     return NST_OK;
 }
@@ -971,12 +958,76 @@ static void _nst_cache_record_access(struct nst_cache_entry *entry) {
 
 }
 
+/*
+ * Queue a disk tier entry to be loaded back to memory by the housekeeping
+ */
+static void _nst_cache_tier_queue(struct nst_cache_entry *entry) {
+    struct nst_cache_journal *promote = &nuster.cache->promote;
+
+    if(entry->promoting) {
+        return;
+    }
+
+    if(promote->count == NST_CACHE_JOURNAL_SIZE) {
+        promote->dropped++;
+        return;
+    }
+
+    promote->entry[(promote->head + promote->count) % NST_CACHE_JOURNAL_SIZE] =
+        entry;
+
+    promote->count++;
+
+    entry->promoting = 1;
+    entry->pinned++;
+}
+
 /*
  * Check if valid cache exists
  */
+/*
+ * Open the file of a disk hit, from the open files of disk-fds if set.
+ */
+static int _nst_cache_disk_open(struct nst_cache_ctx *ctx, int verify) {
+
+    if(global.nuster.cache.disk_fds) {
+        return nst_persist_file_get(&ctx->disk, ctx->key, ctx->hash, verify,
+                &nuster.cache->disk);
+    }
+
+    if(nst_persist_valid(&ctx->disk, ctx->key, ctx->hash) != NST_OK) {
+        return NST_ERR;
+    }
+
+    if(verify) {
+        return nst_persist_verify(&ctx->disk, &nuster.cache->disk);
+    }
+
+    return NST_OK;
+}
+
+/*
+ * End the check of the file of the entry of ctx, which is verified only if
+ * the checksum matched, unless the file was replaced meanwhile.
+ */
+static void _nst_cache_verified(struct nst_cache_ctx *ctx, int ok) {
+    struct nst_cache_entry *entry;
+
+    nst_shctx_lock(&nuster.cache->dict[0]);
+    entry = nst_cache_dict_get(ctx->key, ctx->hash);
+
+    if(entry && entry->verifying && entry->file == ctx->disk.file) {
+        entry->verifying = 0;
+        entry->verified  = ok;
+    }
+
+    nst_shctx_unlock(&nuster.cache->dict[0]);
+}
+
 int nst_cache_exists(struct nst_cache_ctx *ctx, struct nst_rule *rule) {
     struct nst_cache_entry *entry = NULL;
     int ret = NST_CACHE_CTX_STATE_INIT;
+    int verify = 0;
 
     if(!ctx->key) {
         return ret;
@@ -1012,18 +1063,32 @@ int nst_cache_exists(struct nst_cache_ctx *ctx, struct nst_rule *rule) {
 
             _nst_cache_record_access(entry);
 
+            entry->hits++;
+
             ret = NST_CACHE_CTX_STATE_HIT;
         }
 
-        if(entry->state == NST_CACHE_ENTRY_STATE_INVALID && entry->file) {
+        if(entry->state == NST_CACHE_ENTRY_STATE_INVALID && entry->file
+                && !entry->verifying) {
+
             ctx->disk.file = entry->file;
             ret = NST_CACHE_CTX_STATE_CHECK_PERSIST;
+
+            if(entry->tier && ++entry->hits >= NST_CACHE_TIER_PROMOTE) {
+                _nst_cache_tier_queue(entry);
+            }
+
+            /* loaded from disk, the first hit checks the file */
+            verify = !entry->verified;
+            entry->verifying = verify;
         }
     } else {
         if(rule->disk != NST_DISK_OFF) {
             ctx->disk.file = NULL;
 
-            if(nuster.cache->disk.loaded) {
+            if(nuster.cache->disk.loaded
+                    || nst_persist_bloom_miss(&nuster.cache->disk, ctx->hash)) {
+
                 ret = NST_CACHE_CTX_STATE_INIT;
             } else {
                 ret = NST_CACHE_CTX_STATE_CHECK_PERSIST;
@@ -1037,12 +1102,16 @@ int nst_cache_exists(struct nst_cache_ctx *ctx, struct nst_rule *rule) {
 
         if(ctx->disk.file) {
 
-            if(nst_persist_valid(&ctx->disk, ctx->key, ctx->hash) == NST_OK) {
+            if(_nst_cache_disk_open(ctx, verify) == NST_OK) {
                 _nst_cache_record_access(entry);
                 ret = NST_CACHE_CTX_STATE_HIT_DISK;
             } else {
                 ret = NST_CACHE_CTX_STATE_INIT;
             }
+
+            if(verify) {
+                _nst_cache_verified(ctx, ret == NST_CACHE_CTX_STATE_HIT_DISK);
+            }
         } else {
             ctx->disk.file = nst_cache_memory_alloc(
                     nst_persist_path_file_len(global.nuster.cache.root) + 1);
@@ -1052,7 +1121,8 @@ int nst_cache_exists(struct nst_cache_ctx *ctx, struct nst_rule *rule) {
             } else {
 
                 if(nst_persist_exists(global.nuster.cache.root, &ctx->disk,
-                            ctx->key, ctx->hash) == NST_OK) {
+                            ctx->key, ctx->hash, &nuster.cache->disk)
+                        == NST_OK) {
 
                     ret = NST_CACHE_CTX_STATE_HIT_DISK;
                 } else {
@@ -1066,6 +1136,55 @@ int nst_cache_exists(struct nst_cache_ctx *ctx, struct nst_rule *rule) {
     return ret;
 }
 
+/*
+ * Collect the tags of the response from tag-header, values are separated by
+ * commas or spaces, like Cache-Tag and Surrogate-Key
+ */
+static int _nst_cache_build_tags(struct http_msg *msg, struct ist *tags) {
+    struct htx *htx         = htxbuf(&msg->chn->buf);
+    struct http_hdr_ctx hdr = { .blk = NULL };
+    int count               = 0;
+
+    if(!global.nuster.cache.tag_header) {
+        return 0;
+    }
+
+    while(http_find_header(htx, ist(global.nuster.cache.tag_header), &hdr, 0)) {
+        count = nst_cache_tag_parse(hdr.value.ptr,
+                hdr.value.ptr + hdr.value.len, tags, count);
+    }
+
+    return count;
+}
+
+/*
+ * Write the tags of a response after its last-modified, each one followed
+ * by a space, the length is set in the meta
+ */
+static void _nst_cache_persist_write_tags(struct persist *disk,
+        struct ist *tags, int count) {
+
+    uint64_t len = 0;
+    int i;
+
+    for(i = 0; i < count; i++) {
+        len += tags[i].len + 1;
+    }
+
+    nst_persist_meta_set_tags_len(disk->meta, len);
+
+    for(i = 0; i < count; i++) {
+
+        if(i) {
+            nst_persist_write(disk, tags[i].ptr, tags[i].len);
+        } else {
+            nst_persist_write_tags(disk, tags[i].ptr, tags[i].len);
+        }
+
+        nst_persist_write(disk, " ", 1);
+    }
+}
+
 /*
  * Start to create cache,
  * if cache does not exist, add a new nst_cache_entry
@@ -1074,6 +1193,8 @@ int nst_cache_exists(struct nst_cache_ctx *ctx, struct nst_rule *rule) {
  */
 void nst_cache_create(struct nst_cache_ctx *ctx, struct http_msg *msg) {
     struct nst_cache_entry *entry = NULL;
+    struct ist tags[NST_CACHE_TAGS];
+    int tag_count                 = _nst_cache_build_tags(msg, tags);
 
     nst_shctx_lock(&nuster.cache->dict[0]);
     entry = nst_cache_dict_get(ctx->key, ctx->hash);
@@ -1136,6 +1257,10 @@ void nst_cache_create(struct nst_cache_ctx *ctx, struct http_msg *msg) {
         }
     }
 
+    if(ctx->state == NST_CACHE_CTX_STATE_CREATE) {
+        nst_cache_tag_set(ctx->entry, tags, tag_count);
+    }
+
     nst_shctx_unlock(&nuster.cache->dict[0]);
 
     if(ctx->state == NST_CACHE_CTX_STATE_CREATE) {
@@ -1148,7 +1273,7 @@ void nst_cache_create(struct nst_cache_ctx *ctx, struct http_msg *msg) {
             uint32_t        sz  = htx_get_blksz(blk);
             enum htx_blk_type type = htx_get_blk_type(blk);
 
-            struct nst_cache_element *element = NULL;
+            struct nst_data_element *element = NULL;
             char *data = NULL;
 
             if(ctx->rule->disk != NST_DISK_ONLY)  {
@@ -1168,6 +1293,7 @@ void nst_cache_create(struct nst_cache_ctx *ctx, struct http_msg *msg) {
 
                 element->msg.data = data;
                 element->msg.len  = blk->info;
+                element->next     = NULL;
 
                 if(ctx->element) {
                     ctx->element->next = element;
@@ -1208,7 +1334,7 @@ void nst_cache_create(struct nst_cache_ctx *ctx, struct http_msg *msg) {
             return;
         }
 
-        ctx->disk.fd = nst_persist_create(ctx->disk.file);
+        nst_persist_create(&ctx->disk);
 
         ttl_extend = ttl_extend << 32;
         *( uint8_t *)(&ttl_extend)      = ctx->rule->extend[0];
@@ -1227,6 +1353,7 @@ void nst_cache_create(struct nst_cache_ctx *ctx, struct http_msg *msg) {
         nst_persist_write_path(&ctx->disk, &ctx->entry->path);
         nst_persist_write_etag(&ctx->disk, &ctx->entry->etag);
         nst_persist_write_last_modified(&ctx->disk, &ctx->entry->last_modified);
+        _nst_cache_persist_write_tags(&ctx->disk, tags, tag_count);
 
         htx = htxbuf(&msg->chn->buf);
 
@@ -1242,6 +1369,8 @@ void nst_cache_create(struct nst_cache_ctx *ctx, struct http_msg *msg) {
                 break;
             }
         }
+
+        nst_persist_flush(&ctx->disk);
     }
 
 err:
@@ -1261,7 +1390,7 @@ int nst_cache_update(struct nst_cache_ctx *ctx, struct http_msg *msg,
         struct htx_blk *blk = htx_get_blk(htx, pos);
         uint32_t        sz  = htx_get_blksz(blk);
         enum htx_blk_type type = htx_get_blk_type(blk);
-        struct nst_cache_element *element;
+        struct nst_data_element *element;
         char *data;
 
         if(type != HTX_BLK_DATA) {
@@ -1288,6 +1417,7 @@ int nst_cache_update(struct nst_cache_ctx *ctx, struct http_msg *msg,
 
             element->msg.data = data;
             element->msg.len  = blk->info;
+            element->next     = NULL;
 
             if(ctx->element) {
                 ctx->element->next = element;
@@ -1305,9 +1435,12 @@ int nst_cache_update(struct nst_cache_ctx *ctx, struct http_msg *msg,
         }
     }
 
+    nst_persist_flush(&ctx->disk);
+
     return NST_OK;
 
 err:
+    nst_persist_flush(&ctx->disk);
 
     return NST_ERR;
 }
@@ -1340,7 +1473,15 @@ void nst_cache_finish(struct nst_cache_ctx *ctx) {
 
         nst_persist_write_meta(&ctx->disk);
 
-        ctx->entry->file = ctx->disk.file;
+        if(nst_persist_commit(&ctx->disk, &nuster.cache->disk,
+                    global.nuster.cache.disk_sync) == NST_OK) {
+
+            ctx->entry->file      = ctx->disk.file;
+            ctx->entry->verified  = 1;
+            ctx->entry->verifying = 0;
+        } else {
+            nst_cache_memory_free(ctx->disk.file);
+        }
     }
 }
 
@@ -1363,7 +1504,7 @@ void nst_cache_hit(struct stream *s, struct stream_interface *si,
 
     if(unlikely(!si_register_handler(si, objt_applet(s->target)))) {
         /* return to regular process on error */
-        data->clients--;
+        nst_cache_data_release(data);
         s->target = NULL;
     } else {
         appctx = si_appctx(si);
@@ -1411,6 +1552,11 @@ void nst_cache_hit_disk(struct stream *s, struct stream_interface *si,
         appctx->ctx.nuster.cache_disk_engine.header_len =
             nst_persist_meta_get_header_len(ctx->disk.meta);
 
+        /* the applet owns the file from now on */
+        appctx->ctx.nuster.cache_disk_engine.cached = ctx->disk.cached;
+        ctx->disk.cached = NULL;
+        ctx->disk.fd  = -1;
+
         appctx->st0 = NST_PERSIST_APPLET_HEADER;
 
         req->analysers &= ~AN_REQ_FLT_HTTP_HDRS;
@@ -1423,297 +1569,875 @@ void nst_cache_hit_disk(struct stream *s, struct stream_interface *si,
     }
 }
 
-void nst_cache_persist_async() {
-    struct nst_cache_entry *entry;
+/*
+ * Name the file of an entry in memory and fill its meta, called with the
+ * dict lock held. The tags are copied to tags as they may be replaced once
+ * the lock is released. Nothing is written yet, see _nst_cache_persist_begin.
+ */
+static int _nst_cache_persist_meta(struct nst_cache_entry *entry,
+        struct persist *disk, struct nst_str *tags) {
 
-    if(!global.nuster.cache.root || !nuster.cache->disk.loaded) {
-        return;
-    }
+    uint64_t ttl_extend = entry->ttl;
+    struct nst_cache_tag *tag;
+    char *p;
 
-    if(!nuster.cache->dict[0].used) {
-        return;
+    tags->data = NULL;
+    tags->len  = 0;
+
+    for(tag = entry->tags; tag; tag = tag->sibling) {
+        tags->len += tag->len + 1;
     }
 
-    entry = nuster.cache->dict[0].entry[nuster.cache->persist_idx];
+    if(tags->len) {
+        tags->data = nst_cache_memory_alloc(tags->len);
 
-    while(entry) {
+        if(!tags->data) {
+            return NST_ERR;
+        }
 
-        if(!nst_cache_entry_invalid(entry)
-                && entry->rule->disk == NST_DISK_ASYNC
-                && entry->file == NULL) {
+        for(p = tags->data, tag = entry->tags; tag; tag = tag->sibling) {
+            memcpy(p, tag->data, tag->len);
+            p += tag->len;
+            *p++ = ' ';
+        }
+    }
 
-            struct nst_cache_element *element = entry->data->element;
-            uint64_t cache_len = 0;
-            struct persist disk;
-            uint64_t ttl_extend = entry->ttl;
-            uint64_t header_len = 0;
+    disk->file = nst_cache_memory_alloc(
+            nst_persist_path_file_len(global.nuster.cache.root) + 1);
 
-            entry->file = nst_cache_memory_alloc(
-                    nst_persist_path_file_len(global.nuster.cache.root) + 1);
+    if(!disk->file) {
 
-            if(!entry->file) {
-                return;
-            }
+        if(tags->data) {
+            nst_cache_memory_free(tags->data);
+        }
 
-            if(nst_persist_init(global.nuster.cache.root, entry->file,
-                        entry->hash) != NST_OK) {
-                return;
-            }
+        return NST_ERR;
+    }
 
-            disk.fd = nst_persist_create(entry->file);
-
-            ttl_extend = ttl_extend << 32;
-            *( uint8_t *)(&ttl_extend)      = entry->extend[0];
-            *((uint8_t *)(&ttl_extend) + 1) = entry->extend[1];
-            *((uint8_t *)(&ttl_extend) + 2) = entry->extend[2];
-            *((uint8_t *)(&ttl_extend) + 3) = entry->extend[3];
-
-            nst_persist_meta_init(disk.meta, (char)entry->rule->disk,
-                    entry->hash, entry->expire, 0, 0,
-                    entry->key->data, entry->host.len, entry->path.len,
-                    entry->etag.len, entry->last_modified.len, ttl_extend);
-
-            nst_persist_write_key(&disk, entry->key);
-            nst_persist_write_host(&disk, &entry->host);
-            nst_persist_write_path(&disk, &entry->path);
-            nst_persist_write_etag(&disk, &entry->etag);
-            nst_persist_write_last_modified(&disk, &entry->last_modified);
-
-            while(element) {
-                uint32_t blksz, info;
-                enum htx_blk_type type;
-
-                info = element->msg.len;
-                type = (info >> 28);
-                blksz = ((type == HTX_BLK_HDR || type == HTX_BLK_TLR)
-                        ? (info & 0xff) + ((info >> 8) & 0xfffff)
-                        : info & 0xfffffff);
-
-                if(type != HTX_BLK_DATA) {
-                    nst_persist_write(&disk, (char *)&info, 4);
-                    cache_len += 4;
-                    header_len += 4 + blksz;
-                }
+    ttl_extend = ttl_extend << 32;
+    *( uint8_t *)(&ttl_extend)      = entry->extend[0];
+    *((uint8_t *)(&ttl_extend) + 1) = entry->extend[1];
+    *((uint8_t *)(&ttl_extend) + 2) = entry->extend[2];
+    *((uint8_t *)(&ttl_extend) + 3) = entry->extend[3];
 
-                nst_persist_write(&disk, element->msg.data, blksz);
+    nst_persist_meta_init(disk->meta,
+            entry->tier ? NST_DISK_TIER : (char)entry->rule->disk,
+            entry->hash, entry->expire, 0, 0,
+            entry->key->data, entry->host.len, entry->path.len,
+            entry->etag.len, entry->last_modified.len, ttl_extend);
 
-                cache_len += blksz;
+    nst_persist_meta_set_tags_len(disk->meta, tags->len);
 
-                element = element->next;
-            }
+    return NST_OK;
+}
 
-            nst_persist_meta_set_cache_len(disk.meta, cache_len);
-            nst_persist_meta_set_header_len(disk.meta, header_len);
+/*
+ * Create the file named by _nst_cache_persist_meta and write its key, host,
+ * path, etag, last-modified and the tags copied with the meta, which are
+ * freed. It runs without the dict lock if the entry is pinned, its strings
+ * stay. The file is freed on error.
+ */
+static int _nst_cache_persist_begin(struct nst_cache_entry *entry,
+        struct persist *disk, struct nst_str *tags) {
 
-            nst_persist_write_meta(&disk);
+    if(nst_persist_init(global.nuster.cache.root, disk->file,
+                nst_persist_meta_get_hash(disk->meta)) != NST_OK) {
 
-            close(disk.fd);
+        if(tags->data) {
+            nst_cache_memory_free(tags->data);
         }
 
-        entry = entry->next;
+        nst_cache_memory_free(disk->file);
+        disk->file = NULL;
 
+        return NST_ERR;
     }
 
-    nuster.cache->persist_idx++;
+    nst_persist_create(disk);
 
-    /* if we have checked the whole dict */
-    if(nuster.cache->persist_idx == nuster.cache->dict[0].size) {
-        nuster.cache->persist_idx = 0;
+    nst_persist_write_key(disk, entry->key);
+    nst_persist_write_host(disk, &entry->host);
+    nst_persist_write_path(disk, &entry->path);
+    nst_persist_write_etag(disk, &entry->etag);
+    nst_persist_write_last_modified(disk, &entry->last_modified);
+    nst_persist_write_tags(disk, tags->data, tags->len);
+
+    if(tags->data) {
+        nst_cache_memory_free(tags->data);
     }
 
+    return NST_OK;
 }
 
-void nst_cache_persist_load() {
+/*
+ * Write the elements of data to a file started by _nst_cache_persist_begin
+ * and commit it. It does not touch the entry, so it runs without the dict
+ * lock as long as a client holds data. The file is freed on error.
+ */
+static int _nst_cache_persist_data(struct persist *disk,
+        struct nst_cache_data *data) {
 
-    if(global.nuster.cache.root && !nuster.cache->disk.loaded) {
-        char *root;
-        char *file;
-        char meta[NST_PERSIST_META_SIZE];
-        struct buffer *key;
-        struct nst_str host;
-        struct nst_str path;
-        int fd;
-        DIR *dir2;
-        struct dirent *de2;
+    struct nst_data_element *element = data->element;
+    uint64_t cache_len  = 0;
+    uint64_t header_len = 0;
+    int ret;
 
-        fd = -1;
-        key = NULL;
-        dir2 = NULL;
+    while(element) {
+        uint32_t blksz, info;
+        enum htx_blk_type type;
 
-        root = global.nuster.cache.root;
-        file = nuster.cache->disk.file;
+        info = element->msg.len;
+        type = (info >> 28);
+        blksz = ((type == HTX_BLK_HDR || type == HTX_BLK_TLR)
+                ? (info & 0xff) + ((info >> 8) & 0xfffff)
+                : info & 0xfffffff);
 
-        if(nuster.cache->disk.dir) {
-            struct dirent *de = nst_persist_dir_next(nuster.cache->disk.dir);
+        if(type != HTX_BLK_DATA) {
+            nst_persist_write(disk, (char *)&info, 4);
+            cache_len += 4;
+            header_len += 4 + blksz;
+        }
 
-            if(de) {
+        nst_persist_write(disk, element->msg.data, blksz);
 
-                if(strcmp(de->d_name, ".") == 0
-                        || strcmp(de->d_name, "..") == 0) {
+        cache_len += blksz;
 
-                    return;
-                }
+        element = element->next;
+    }
 
-                memcpy(file + nst_persist_path_base_len(root), "/", 1);
-                memcpy(file + nst_persist_path_base_len(root) + 1, de->d_name,
-                        strlen(de->d_name));
+    nst_persist_meta_set_cache_len(disk->meta, cache_len);
+    nst_persist_meta_set_header_len(disk->meta, header_len);
 
-                dir2 = opendir(file);
+    nst_persist_write_meta(disk);
 
-                if(!dir2) {
-                    return;
-                }
+    ret = nst_persist_commit(disk, &nuster.cache->disk,
+            global.nuster.cache.disk_sync);
 
-                while((de2 = readdir(dir2)) != NULL) {
-                    if(strcmp(de2->d_name, ".") == 0
-                            || strcmp(de2->d_name, "..") == 0) {
+    if(ret != NST_OK) {
+        nst_cache_memory_free(disk->file);
+        disk->file = NULL;
+    }
 
-                        continue;
-                    }
+    close(disk->fd);
 
-                    memcpy(file + nst_persist_path_hash_len(root), "/", 1);
-                    memcpy(file + nst_persist_path_hash_len(root) + 1,
-                            de2->d_name, strlen(de2->d_name));
+    return ret;
+}
 
-                    fd = nst_persist_open(file);
+/*
+ * Write the data of an entry in memory to a new file, called with the dict
+ * lock held. The entry gets its file once it is complete.
+ */
+static int _nst_cache_persist_entry(struct nst_cache_entry *entry) {
+    struct persist disk;
+    struct nst_str tags;
 
-                    if(fd == -1) {
-                        closedir(dir2);
-                        return;
-                    }
+    if(_nst_cache_persist_meta(entry, &disk, &tags) != NST_OK
+            || _nst_cache_persist_begin(entry, &disk, &tags) != NST_OK) {
 
-                    if(nst_persist_get_meta(fd, meta) != NST_OK) {
-                        goto err;
-                    }
+        return NST_ERR;
+    }
 
-                    key = nst_cache_memory_alloc(sizeof(*key));
+    if(_nst_cache_persist_data(&disk, entry->data) != NST_OK) {
+        return NST_ERR;
+    }
 
-                    if(!key) {
-                        goto err;
-                    }
+    entry->file      = disk.file;
+    entry->verified  = 1;
+    entry->verifying = 0;
 
-                    key->size = nst_persist_meta_get_key_len(meta);
-                    key->area = nst_cache_memory_alloc(key->size);
+    return NST_OK;
+}
 
-                    if(!key->area) {
-                        goto err;
-                    }
+void nst_cache_persist_async() {
+    struct nst_cache_entry *entry;
 
-                    if(nst_persist_get_key(fd, meta, key) != NST_OK) {
-                        goto err;
-                    }
+    if(!global.nuster.cache.root || !nuster.cache->disk.loaded) {
+        return;
+    }
 
-                    host.len = nst_persist_meta_get_host_len(meta);
-                    host.data = nst_cache_memory_alloc(host.len);
+    if(!nuster.cache->dict[0].used) {
+        return;
+    }
 
-                    if(!host.data) {
-                        goto err;
-                    }
+    entry = nuster.cache->dict[0].entry[nuster.cache->persist_idx];
 
-                    if(nst_persist_get_host(fd, meta, &host) != NST_OK) {
-                        goto err;
-                    }
+    while(entry) {
 
-                    path.len = nst_persist_meta_get_path_len(meta);
-                    path.data = nst_cache_memory_alloc(path.len);
+        if(!nst_cache_entry_invalid(entry)
+                && entry->rule && entry->rule->disk == NST_DISK_ASYNC
+                && entry->file == NULL && !entry->evicted) {
 
-                    if(!path.data) {
-                        goto err;
-                    }
+            _nst_cache_persist_entry(entry);
+        }
 
-                    if(nst_persist_get_path(fd, meta, &path) != NST_OK) {
-                        goto err;
-                    }
+        entry = entry->next;
+
+    }
+
+    nuster.cache->persist_idx++;
+
+    /* if we have checked the whole dict */
+    if(nuster.cache->persist_idx == nuster.cache->dict[0].size) {
+        nuster.cache->persist_idx = 0;
+    }
+
+}
+
+/*
+ * Remove the least recently used file of the next NST_CACHE_EVICT_SAMPLES
+ * entries having one. Entries in memory are kept, disk only ones are expired.
+ */
+int nst_cache_persist_evict() {
+    struct nst_cache_entry *victim = NULL;
+    char file[PATH_MAX];
+    uint64_t idx, buckets;
+    int samples = 0;
+
+    nst_shctx_lock(&nuster.cache->dict[0]);
+
+    idx = nuster.cache->evict_idx;
+
+    if(idx >= nuster.cache->dict[0].size) {
+        idx = 0;
+    }
+
+    for(buckets = 0; buckets < nuster.cache->dict[0].size
+            && samples < NST_CACHE_EVICT_SAMPLES; buckets++) {
 
-                    nst_cache_dict_set_from_disk(file, meta, key, &host, &path);
+        struct nst_cache_entry *entry = nuster.cache->dict[0].entry[idx];
 
-                    close(fd);
+        while(entry) {
+
+            if(entry->file && !entry->pinned
+                    && (entry->state == NST_CACHE_ENTRY_STATE_VALID
+                        || entry->state == NST_CACHE_ENTRY_STATE_INVALID)) {
+
+                if(!victim || entry->atime < victim->atime) {
+                    victim = entry;
                 }
 
-                closedir(dir2);
-            } else {
-                nuster.cache->disk.idx++;
-                closedir(nuster.cache->disk.dir);
-                nuster.cache->disk.dir = NULL;
+                samples++;
             }
-        } else {
-            nuster.cache->disk.dir = nst_persist_opendir_by_idx(
-                    global.nuster.cache.root, file, nuster.cache->disk.idx);
 
-            if(!nuster.cache->disk.dir) {
-                nuster.cache->disk.idx++;
-            }
+            entry = entry->next;
         }
 
-        if(nuster.cache->disk.idx == 16 * 16) {
-            nuster.cache->disk.loaded = 1;
-            nuster.cache->disk.idx    = 0;
+        if(++idx == nuster.cache->dict[0].size) {
+            idx = 0;
         }
+    }
 
-        return;
+    nuster.cache->evict_idx = idx;
 
-err:
+    if(!victim) {
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+
+        return NST_ERR;
+    }
+
+    strcpy(file, victim->file);
+
+    if(victim->state == NST_CACHE_ENTRY_STATE_INVALID) {
+        victim->state = NST_CACHE_ENTRY_STATE_EXPIRED;
+    } else {
+        nst_cache_memory_free(victim->file);
+        victim->file    = NULL;
+        victim->evicted = 1;
+    }
+
+    nst_shctx_unlock(&nuster.cache->dict[0]);
+
+    if(nst_persist_unlink(&nuster.cache->disk, file) == 0) {
+        HA_ATOMIC_ADD(&nuster.cache->disk.evicted, 1);
+    }
+
+    return NST_OK;
+}
+
+static int _nst_cache_tier_usage() {
+    struct nst_memory *memory = global.nuster.cache.memory;
+
+    return nst_memory_in_use(memory) * 100
+        / ((uint64_t)memory->blocks * memory->block_size);
+}
+
+/*
+ * Append an element of size bytes to data, after tail
+ */
+static struct nst_data_element *_nst_cache_tier_element(
+        struct nst_cache_data *data, struct nst_data_element *tail,
+        uint32_t info, int size) {
+
+    struct nst_data_element *element = nst_cache_memory_alloc(sizeof(*element));
+
+    if(!element) {
+        return NULL;
+    }
+
+    element->msg.data = nst_cache_memory_alloc(size);
+
+    if(!element->msg.data) {
+        nst_cache_memory_free(element);
+        return NULL;
+    }
+
+    element->msg.len = info;
+    element->next    = NULL;
+
+    if(tail) {
+        tail->next = element;
+    } else {
+        data->element = element;
+    }
+
+    return element;
+}
+
+/*
+ * Read a file opened by nst_persist_valid back to a new nst_cache_data, the
+ * payload is split in NST_CACHE_TIER_BLOCK elements
+ */
+static struct nst_cache_data *_nst_cache_tier_load(struct persist *disk) {
+    struct nst_data_element *tail = NULL;
+    struct nst_cache_data *data;
+    struct stat st;
+    uint64_t pos;
+    char *buf, *p;
+    int header_len;
+
+    if(fstat(disk->fd, &st) != 0) {
+        return NULL;
+    }
+
+    header_len = nst_persist_meta_get_header_len(disk->meta);
+    pos        = nst_persist_get_header_pos(disk->meta);
+    buf        = malloc(header_len);
+
+    if(!buf || pread(disk->fd, buf, header_len, pos) != header_len) {
+        free(buf);
+        return NULL;
+    }
+
+    data = nst_cache_data_new();
 
-        if(file) {
-            unlink(file);
+    if(!data) {
+        free(buf);
+        return NULL;
+    }
+
+    for(p = buf; p < buf + header_len; ) {
+        uint32_t info = *(uint32_t *)p;
+        enum htx_blk_type type = (info >> 28);
+        uint32_t blksz = ((type == HTX_BLK_HDR || type == HTX_BLK_TLR)
+                ? (info & 0xff) + ((info >> 8) & 0xfffff)
+                : info & 0xfffffff);
+
+        if(p + 4 + blksz > buf + header_len) {
+            goto err;
         }
 
-        if(fd) {
-            close(fd);
+        tail = _nst_cache_tier_element(data, tail, info, blksz);
+
+        if(!tail) {
+            goto err;
         }
 
-        if(dir2) {
-            closedir(dir2);
+        memcpy(tail->msg.data, p + 4, blksz);
+        p += 4 + blksz;
+    }
+
+    pos += header_len;
+
+    while(pos < st.st_size) {
+        int len = st.st_size - pos > NST_CACHE_TIER_BLOCK
+            ? NST_CACHE_TIER_BLOCK : st.st_size - pos;
+
+        tail = _nst_cache_tier_element(data, tail,
+                (HTX_BLK_DATA << 28) + len, len);
+
+        if(!tail || pread(disk->fd, tail->msg.data, len, pos) != len) {
+            goto err;
         }
 
-        if(key) {
+        pos += len;
+    }
 
-            if(key->area) {
-                nst_cache_memory_free(key->area);
-            }
+    free(buf);
+
+    return data;
+
+err:
+    free(buf);
+
+    /* freed by the data cleaner */
+    data->invalid = 1;
+
+    return NULL;
+}
+
+/*
+ * Load the entries queued by nst_cache_exists back to memory, if there is
+ * room. The file is kept, so moving it to disk again only drops the data.
+ */
+void nst_cache_tier_promote() {
+    struct nst_cache_journal *promote = &nuster.cache->promote;
+    int batch                         = NST_CACHE_TIER_BATCH;
+
+    if(!global.nuster.cache.root) {
+        return;
+    }
+
+    while(batch-- && promote->count) {
+        struct nst_cache_entry *entry;
+        struct nst_cache_data *data = NULL;
+        struct nst_str etag, last_modified;
+        struct persist disk;
+        char file[PATH_MAX];
+        int verify;
+
+        nst_shctx_lock(&nuster.cache->dict[0]);
 
-            nst_cache_memory_free(key);
+        entry = promote->entry[promote->head];
+
+        promote->head = (promote->head + 1) % NST_CACHE_JOURNAL_SIZE;
+        promote->count--;
+
+        entry->promoting = 0;
+
+        if(entry->state != NST_CACHE_ENTRY_STATE_INVALID || !entry->file
+                || _nst_cache_tier_usage() >= NST_CACHE_TIER_LOW) {
+
+            entry->pinned--;
+            nst_shctx_unlock(&nuster.cache->dict[0]);
+
+            continue;
         }
 
-        if(host.data) {
-            nst_cache_memory_free(host.data);
+        strcpy(file, entry->file);
+        verify = !entry->verified;
+
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+
+        /* the entry is pinned, its key stays */
+        disk.file          = file;
+        etag.data          = NULL;
+        last_modified.data = NULL;
+
+        if(nst_persist_valid(&disk, entry->key, entry->hash) == NST_OK
+                && (!verify
+                    || nst_persist_verify(&disk, &nuster.cache->disk) == NST_OK)) {
+
+            etag.len          = nst_persist_meta_get_etag_len(disk.meta);
+            last_modified.len = nst_persist_meta_get_last_modified_len(disk.meta);
+
+            etag.data          = nst_cache_memory_alloc(etag.len + 1);
+            last_modified.data = nst_cache_memory_alloc(last_modified.len + 1);
+
+            if(etag.data && last_modified.data
+                    && nst_persist_get_etag(disk.fd, disk.meta, &etag) == NST_OK
+                    && nst_persist_get_last_modified(disk.fd, disk.meta,
+                        &last_modified) == NST_OK) {
+
+                data = _nst_cache_tier_load(&disk);
+            }
+
+            close(disk.fd);
         }
 
-        if(path.data) {
-            nst_cache_memory_free(path.data);
+        nst_shctx_lock(&nuster.cache->dict[0]);
+
+        entry->pinned--;
+
+        if(data && entry->state == NST_CACHE_ENTRY_STATE_INVALID
+                && entry->file && !strcmp(entry->file, file)) {
+
+            if(!entry->etag.data) {
+                entry->etag   = etag;
+                etag.data     = NULL;
+            }
+
+            if(!entry->last_modified.data) {
+                entry->last_modified = last_modified;
+                last_modified.data   = NULL;
+            }
+
+            entry->data     = data;
+            entry->state    = NST_CACHE_ENTRY_STATE_VALID;
+            entry->verified = 1;
+
+            nuster.cache->promoted++;
+        } else if(data) {
+            data->invalid = 1;
         }
 
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+
+        nst_cache_memory_free(etag.data);
+        nst_cache_memory_free(last_modified.data);
     }
 }
 
-void nst_cache_persist_cleanup() {
+/*
+ * Move the entry with the fewest hits of the next NST_CACHE_TIER_SAMPLES in
+ * memory to disk, the hits of the others are halved so that old hits fade.
+ * Returns the size of the data dropped, freed later by the data cleaner.
+ */
+static uint64_t _nst_cache_tier_demote() {
+    struct nst_cache_entry *victim = NULL;
+    struct nst_data_element *element;
+    struct nst_cache_data *data;
+    struct persist disk;
+    struct nst_str tags;
+    int ret;
+    uint64_t idx, buckets;
+    uint64_t size = 0;
+    int samples = 0;
 
-    if(global.nuster.cache.root && nuster.cache->disk.loaded) {
-        char *file = nuster.cache->disk.file;
+    nst_shctx_lock(&nuster.cache->dict[0]);
 
-        if(nuster.cache->disk.dir) {
-            struct dirent *de = nst_persist_dir_next(nuster.cache->disk.dir);
+    idx = nuster.cache->tier_idx;
 
-            if(de) {
-                nst_persist_cleanup(global.nuster.cache.root, file, de);
-            } else {
-                nuster.cache->disk.idx++;
-                closedir(nuster.cache->disk.dir);
-                nuster.cache->disk.dir = NULL;
+    if(idx >= nuster.cache->dict[0].size) {
+        idx = 0;
+    }
+
+    for(buckets = 0; buckets < nuster.cache->dict[0].size
+            && samples < NST_CACHE_TIER_SAMPLES; buckets++) {
+
+        struct nst_cache_entry *entry = nuster.cache->dict[0].entry[idx];
+
+        while(entry) {
+
+            if(entry->tier && entry->state == NST_CACHE_ENTRY_STATE_VALID
+                    && !nst_cache_entry_expired(entry)) {
+
+                if(!victim || entry->hits < victim->hits) {
+
+                    if(victim) {
+                        victim->hits >>= 1;
+                    }
+
+                    victim = entry;
+                } else {
+                    entry->hits >>= 1;
+                }
+
+                samples++;
             }
-        } else {
-            nuster.cache->disk.dir = nst_persist_opendir_by_idx(
-                    global.nuster.cache.root, file, nuster.cache->disk.idx);
 
-            if(!nuster.cache->disk.dir) {
-                nuster.cache->disk.idx++;
+            entry = entry->next;
+        }
+
+        if(++idx == nuster.cache->dict[0].size) {
+            idx = 0;
+        }
+    }
+
+    nuster.cache->tier_idx = idx;
+
+    if(!victim) {
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+
+        return 0;
+    }
+
+    data = victim->data;
+
+    for(element = data->element; element; element = element->next) {
+        size += sizeof(*element) + nst_data_element_size(element);
+    }
+
+    /*
+     * The file is created and written without the lock, the victim is pinned
+     * so that it stays and a client holds its data. It is only swapped for
+     * the file if nothing replaced it meanwhile, and dropped anyway if it
+     * cannot be written, memory is short.
+     */
+    if(!victim->file
+            && _nst_cache_persist_meta(victim, &disk, &tags) == NST_OK) {
+
+        victim->pinned++;
+        data->clients++;
+
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+
+        ret = _nst_cache_persist_begin(victim, &disk, &tags);
+
+        if(ret == NST_OK) {
+            ret = _nst_cache_persist_data(&disk, data);
+        }
+
+        nst_shctx_lock(&nuster.cache->dict[0]);
+
+        victim->pinned--;
+        data->clients--;
+
+        if(victim->state != NST_CACHE_ENTRY_STATE_VALID
+                || victim->data != data || victim->file) {
+
+            nst_shctx_unlock(&nuster.cache->dict[0]);
+
+            if(ret == NST_OK) {
+                nst_persist_unlink(&nuster.cache->disk, disk.file);
+                nst_cache_memory_free(disk.file);
             }
+
+            return 0;
+        }
+
+        if(ret == NST_OK) {
+            victim->file      = disk.file;
+            victim->verified  = 1;
+            victim->verifying = 0;
+        }
+    }
+
+    victim->data->invalid = 1;
+    victim->data          = NULL;
+    victim->hits          = 0;
+    victim->evicted       = 0;
+
+    if(victim->file) {
+        victim->state = NST_CACHE_ENTRY_STATE_INVALID;
+        nuster.cache->demoted++;
+    } else {
+        victim->state = NST_CACHE_ENTRY_STATE_EXPIRED;
+    }
+
+    nst_shctx_unlock(&nuster.cache->dict[0]);
+
+    return size + sizeof(struct nst_cache_data);
+}
+
+void nst_cache_tier_demote() {
+    struct nst_memory *memory = global.nuster.cache.memory;
+    uint64_t size             = (uint64_t)memory->blocks * memory->block_size;
+    uint64_t used             = nst_memory_in_use(memory);
+    int batch                 = NST_CACHE_TIER_BATCH;
+
+    if(!global.nuster.cache.root || !global.nuster.cache.tier
+            || used * 100 < size * NST_CACHE_TIER_HIGH) {
+
+        return;
+    }
+
+    while(batch-- && used * 100 >= size * NST_CACHE_TIER_LOW) {
+        uint64_t dropped = _nst_cache_tier_demote();
+
+        if(!dropped) {
+            break;
+        }
+
+        used = used > dropped ? used - dropped : 0;
+    }
+}
+
+/*
+ * Write the expire of the entries queued by nst_cache_dict_get, in batches:
+ * the paths are copied under the dict lock, the files are written after
+ */
+void nst_cache_persist_journal() {
+    struct nst_cache_journal *journal = &nuster.cache->journal;
+    static char *file                 = NULL;
+    uint64_t expire[NST_CACHE_JOURNAL_BATCH];
+    int len, count, i;
+
+    if(!global.nuster.cache.root || !journal->count) {
+        return;
+    }
+
+    len = nst_persist_path_file_len(global.nuster.cache.root) + 1;
+
+    if(!file) {
+        file = malloc(len * NST_CACHE_JOURNAL_BATCH);
+
+        if(!file) {
+            return;
+        }
+    }
+
+    do {
+        nst_shctx_lock(&nuster.cache->dict[0]);
+
+        for(count = 0; count < NST_CACHE_JOURNAL_BATCH && journal->count;
+                count++) {
+
+            struct nst_cache_entry *entry = journal->entry[journal->head];
+
+            memcpy(file + count * len, entry->file, len);
+            expire[count] = entry->expire;
+
+            entry->journaled = 0;
+            entry->pinned--;
+
+            journal->head = (journal->head + 1) % NST_CACHE_JOURNAL_SIZE;
+            journal->count--;
+        }
+
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+
+        for(i = 0; i < count; i++) {
+            nst_persist_update_expire(file + i * len, expire[i]);
+        }
+
+    } while(count == NST_CACHE_JOURNAL_BATCH);
+}
+
+static void _nst_cache_persist_free(struct nst_persist_item *item) {
+
+    if(item->key) {
+
+        if(item->key->area) {
+            nst_cache_memory_free(item->key->area);
+        }
+
+        nst_cache_memory_free(item->key);
+    }
+
+    if(item->host.data) {
+        nst_cache_memory_free(item->host.data);
+    }
+
+    if(item->path.data) {
+        nst_cache_memory_free(item->path.data);
+    }
+
+    if(item->tags.data) {
+        nst_cache_memory_free(item->tags.data);
+    }
+
+    item->key = NULL;
+}
+
+/*
+ * Read the key, host, path and tags of a file for the loader, out of memory
+ * keeps the file without adding it, a broken one is removed.
+ */
+static int _nst_cache_persist_read(struct nst_persist_item *item, int fd) {
+    struct buffer *key;
+    char *meta = item->meta;
+    int ret = NST_OK;
+
+    item->host.data = NULL;
+    item->path.data = NULL;
+    item->tags.data = NULL;
+
+    key = item->key = nst_cache_memory_alloc(sizeof(*key));
+
+    if(!key) {
+        goto err;
+    }
+
+    key->size = nst_persist_meta_get_key_len(meta);
+    key->area = nst_cache_memory_alloc(key->size);
+
+    if(!key->area) {
+        goto err;
+    }
+
+    if(nst_persist_get_key(fd, meta, key) != NST_OK) {
+        ret = NST_ERR;
+        goto err;
+    }
+
+    item->host.len  = nst_persist_meta_get_host_len(meta);
+    item->host.data = nst_cache_memory_alloc(item->host.len);
+
+    if(!item->host.data) {
+        goto err;
+    }
+
+    if(nst_persist_get_host(fd, meta, &item->host) != NST_OK) {
+        ret = NST_ERR;
+        goto err;
+    }
+
+    item->path.len  = nst_persist_meta_get_path_len(meta);
+    item->path.data = nst_cache_memory_alloc(item->path.len);
+
+    if(!item->path.data) {
+        goto err;
+    }
+
+    if(nst_persist_get_path(fd, meta, &item->path) != NST_OK) {
+        ret = NST_ERR;
+        goto err;
+    }
+
+    item->tags.len = nst_persist_meta_get_tags_len(meta);
+
+    if(item->tags.len) {
+        item->tags.data = nst_cache_memory_alloc(item->tags.len);
+
+        if(!item->tags.data) {
+            goto err;
         }
 
-        if(nuster.cache->disk.idx == 16 * 16) {
-            nuster.cache->disk.idx = 0;
+        if(nst_persist_get_tags(fd, meta, &item->tags) != NST_OK) {
+            ret = NST_ERR;
+            goto err;
         }
+    }
 
+    return NST_OK;
+
+err:
+    _nst_cache_persist_free(item);
+
+    return ret;
+}
+
+/* add the files read by the loader under one lock, returns the number added */
+static int _nst_cache_persist_add(struct nst_persist_item *item, int n) {
+    int added = 0;
+
+    nst_shctx_lock(&nuster.cache->dict[0]);
+
+    for(; n--; item++) {
+
+        /* keep the one set after start */
+        if(nst_cache_dict_get(item->key, nst_persist_meta_get_hash(item->meta))
+                || nst_cache_dict_set_from_disk(item->file, item->meta,
+                    item->key, &item->host, &item->path, &item->tags)
+                != NST_OK) {
+
+            _nst_cache_persist_free(item);
+            continue;
+        }
+
+        /* the tags are copied to the index */
+        if(item->tags.data) {
+            nst_cache_memory_free(item->tags.data);
+        }
+
+        added++;
+    }
+
+    nst_shctx_unlock(&nuster.cache->dict[0]);
+
+    return added;
+}
+
+static struct nst_persist_loader_ops _nst_cache_persist_loader = {
+    .read = _nst_cache_persist_read,
+    .add  = _nst_cache_persist_add,
+};
+
+void nst_cache_persist_load() {
+
+    if(global.nuster.cache.root && !nuster.cache->disk.loaded) {
+        nst_persist_disk_load(global.nuster.cache.root, &nuster.cache->disk,
+                &_nst_cache_persist_loader,
+                global.nuster.cache.disk_loader_threads,
+                global.nuster.cache.disk_loader_rate);
+    }
+}
+
+void nst_cache_persist_cleanup() {
+
+    if(global.nuster.cache.root && nuster.cache->disk.loaded) {
+        nst_persist_disk_cleanup(global.nuster.cache.root,
+                &nuster.cache->disk);
     }
 }
 
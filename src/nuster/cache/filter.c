@@ -90,7 +90,9 @@ static void _nst_cache_filter_detach(struct stream *s, struct filter *filter) {
 
         nst_cache_stats_update_req(ctx->state);
 
-        if(ctx->disk.fd > 0) {
+        if(ctx->disk.cached) {
+            nst_persist_file_put(ctx->disk.cached);
+        } else if(ctx->disk.fd > 0) {
             close(ctx->disk.fd);
         }
 
@@ -103,10 +105,7 @@ static void _nst_cache_filter_detach(struct stream *s, struct filter *filter) {
             ctx->stash = ctx->stash->next;
 
             if(stash->key) {
-                if(!ctx->entry || ctx->entry->key != stash->key) {
-                    nst_cache_memory_free(stash->key->area);
-                    nst_cache_memory_free(stash->key);
-                }
+                nst_key_free(NULL, stash->key);
             }
 
             pool_free(global.nuster.cache.pool.stash, stash);
@@ -260,6 +259,8 @@ static int _nst_cache_filter_http_headers(struct stream *s,
     struct stream_interface *si = &s->si[1];
     struct nst_cache_ctx *ctx   = filter->ctx;
     struct nst_rule *rule       = NULL;
+    struct nst_rule_key **key   = NULL;
+    struct server *srv          = NULL;
 
     if(!(msg->chn->flags & CF_ISRESP)) {
 
@@ -276,6 +277,26 @@ static int _nst_cache_filter_http_headers(struct stream *s,
                 return 1;
             }
 
+            /* first rule key decides the owner in shard mode */
+            rule = nst_shard_rule(px);
+
+            if(rule) {
+
+                if(nst_cache_build_key(ctx, rule->key, s, msg) != NST_OK) {
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                    return 1;
+                }
+
+                key = rule->key;
+                srv = nst_shard_owner(s, msg, ctx->hash);
+
+                if(srv && nst_shard_forward(s, msg, srv) == NST_OK) {
+                    nst_debug(s, "[cache] Forward to shard %s\n", srv->id);
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                    return 1;
+                }
+            }
+
             list_for_each_entry(rule, &px->nuster.rules, list) {
                 nst_debug(s, "[cache] ==== Check rule: %s ====\n", rule->name);
 
@@ -284,23 +305,19 @@ static int _nst_cache_filter_http_headers(struct stream *s,
                     continue;
                 }
 
-                /* build key */
-                if(nst_cache_build_key(ctx, rule->key, s, msg) != NST_OK) {
-                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
-                    return 1;
-                }
-
-                nst_debug(s, "[cache] Key: ");
-                nst_debug_key(ctx->key);
+                /* build key, rules sharing a key definition reuse the last one */
+                if(rule->key != key) {
 
-                ctx->hash = nst_hash(ctx->key->area, ctx->key->data);
+                    if(nst_cache_build_key(ctx, rule->key, s, msg) != NST_OK) {
+                        ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                        return 1;
+                    }
 
-                nst_debug(s, "[cache] Hash: %"PRIu64"\n", ctx->hash);
+                    nst_debug(s, "[cache] Key: ");
+                    nst_debug_key(ctx->key);
+                    nst_debug(s, "[cache] Hash: %"PRIu64"\n", ctx->hash);
 
-                /* stash key */
-                if(!nst_cache_stash_rule(ctx, rule)) {
-                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
-                    return 1;
+                    key = rule->key;
                 }
 
                 /* check if cache exists  */
@@ -320,12 +337,16 @@ static int _nst_cache_filter_http_headers(struct stream *s,
                         nst_res_304(s, &ctx->res.last_modified,
                                 &ctx->res.etag);
 
+                        nst_cache_data_release(ctx->data);
+
                         return 1;
                     }
 
                     if(ret == 412) {
                         nst_res_412(s);
 
+                        nst_cache_data_release(ctx->data);
+
                         return 1;
                     }
 
@@ -408,6 +429,12 @@ abort_check:
 
                 /* no, there's no cache yet */
 
+                /* stash key, ctx->key is only the per-thread scratch buffer */
+                if(!nst_cache_stash_rule(ctx, rule)) {
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                    return 1;
+                }
+
                 /* test acls to see if we should cache it */
                 nst_debug(s, "[cache] Test rule ACL (req): ");
 
@@ -487,13 +514,14 @@ abort_check:
 
             nst_debug2("PASS\n");
 
-            /* get cache key */
+            /* get cache key, ctx->key may still point to the scratch key */
+            ctx->key = NULL;
+
             while(stash) {
 
                 if(stash->rule == ctx->rule) {
                     ctx->key  = stash->key;
                     ctx->hash = stash->hash;
-                    stash->key = NULL;
                     break;
                 }
 
@@ -608,6 +636,7 @@ static struct sample_fetch_kw_list nst_sample_fetch_keywords = {
         { "nuster.cache.hit", nst_smp_fetch_cache_hit, 0, NULL, SMP_T_BOOL,
             SMP_USE_HRSHP
         },
+        { /* END */ },
     }
 };
 
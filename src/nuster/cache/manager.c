@@ -44,7 +44,12 @@ int _nst_cache_purge_by_key(struct buffer *key, uint64_t hash) {
         }
 
         if(entry->file) {
-            ret = nst_persist_purge_by_path(entry->file);
+            ret = nst_persist_purge_by_path(entry->file, &nuster.cache->disk);
+
+            /* do not keep it as a disk only entry */
+            if(entry->state == NST_CACHE_ENTRY_STATE_INVALID) {
+                entry->state = NST_CACHE_ENTRY_STATE_EXPIRED;
+            }
         }
     } else {
         ret = 404;
@@ -62,7 +67,7 @@ int _nst_cache_purge_by_key(struct buffer *key, uint64_t hash) {
             ret = 500;
         } else {
             ret = nst_persist_purge_by_key(global.nuster.cache.root,
-                    &disk, key, hash);
+                    &disk, key, hash, &nuster.cache->disk);
         }
 
         nst_cache_memory_free(disk.file);
@@ -181,8 +186,10 @@ int _nst_cache_manager_purge(struct stream *s, struct channel *req,
     struct my_regex *regex      = NULL;
     char *error                 = NULL;
     char *regex_str             = NULL;
+    char *tag                   = NULL;
     int host_len                = 0;
     int path_len                = 0;
+    int tag_len                 = 0;
     struct proxy *p;
 
     struct htx *htx = htxbuf(&s->req.buf);
@@ -252,9 +259,13 @@ int _nst_cache_manager_purge(struct stream *s, struct channel *req,
         }
 
         free(regex_str);
-        regex_free(regex);
+        regex_str = NULL;
 
         mode = host ? NST_CACHE_PURGE_REGEX_HOST : NST_CACHE_PURGE_REGEX;
+    } else if(http_find_header(htx, ist("tag"), &hdr, 0)) {
+        tag     = hdr.value.ptr;
+        tag_len = hdr.value.len;
+        mode    = NST_CACHE_PURGE_TAG;
     } else if(host) {
         mode = NST_CACHE_PURGE_HOST;
     } else {
@@ -307,6 +318,29 @@ purge:
                 mode == NST_CACHE_PURGE_REGEX_HOST) {
 
             appctx->ctx.nuster.cache_manager.regex = regex;
+        } else if(mode == NST_CACHE_PURGE_TAG) {
+
+            appctx->ctx.nuster.cache_manager.tag.data =
+                nst_cache_memory_alloc(tag_len);
+
+            appctx->ctx.nuster.cache_manager.tag.len  = tag_len;
+
+            if(!appctx->ctx.nuster.cache_manager.tag.data) {
+                goto err;
+            }
+
+            memcpy(appctx->ctx.nuster.cache_manager.tag.data, tag, tag_len);
+        }
+
+        /* the index bucket to walk, see _nst_cache_manager_index() */
+        if(mode == NST_CACHE_PURGE_PATH || mode == NST_CACHE_PURGE_PATH_HOST) {
+            appctx->ctx.nuster.cache_manager.hash = nst_hash(path, path_len);
+        } else if(mode == NST_CACHE_PURGE_TAG) {
+            appctx->ctx.nuster.cache_manager.hash = nst_hash(tag, tag_len);
+        } else if(host) {
+            appctx->ctx.nuster.cache_manager.hash = nst_hash(host, host_len);
+        } else {
+            appctx->ctx.nuster.cache_manager.hash = st1;
         }
 
         req->analysers &=
@@ -474,6 +508,154 @@ static int _nst_cache_manager_should_purge(struct nst_cache_entry *entry,
     return ret;
 }
 
+static void _nst_cache_manager_purge_entry(struct nst_cache_entry *entry) {
+
+    if(entry->state == NST_CACHE_ENTRY_STATE_VALID) {
+
+        entry->state         = NST_CACHE_ENTRY_STATE_INVALID;
+        entry->data->invalid = 1;
+        entry->data          = NULL;
+        entry->expire        = 0;
+    }
+
+    if(entry->file) {
+        nst_persist_purge_by_path(entry->file, &nuster.cache->disk);
+
+        if(entry->state == NST_CACHE_ENTRY_STATE_INVALID) {
+            entry->state = NST_CACHE_ENTRY_STATE_EXPIRED;
+        }
+    }
+}
+
+/*
+ * The index that holds every entry the purge can match, -1 if the whole dict
+ * has to be scanned
+ */
+static int _nst_cache_manager_index(struct appctx *appctx) {
+
+    switch(appctx->st0) {
+        case NST_CACHE_PURGE_NAME_RULE:
+            return NST_CACHE_INDEX_RULE;
+        case NST_CACHE_PURGE_PATH:
+        case NST_CACHE_PURGE_PATH_HOST:
+            return NST_CACHE_INDEX_PATH;
+        case NST_CACHE_PURGE_HOST:
+        case NST_CACHE_PURGE_REGEX_HOST:
+            return NST_CACHE_INDEX_HOST;
+    }
+
+    return -1;
+}
+
+/*
+ * Walk one index bucket, st2 is set once the walk has started. The entry to
+ * resume from is pinned while the lock is released so that
+ * nst_cache_dict_cleanup() keeps it.
+ * return 1 if the whole bucket has been walked, otherwise 0
+ */
+static int _nst_cache_manager_purge_index(struct appctx *appctx, int type,
+        uint64_t start) {
+
+    struct nst_cache_entry *entry = NULL;
+    int max                       = 1000;
+
+    while(1) {
+        nst_shctx_lock(&nuster.cache->dict[0]);
+
+        entry = appctx->ctx.nuster.cache_manager.cursor;
+
+        if(entry) {
+            entry->pinned--;
+        } else if(!appctx->st2) {
+            entry = nst_cache_index_first(type,
+                    appctx->ctx.nuster.cache_manager.hash);
+
+            appctx->st2 = 1;
+        }
+
+        while(entry && max--) {
+
+            if(_nst_cache_manager_should_purge(entry, appctx)) {
+                _nst_cache_manager_purge_entry(entry);
+            }
+
+            entry = entry->index[type].next;
+        }
+
+        if(entry) {
+            entry->pinned++;
+        }
+
+        appctx->ctx.nuster.cache_manager.cursor = entry;
+
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+
+        if(!entry) {
+            return 1;
+        }
+
+        if(get_current_timestamp() - start > 1) {
+            return 0;
+        }
+
+        max = 1000;
+    }
+}
+
+/*
+ * Walk the tag index bucket like _nst_cache_manager_purge_index(), the tag to
+ * resume from is pinned instead of its entry
+ * return 1 if the whole bucket has been walked, otherwise 0
+ */
+static int _nst_cache_manager_purge_tag(struct appctx *appctx, uint64_t start) {
+    struct nst_str *name      = &appctx->ctx.nuster.cache_manager.tag;
+    struct nst_cache_tag *tag = NULL;
+    int max                   = 1000;
+
+    while(1) {
+        nst_shctx_lock(&nuster.cache->dict[0]);
+
+        tag = appctx->ctx.nuster.cache_manager.tag_cursor;
+
+        if(tag) {
+            tag = nst_cache_tag_unpin(tag);
+        } else if(!appctx->st2) {
+            tag = nst_cache_tag_first(appctx->ctx.nuster.cache_manager.hash);
+
+            appctx->st2 = 1;
+        }
+
+        while(tag && max--) {
+
+            if(tag->entry && tag->len == name->len
+                    && !memcmp(tag->data, name->data, name->len)) {
+
+                _nst_cache_manager_purge_entry(tag->entry);
+            }
+
+            tag = tag->next;
+        }
+
+        if(tag) {
+            tag->pinned++;
+        }
+
+        appctx->ctx.nuster.cache_manager.tag_cursor = tag;
+
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+
+        if(!tag) {
+            return 1;
+        }
+
+        if(get_current_timestamp() - start > 1) {
+            return 0;
+        }
+
+        max = 1000;
+    }
+}
+
 static void nst_cache_manager_handler(struct appctx *appctx) {
     struct nst_cache_entry *entry = NULL;
     struct stream_interface *si   = appctx->owner;
@@ -481,6 +663,26 @@ static void nst_cache_manager_handler(struct appctx *appctx) {
     int max                       = 1000;
     uint64_t start                = get_current_timestamp();
     struct http_txn *txn = s->txn;
+    int type                      = _nst_cache_manager_index(appctx);
+
+    if(type >= 0 || appctx->st0 == NST_CACHE_PURGE_TAG) {
+        int done;
+
+        if(type >= 0) {
+            done = _nst_cache_manager_purge_index(appctx, type, start);
+        } else {
+            done = _nst_cache_manager_purge_tag(appctx, start);
+        }
+
+        task_wakeup(s->task, TASK_WOKEN_OTHER);
+
+        if(done) {
+            txn->status = 200;
+            http_reply_and_close(s, txn->status, http_error_message(s));
+        }
+
+        return;
+    }
 
     while(1) {
         nst_shctx_lock(&nuster.cache->dict[0]);
@@ -491,17 +693,7 @@ static void nst_cache_manager_handler(struct appctx *appctx) {
             while(entry) {
 
                 if(_nst_cache_manager_should_purge(entry, appctx)) {
-                    if(entry->state == NST_CACHE_ENTRY_STATE_VALID) {
-
-                        entry->state         = NST_CACHE_ENTRY_STATE_INVALID;
-                        entry->data->invalid = 1;
-                        entry->data          = NULL;
-                        entry->expire        = 0;
-                    }
-
-                    if(entry->file) {
-                        nst_persist_purge_by_path(entry->file);
-                    }
+                    _nst_cache_manager_purge_entry(entry);
                 }
 
                 entry = entry->next;
@@ -529,9 +721,20 @@ static void nst_cache_manager_handler(struct appctx *appctx) {
 
 static void nst_cache_manager_release_handler(struct appctx *appctx) {
 
+    if(appctx->ctx.nuster.cache_manager.cursor) {
+        nst_shctx_lock(&nuster.cache->dict[0]);
+        appctx->ctx.nuster.cache_manager.cursor->pinned--;
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+    }
+
+    if(appctx->ctx.nuster.cache_manager.tag_cursor) {
+        nst_shctx_lock(&nuster.cache->dict[0]);
+        nst_cache_tag_unpin(appctx->ctx.nuster.cache_manager.tag_cursor);
+        nst_shctx_unlock(&nuster.cache->dict[0]);
+    }
+
     if(appctx->ctx.nuster.cache_manager.regex) {
         regex_free(appctx->ctx.nuster.cache_manager.regex);
-        free(appctx->ctx.nuster.cache_manager.regex);
     }
 
     if(appctx->ctx.nuster.cache_manager.host.data) {
@@ -541,6 +744,10 @@ static void nst_cache_manager_release_handler(struct appctx *appctx) {
     if(appctx->ctx.nuster.cache_manager.path.data) {
         nst_cache_memory_free(appctx->ctx.nuster.cache_manager.path.data);
     }
+
+    if(appctx->ctx.nuster.cache_manager.tag.data) {
+        nst_cache_memory_free(appctx->ctx.nuster.cache_manager.tag.data);
+    }
 }
 
 int nst_cache_manager_init() {
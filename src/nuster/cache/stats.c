@@ -138,6 +138,12 @@ int _nst_cache_stats_head(struct appctx *appctx, struct stream *s,
     chunk_appendf(&trash, "global.nuster.cache.dict.size: %"PRIu64"\n",
             global.nuster.cache.dict_size);
 
+    chunk_appendf(&trash, "global.nuster.cache.page.size: %"PRIu64"\n",
+            global.nuster.cache.memory->page_size);
+
+    chunk_appendf(&trash, "global.nuster.cache.page.hugepage: %s\n",
+            nst_memory_hugepage_str(global.nuster.cache.memory));
+
     chunk_appendf(&trash, "global.nuster.cache.uri: %s\n",
             global.nuster.cache.uri);
 
@@ -160,6 +166,10 @@ int _nst_cache_stats_head(struct appctx *appctx, struct stream *s,
     chunk_appendf(&trash, "global.nuster.cache.stats.req_abort: %"PRIu64"\n",
             global.nuster.cache.stats->req.abort);
 
+    chunk_appendf(&trash, "\n**MEMORY**\n");
+    nst_memory_stats_dump(&trash, global.nuster.cache.memory,
+            "global.nuster.cache.memory");
+
     chunk_appendf(&trash, "\n**PERSISTENCE**\n");
 
     if(global.nuster.cache.root) {
@@ -167,6 +177,36 @@ int _nst_cache_stats_head(struct appctx *appctx, struct stream *s,
                 global.nuster.cache.root);
         chunk_appendf(&trash, "global.nuster.cache.loaded: %s\n",
             nuster.cache->disk.loaded ? "yes" : "no");
+        chunk_appendf(&trash, "global.nuster.cache.journal: pending=%d "
+                "dropped=%"PRIu64"\n", nuster.cache->journal.count,
+                nuster.cache->journal.dropped);
+        chunk_appendf(&trash, "global.nuster.cache.sync: dirty=%u "
+                "syncs=%"PRIu64"\n", nuster.cache->disk.dirty,
+                nuster.cache->disk.syncs);
+        chunk_appendf(&trash, "global.nuster.cache.disk_size: %"PRIu64"\n",
+                global.nuster.cache.disk_size);
+        chunk_appendf(&trash, "global.nuster.cache.disk_fds: %d\n",
+                global.nuster.cache.disk_fds);
+        chunk_appendf(&trash, "global.nuster.cache.disk_mmap: %s\n",
+                global.nuster.cache.disk_mmap ? "on" : "off");
+        chunk_appendf(&trash, "global.nuster.cache.disk_loader_threads: %d\n",
+                global.nuster.cache.disk_loader_threads);
+        chunk_appendf(&trash, "global.nuster.cache.disk_loader_rate: %d\n",
+                global.nuster.cache.disk_loader_rate);
+        nst_persist_stats_dump(&trash, &nuster.cache->disk,
+                "global.nuster.cache.disk");
+
+        if(global.nuster.cache.tier) {
+            chunk_appendf(&trash, "global.nuster.cache.tier: promoted=%"PRIu64
+                    " demoted=%"PRIu64" queued=%d dropped=%"PRIu64"\n",
+                    nuster.cache->promoted, nuster.cache->demoted,
+                    nuster.cache->promote.count, nuster.cache->promote.dropped);
+        }
+    }
+
+    if(global.nuster.nosql.status == NST_STATUS_ON) {
+        chunk_appendf(&trash, "\n**NOSQL**\n");
+        nst_nosql_stats_dump(&trash);
     }
 
     if(trash.data >= channel_htx_recv_max(res, res_htx)) {
@@ -241,6 +281,7 @@ int _nst_cache_stats_data(struct appctx *appctx, struct stream *s,
                                 : rule->disk == NST_DISK_ONLY ? "only"
                                 : rule->disk == NST_DISK_SYNC ? "sync"
                                 : rule->disk == NST_DISK_ASYNC ? "async"
+                                : rule->disk == NST_DISK_TIER ? "tier"
                                 : "invalid");
 
                         if(trash.data >= channel_htx_recv_max(res, htx)) {
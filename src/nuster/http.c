@@ -10,7 +10,16 @@
  *
  */
 
+#define _GNU_SOURCE
+#include <fcntl.h>
+
+#include <proto/filters.h>
+#include <proto/http_htx.h>
+#include <proto/pipe.h>
+#include <proto/stream.h>
+
 #include <nuster/http.h>
+#include <nuster/persist.h>
 
 /*
  * Used by cache, should move to new one
@@ -113,3 +122,288 @@ int nst_req_find_param(char *query_beg, char *query_end,
     return NST_ERR;
 }
 
+/*
+ * Append a cached element to htx as a block, used by both cache and nosql
+ * applets to send stored data
+ */
+int nst_data_element_to_htx(struct nst_data_element *element, struct htx *htx) {
+    struct htx_blk *blk;
+    char *ptr;
+    uint32_t sz;
+
+    blk = htx_add_blk(htx, element->msg.len >> 28,
+            nst_data_element_size(element));
+
+    if(!blk) {
+        return NST_ERR;
+    }
+
+    blk->info = element->msg.len;
+    ptr = htx_get_blk_ptr(htx, blk);
+    sz = htx_get_blksz(blk);
+    memcpy(ptr, element->msg.data, sz);
+
+    return NST_OK;
+}
+
+/*
+ * Whether the payload of a persisted entry can be spliced from the file to
+ * the client: the client must be HTTP/1 over a raw socket with splicing
+ * enabled, the response must have a content-length and no other filter may
+ * need to see the payload.
+ */
+static int _nst_res_can_splice(struct stream_interface *si, struct htx *htx) {
+#if defined(USE_LINUX_SPLICE)
+    struct stream *s = si_strm(si);
+    struct connection *conn = objt_conn(strm_sess(s)->origin);
+    struct filter *filter;
+    struct htx_sl *sl;
+
+    if(!(global.tune.options & GTUNE_USE_SPLICE)) {
+        return 0;
+    }
+
+    if(!((strm_fe(s)->options2 | s->be->options2) & PR_O2_SPLIC_RTR)) {
+        return 0;
+    }
+
+    if(!conn || !conn->mux || !conn->mux->snd_pipe
+            || !conn->xprt || !conn->xprt->snd_pipe) {
+
+        return 0;
+    }
+
+    if(s->txn && s->txn->meth == HTTP_METH_HEAD) {
+        return 0;
+    }
+
+    list_for_each_entry(filter, &strm_flt(s)->filters, list) {
+
+        if(FLT_OPS(filter) != &nst_cache_filter_ops
+                && FLT_OPS(filter) != &nst_nosql_filter_ops) {
+
+            return 0;
+        }
+    }
+
+    sl = http_get_stline(htx);
+
+    if(!sl || !(sl->flags & HTX_SL_F_CLEN) || (sl->flags & HTX_SL_F_CHNK)) {
+        return 0;
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Splice the payload from the file to the response pipe once the headers
+ * left the buffer, until the pipe is full. Returns 1 if the payload is done,
+ * 0 to be called again and -1 if splicing is not possible, in which case the
+ * payload is copied.
+ */
+static int _nst_res_splice_persist(struct stream_interface *si,
+        struct htx *htx, int fd, uint64_t *offset) {
+#if defined(USE_LINUX_SPLICE)
+    struct channel *res = si_ic(si);
+    loff_t off = *offset;
+    int ret;
+
+    /* the headers must be sent before the payload */
+    if(!htx_is_empty(htx)) {
+        si_rx_room_blk(si);
+        return 0;
+    }
+
+    if(!res->pipe && !(res->pipe = get_pipe())) {
+        return -1;
+    }
+
+    while(1) {
+        ret = splice(fd, &off, res->pipe->prod, NULL, global.tune.pipesize
+                ? global.tune.pipesize : NST_PERSIST_SPLICE_SIZE,
+                SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        if(ret <= 0) {
+            break;
+        }
+
+        res->pipe->data += ret;
+        res->total      += ret;
+        res->flags      |= CF_READ_PARTIAL;
+        *offset          = off;
+    }
+
+    if(ret == 0) {
+        return 1;
+    }
+
+    if(errno == EAGAIN) {
+        si_rx_room_blk(si);
+        return 0;
+    }
+
+    if(!res->pipe->data) {
+        put_pipe(res->pipe);
+        res->pipe = NULL;
+    }
+#endif
+
+    return -1;
+}
+
+/*
+ * Send a persisted entry, state is one of NST_PERSIST_APPLET_*, the headers
+ * are read in one go, then the payload as much as the channel accepts. The
+ * payload is spliced to the client instead when <splice> allows it. The fd
+ * of a <cached> file is left open, and its mapping is used if any.
+ */
+void nst_res_send_persist(struct stream_interface *si, struct htx *htx,
+        unsigned int *state, int fd, int header_len, uint64_t *offset,
+        int *splice, struct nst_persist_file *cached) {
+
+    struct channel *req = si_oc(si);
+    struct channel *res = si_ic(si);
+    struct htx *req_htx;
+    struct htx_blk *blk;
+    char *p;
+    char *addr = cached ? cached->addr : NULL;
+    uint32_t sz, info;
+    int ret, max;
+
+    /* check that the output is not closed */
+    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
+
+        if(*state == NST_PERSIST_APPLET_HEADER
+                || *state == NST_PERSIST_APPLET_PAYLOAD) {
+
+            if(!cached) {
+                close(fd);
+            }
+        }
+
+        *state = NST_PERSIST_APPLET_DONE;
+    }
+
+    switch((int)*state) {
+        case NST_PERSIST_APPLET_HEADER:
+            if(addr) {
+                p   = addr + *offset;
+                ret = *offset + header_len <= cached->size ? header_len : -1;
+            } else {
+                p   = trash.area;
+                ret = pread(fd, p, header_len, *offset);
+            }
+
+            if(ret != header_len) {
+                goto err;
+            }
+
+            while(header_len != 0) {
+                info = *(uint32_t *)p;
+                blk = htx_add_blk(htx, info >> 28,
+                        (info & 0xff) + ((info >> 8) & 0xfffff));
+
+                if(!blk) {
+                    goto err;
+                }
+
+                blk->info = info;
+                sz = htx_get_blksz(blk);
+                p += 4;
+                memcpy(htx_get_blk_ptr(htx, blk), p, sz);
+                p += sz;
+
+                header_len -= 4 + sz;
+            }
+
+            *state = NST_PERSIST_APPLET_PAYLOAD;
+            *offset += ret;
+            *splice = _nst_res_can_splice(si, htx);
+
+        case NST_PERSIST_APPLET_PAYLOAD:
+
+            if(*splice) {
+                ret = _nst_res_splice_persist(si, htx, fd, offset);
+
+                if(ret == 0) {
+                    break;
+                }
+
+                *splice = (ret == 1);
+            }
+
+            if(!*splice) {
+                max = htx_get_max_blksz(htx, channel_htx_recv_max(res, htx));
+
+                if(addr) {
+                    p   = addr + *offset;
+                    ret = MIN(cached->size - *offset, (uint64_t)max);
+                } else {
+                    p   = trash.area;
+                    ret = pread(fd, p, max, *offset);
+                }
+
+                if(ret == -1) {
+                    goto err;
+                }
+
+                if(ret > 0) {
+                    blk = htx_add_blk(htx, HTX_BLK_DATA, ret);
+
+                    if(!blk) {
+                        goto err;
+                    }
+
+                    blk->info = (HTX_BLK_DATA << 28) + ret;
+                    memcpy(htx_get_blk_ptr(htx, blk), p, ret);
+
+                    *offset += ret;
+                    break;
+                }
+            }
+
+            if(!cached) {
+                close(fd);
+            }
+
+            *state = NST_PERSIST_APPLET_EOM;
+
+        case NST_PERSIST_APPLET_EOM:
+
+            if(!htx_add_endof(htx, HTX_BLK_EOM)) {
+                si_rx_room_blk(si);
+                break;
+            }
+
+            *state = NST_PERSIST_APPLET_DONE;
+
+        case NST_PERSIST_APPLET_DONE:
+
+            if(!(res->flags & CF_SHUTR)) {
+                res->flags |= CF_READ_NULL;
+                si_shutr(si);
+            }
+
+            if(co_data(req)) {
+                req_htx = htx_from_buf(&req->buf);
+                co_htx_skip(req, req_htx, co_data(req));
+                htx_to_buf(req_htx, &req->buf);
+            }
+
+            break;
+    }
+
+    return;
+
+err:
+    *state = NST_PERSIST_APPLET_ERROR;
+    si_shutr(si);
+    res->flags |= CF_READ_NULL;
+
+    if(!cached) {
+        close(fd);
+    }
+}
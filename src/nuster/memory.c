@@ -10,15 +10,236 @@
  *
  */
 
+#include <errno.h>
+#include <inttypes.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include <nuster/shctx.h>
 #include <nuster/memory.h>
 
 #include <common/standard.h>
+#include <common/chunk.h>
+#include <common/hathreads.h>
+
+#include <types/global.h>
+
+/* zones with magazines, indexed by memory->zone */
+static struct nst_memory *nst_memory_zone[NST_MEMORY_MAGAZINE_ZONES];
+static int nst_memory_zones = 0;
+
+/*
+ * The parked slot of this thread per zone, NULL until the thread runs as
+ * chunks cached before fork would be shared, or if the zone has no slot left
+ */
+static THREAD_LOCAL struct nst_memory_parked
+*nst_memory_parked[NST_MEMORY_MAGAZINE_ZONES];
+static THREAD_LOCAL struct nst_memory_magazine
+nst_memory_magazine[NST_MEMORY_MAGAZINE_ZONES][NST_MEMORY_MAGAZINE_CLASSES];
+
+/* size of the default huge page, 0 if unknown */
+static uint64_t _nst_memory_hugepage_size() {
+    FILE *f = fopen("/proc/meminfo", "r");
+    char line[128];
+    uint64_t kb = 0;
+
+    if(!f) {
+        return 0;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+
+        if(sscanf(line, "Hugepagesize: %"SCNu64" kB", &kb) == 1) {
+            break;
+        }
+    }
+
+    fclose(f);
+
+    return kb * 1024;
+}
+
+/*
+ * Map the zone as asked by conf, fall back to normal pages if huge pages
+ * cannot be used, numa placement is applied before any page is touched.
+ */
+static uint8_t *_nst_memory_map(char *name, uint64_t *size,
+        struct nst_memory_conf *conf, uint64_t *page_size, int *hugepage) {
+
+    uint8_t *p = MAP_FAILED;
+    uint64_t hpage = 0;
+    uint64_t i;
+
+    *page_size = sysconf(_SC_PAGESIZE);
+    *hugepage  = NST_MEMORY_HUGEPAGE_OFF;
+
+    if(conf && conf->hugepage != NST_MEMORY_HUGEPAGE_OFF) {
+        hpage = _nst_memory_hugepage_size();
+
+        if(!hpage) {
+            fprintf(stderr, "%s: huge pages are not supported, "
+                    "using normal pages.\n", name);
+        }
+    }
+
+    if(hpage && conf->hugepage == NST_MEMORY_HUGEPAGE_ON) {
+        uint64_t hsize = (*size + hpage - 1) / hpage * hpage;
+
+        p = (uint8_t *) mmap(NULL, hsize, PROT_READ|PROT_WRITE,
+                MAP_ANON|MAP_SHARED|MAP_HUGETLB, -1, 0);
+
+        if(p != MAP_FAILED) {
+            *size      = hsize;
+            *page_size = hpage;
+            *hugepage  = NST_MEMORY_HUGEPAGE_ON;
+        } else {
+            fprintf(stderr, "%s: not enough huge pages reserved for %"PRIu64
+                    " bytes, using normal pages.\n", name, hsize);
+        }
+    }
+
+    if(p == MAP_FAILED) {
+        p = (uint8_t *) mmap(NULL, *size, PROT_READ|PROT_WRITE,
+                MAP_ANON|MAP_SHARED, -1, 0);
+
+        if(p == MAP_FAILED) {
+            return NULL;
+        }
+
+        if(hpage && conf->hugepage == NST_MEMORY_HUGEPAGE_THP) {
+
+            if(madvise(p, *size, MADV_HUGEPAGE) == 0) {
+                *page_size = hpage;
+                *hugepage  = NST_MEMORY_HUGEPAGE_THP;
+            } else {
+                fprintf(stderr, "%s: transparent huge pages are not "
+                        "available, using normal pages.\n", name);
+            }
+        }
+    }
+
+    if(conf && conf->numa != NST_MEMORY_NUMA_DEFAULT) {
+        int mode = conf->numa == NST_MEMORY_NUMA_BIND
+            ? MPOL_BIND : MPOL_INTERLEAVE;
+
+        if(syscall(SYS_mbind, p, *size, mode, &conf->nodes,
+                    sizeof(conf->nodes) * 8 + 1, 0) != 0) {
+
+            fprintf(stderr, "%s: cannot set numa policy: %s.\n", name,
+                    strerror(errno));
+        }
+    }
+
+    if(conf && conf->prefault) {
+
+        for(i = 0; i < *size; i += *page_size) {
+            p[i] = 0;
+        }
+    }
+
+    return p;
+}
+
+const char *nst_memory_hugepage_str(struct nst_memory *memory) {
+
+    switch(memory->hugepage) {
+        case NST_MEMORY_HUGEPAGE_ON:
+            return "on";
+        case NST_MEMORY_HUGEPAGE_THP:
+            return "thp";
+        default:
+            return "off";
+    }
+}
+
+/*
+ * Parse a numa node list like 0,2-3
+ */
+int nst_memory_parse_nodes(const char *str, unsigned long *nodes) {
+    char *end;
+    unsigned long from, to;
+
+    *nodes = 0;
+
+    while(*str) {
+        from = strtoul(str, &end, 10);
+
+        if(end == str) {
+            return NST_ERR;
+        }
+
+        to = from;
+
+        if(*end == '-') {
+            str = end + 1;
+            to  = strtoul(str, &end, 10);
+
+            if(end == str) {
+                return NST_ERR;
+            }
+        }
+
+        if(from > to || to >= sizeof(*nodes) * 8) {
+            return NST_ERR;
+        }
+
+        while(from <= to) {
+            *nodes |= 1UL << from++;
+        }
+
+        if(*end == ',') {
+            end++;
+        } else if(*end) {
+            return NST_ERR;
+        }
+
+        str = end;
+    }
+
+    return *nodes ? NST_OK : NST_ERR;
+}
+
+/*
+ * Fill memory->class from chunk_shift to block_shift, return the number of
+ * classes
+ */
+static int _nst_memory_class_init(struct nst_memory *memory) {
+    uint32_t size, step;
+    int n, shift;
+
+    n = 0;
+    memory->class[n++].size = 1U << memory->chunk_shift;
+
+    for(shift = memory->chunk_shift; shift < memory->block_shift; shift++) {
+        step = 1U << (shift - 2 > NST_MEMORY_CLASS_MIN_SHIFT
+                ? shift - 2 : NST_MEMORY_CLASS_MIN_SHIFT);
+
+        memory->class_base[shift] = n;
+
+        for(size = (1U << shift) + step; size <= 1U << (shift + 1);
+                size += step) {
+
+            memory->class[n++].size = size;
+        }
+    }
+
+    for(shift = 0; shift < n; shift++) {
+        memory->class[shift].per_block = memory->block_size
+            / memory->class[shift].size;
+
+        memory->class[shift].requested = 0;
+        memory->class[shift].allocs    = 0;
+    }
+
+    return n;
+}
 
 struct nst_memory *nst_memory_create(char *name, uint64_t size,
-        uint32_t block_size, uint32_t chunk_size) {
+        uint32_t block_size, uint32_t chunk_size, struct nst_memory_conf *conf) {
+
+    uint64_t page_size;
+    int hugepage;
 
     uint8_t *p;
     struct nst_memory *memory;
@@ -66,10 +287,9 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
     size = (size + block_size - 1) / block_size * block_size;
 
     /* create shared memory */
-    p = (uint8_t *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED,
-            -1, 0);
+    p = _nst_memory_map(name, &size, conf, &page_size, &hugepage);
 
-    if(p == MAP_FAILED) {
+    if(!p) {
         fprintf(stderr, "Out of memory when initialization.\n");
         return NULL;
     }
@@ -85,6 +305,8 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
     memory->stop       = p + size;
     memory->block_size = block_size;
     memory->chunk_size = chunk_size;
+    memory->page_size  = page_size;
+    memory->hugepage   = hugepage;
 
     p += sizeof(struct nst_memory);
 
@@ -96,7 +318,7 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
     for(n = NST_MEMORY_BLOCK_MIN_SHIFT; (1ULL << n) < block_size; n++) { }
 
     memory->block_shift = n;
-    memory->chunks      = n - memory->chunk_shift + 1;
+    memory->chunks      = _nst_memory_class_init(memory);
     memory->chunk       = (struct nst_memory_ctrl **)p;
 
     p += memory->chunks * sizeof(struct nst_memory_ctrl *);
@@ -104,6 +326,15 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
     memory->block = (struct nst_memory_ctrl *)p;
     memory->empty = NULL;
     memory->full  = NULL;
+    memory->used  = 0;
+
+    memory->span_blocks = 0;
+    memory->run_blocks  = 0;
+    memory->moved       = 0;
+
+    for(n = 0; n < NST_MEMORY_RUN_BUCKETS; n++) {
+        memory->run[n] = NULL;
+    }
 
     bitmap_size = block_size / chunk_size / 8;
 
@@ -141,6 +372,13 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
         return NULL;
     }
 
+    memory->zone = -1;
+
+    if(nst_memory_zones < NST_MEMORY_MAGAZINE_ZONES) {
+        memory->zone = nst_memory_zones;
+        nst_memory_zone[nst_memory_zones++] = memory;
+    }
+
     /* initialize chunk */
     for(n = 0; n < memory->chunks; n++) {
         memory->chunk[n] = NULL;
@@ -160,18 +398,17 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
 void *_nst_memory_block_alloc(struct nst_memory *memory,
         struct nst_memory_ctrl *block, int chunk_idx) {
 
-    int chunk_size = 1<<(memory->chunk_shift + chunk_idx);
+    int chunk_size = memory->class[chunk_idx].size;
     int block_idx  = block - memory->block;
 
-    int bits_need  = memory->block_size / chunk_size;
+    int bits_need  = memory->class[chunk_idx].per_block;
     int bits_idx   = 0;
     int i          = 0;
     int unset      = 1;
     int full       = 1;
 
     /* use info, should not use anymore */
-    if(chunk_size * NST_MEMORY_INFO_BITMAP_BITS >= memory->block_size) {
-        uint32_t mask =  ~0U >> (NST_MEMORY_INFO_BITMAP_BITS - bits_need);
+    if(bits_need <= NST_MEMORY_INFO_BITMAP_BITS) {
         uint32_t *v   = (uint32_t *)(&block->info) + 1;
         uint32_t t    = *v;
 
@@ -179,7 +416,7 @@ void *_nst_memory_block_alloc(struct nst_memory *memory,
         bits_idx      = __builtin_ffs(~t) - 1;
         /* set rightmost 0 to 1 */
         *v           |= *v + 1;
-        full          = (mask == *v);
+        full          = (~0U == *v);
     }
     /* use bitmap */
     else {
@@ -189,7 +426,7 @@ void *_nst_memory_block_alloc(struct nst_memory *memory,
         i     = 0;
         unset = 1;
 
-        for(i = 0; i < bits_need / 64; i++) {
+        for(i = 0; i < (bits_need + 63) / 64; i++) {
             uint64_t *v = begin + i;
 
             if(*v == ~0ULL && unset) {
@@ -215,10 +452,14 @@ void *_nst_memory_block_alloc(struct nst_memory *memory,
     if(full) {
         _nst_memory_block_set_full(block);
         /* remove from chunk list */
-        memory->chunk[chunk_idx] = block->next;
+        if(block->prev) {
+            block->prev->next = block->next;
+        } else {
+            memory->chunk[chunk_idx] = block->next;
+        }
 
         if(block->next) {
-            block->next->prev = NULL;
+            block->next->prev = block->prev;
         }
 
         /* add to full list */
@@ -237,10 +478,17 @@ void *_nst_memory_block_alloc(struct nst_memory *memory,
             + chunk_size * bits_idx);
 }
 
+/* bits past the last chunk of a block, in the last 64 bits word */
+static inline uint64_t _nst_memory_block_padding(int bits) {
+    return bits % 64 ? ~0ULL << (bits % 64) : 0;
+}
+
 void _nst_memory_block_init(struct nst_memory * memory,
         struct nst_memory_ctrl *block, int chunk_idx) {
 
     struct nst_memory_ctrl *chunk;
+    int bits = memory->class[chunk_idx].per_block;
+
     chunk       = memory->chunk[chunk_idx];
     block->info = 0;
     _nst_memory_block_set_type(block, chunk_idx);
@@ -248,6 +496,13 @@ void _nst_memory_block_init(struct nst_memory * memory,
 
     memset(block->bitmap, 0, memory->block_size / memory->chunk_size / 8);
 
+    if(bits <= NST_MEMORY_INFO_BITMAP_BITS) {
+        block->info |= (_nst_memory_block_padding(bits) & 0xFFFFFFFFULL) << 32;
+    } else {
+        *((uint64_t *)block->bitmap + (bits - 1) / 64) =
+            _nst_memory_block_padding(bits);
+    }
+
     block->prev = NULL;
     block->next = NULL;
 
@@ -260,15 +515,209 @@ void _nst_memory_block_init(struct nst_memory * memory,
     memory->chunk[chunk_idx] = block;
 }
 
-void *nst_memory_alloc_locked(struct nst_memory *memory, int size) {
-    int i, chunk_idx = 0;
+static inline int _nst_memory_chunk_idx(struct nst_memory *memory, int size) {
+    int shift, step;
+
+    if(size <= memory->class[0].size) {
+        return 0;
+    }
+
+    /* 1 << shift < size <= 1 << (shift + 1) */
+    shift = 31 - __builtin_clz(size - 1);
+    step  = shift - 2 > NST_MEMORY_CLASS_MIN_SHIFT
+        ? shift - 2 : NST_MEMORY_CLASS_MIN_SHIFT;
+
+    return memory->class_base[shift] + ((size - 1 - (1 << shift)) >> step);
+}
+
+static inline int _nst_memory_run_bucket(uint32_t len) {
+    return 31 - __builtin_clz(len);
+}
+
+static void _nst_memory_run_add(struct nst_memory *memory, int idx,
+        uint32_t len) {
+
+    struct nst_memory_ctrl *block = &memory->block[idx];
+    int bucket = _nst_memory_run_bucket(len);
+
+    block->info = (uint64_t)len << 32;
+    _nst_memory_block_set_type(block, NST_MEMORY_TYPE_RUN);
+    _nst_memory_block_set_inited(block);
+
+    if(len > 1) {
+        struct nst_memory_ctrl *tail = &memory->block[idx + len - 1];
+
+        tail->info = (uint64_t)len << 32;
+        _nst_memory_block_set_type(tail, NST_MEMORY_TYPE_RUN_TAIL);
+        _nst_memory_block_set_inited(tail);
+    }
+
+    block->prev = NULL;
+    block->next = memory->run[bucket];
+
+    if(block->next) {
+        block->next->prev = block;
+    }
+
+    memory->run[bucket] = block;
+    memory->run_blocks += len;
+}
+
+static void _nst_memory_run_remove(struct nst_memory *memory,
+        struct nst_memory_ctrl *block) {
+
+    uint32_t len = _nst_memory_block_len(block);
+
+    if(block->prev) {
+        block->prev->next = block->next;
+    } else {
+        memory->run[_nst_memory_run_bucket(len)] = block->next;
+    }
+
+    if(block->next) {
+        block->next->prev = block->prev;
+    }
+
+    block->prev = NULL;
+    block->next = NULL;
+    memory->run_blocks -= len;
+}
+
+/*
+ * Take len blocks from the free runs, first fit in the bucket of len then
+ * any run of a larger bucket, the rest of the run is put back.
+ * Return the index of the first block, -1 if none
+ */
+static int _nst_memory_run_take(struct nst_memory *memory, uint32_t len) {
+    struct nst_memory_ctrl *block = NULL;
+    uint32_t found;
+    int bucket, idx;
+
+    for(bucket = _nst_memory_run_bucket(len);
+            bucket < NST_MEMORY_RUN_BUCKETS; bucket++) {
+
+        for(block = memory->run[bucket]; block; block = block->next) {
+
+            if(_nst_memory_block_len(block) >= len) {
+                break;
+            }
+        }
+
+        if(block) {
+            break;
+        }
+    }
+
+    if(!block) {
+        return -1;
+    }
+
+    idx   = block - memory->block;
+    found = _nst_memory_block_len(block);
+
+    _nst_memory_run_remove(memory, block);
+
+    if(found > len) {
+        _nst_memory_run_add(memory, idx + len, found - len);
+    }
+
+    return idx;
+}
+
+/*
+ * Allocate contiguous blocks for size larger than block_size, from the
+ * free runs first, then from the unused blocks
+ */
+static void *_nst_memory_span_alloc(struct nst_memory *memory, uint64_t size) {
+    uint64_t len = (size + memory->block_size - 1) / memory->block_size;
+    int idx, i;
+
+    if(len > ~0U) {
+        return NULL;
+    }
+
+    idx = _nst_memory_run_take(memory, len);
+
+    if(idx < 0) {
+
+        if(memory->data.free + (len - 1) * memory->block_size
+                > memory->data.end) {
+
+            return NULL;
+        }
+
+        idx = (memory->data.free - memory->data.begin) / memory->block_size;
+        memory->data.free += len * memory->block_size;
+    }
+
+    for(i = 0; i < len; i++) {
+        memory->block[idx + i].info = 0;
+        memory->block[idx + i].prev = NULL;
+        memory->block[idx + i].next = NULL;
+        _nst_memory_block_set_type(&memory->block[idx + i],
+                i ? NST_MEMORY_TYPE_SPAN_BODY : NST_MEMORY_TYPE_SPAN);
+        _nst_memory_block_set_inited(&memory->block[idx + i]);
+    }
+
+    memory->block[idx].info |= len << 32;
+
+    memory->span_blocks += len;
+    memory->used        += len * memory->block_size;
+
+    return memory->data.begin + 1ULL * memory->block_size * idx;
+}
+
+/*
+ * Return the blocks of a span to the free runs, merged with the runs before
+ * and after it
+ */
+static void _nst_memory_span_free(struct nst_memory *memory, int idx) {
+    uint32_t len = _nst_memory_block_len(&memory->block[idx]);
+    int blocks   = (memory->data.free - memory->data.begin)
+        / memory->block_size;
+
+    struct nst_memory_ctrl *block;
+
+    memory->span_blocks -= len;
+    memory->used        -= 1ULL * len * memory->block_size;
+
+    if(idx + len < blocks) {
+        block = &memory->block[idx + len];
+
+        if(_nst_memory_block_type(block) == NST_MEMORY_TYPE_RUN) {
+            len += _nst_memory_block_len(block);
+            _nst_memory_run_remove(memory, block);
+        }
+    }
+
+    if(idx > 0) {
+        block = &memory->block[idx - 1];
+
+        if(_nst_memory_block_type(block) == NST_MEMORY_TYPE_RUN
+                || _nst_memory_block_type(block) == NST_MEMORY_TYPE_RUN_TAIL) {
+
+            idx -= _nst_memory_block_len(block);
+            len += _nst_memory_block_len(block);
+            _nst_memory_run_remove(memory, &memory->block[idx]);
+        }
+    }
+
+    _nst_memory_run_add(memory, idx, len);
+}
+
+static void *_nst_memory_alloc_locked(struct nst_memory *memory, int size) {
+    int chunk_idx, block_idx;
     struct nst_memory_ctrl *chunk, *block;
 
-    if(!size || size > memory->block_size) {
+    if(size <= 0) {
         return NULL;
     }
 
-    for(i = (size - 1) >> (memory->chunk_shift - 1); i >>= 1; chunk_idx++) {}
+    if(size > memory->block_size) {
+        return _nst_memory_span_alloc(memory, size);
+    }
+
+    chunk_idx = _nst_memory_chunk_idx(memory, size);
 
     chunk = memory->chunk[chunk_idx];
 
@@ -290,7 +739,7 @@ void *nst_memory_alloc_locked(struct nst_memory *memory, int size) {
     }
     /* require new block from unused */
     else if(memory->data.free <= memory->data.end) {
-        int block_idx      = (memory->data.free - memory->data.begin)
+        block_idx          = (memory->data.free - memory->data.begin)
             / memory->block_size;
 
         memory->data.free += memory->block_size;
@@ -302,15 +751,91 @@ void *nst_memory_alloc_locked(struct nst_memory *memory, int size) {
             _nst_memory_block_init(memory, block, chunk_idx);
         }
     }
+    /* split one block from the free runs */
+    else if((block_idx = _nst_memory_run_take(memory, 1)) >= 0) {
+        block = &memory->block[block_idx];
+        _nst_memory_block_init(memory, block, chunk_idx);
+    }
     else {
         return NULL;
     }
 
+    memory->used += memory->class[chunk_idx].size;
+
     return _nst_memory_block_alloc(memory, block, chunk_idx);
 }
 
+void *nst_memory_alloc_locked(struct nst_memory *memory, int size) {
+    void *p = _nst_memory_alloc_locked(memory, size);
+
+    if(p && size <= memory->block_size) {
+        struct nst_memory_class *class;
+
+        class = &memory->class[_nst_memory_chunk_idx(memory, size)];
+
+        HA_ATOMIC_ADD(&class->requested, size);
+        HA_ATOMIC_ADD(&class->allocs, 1);
+    }
+
+    return p;
+}
+
 void *nst_memory_alloc(struct nst_memory *memory, int size) {
+    struct nst_memory_magazine *magazine;
+    struct nst_memory_parked *parked;
+    int chunk_idx;
     void *p;
+
+    if(memory->zone >= 0 && (parked = nst_memory_parked[memory->zone])
+            && size > 0 && size <= memory->block_size) {
+
+        chunk_idx = _nst_memory_chunk_idx(memory, size);
+
+        if(chunk_idx < NST_MEMORY_MAGAZINE_CLASSES) {
+            magazine = &nst_memory_magazine[memory->zone][chunk_idx];
+
+            if(!magazine->count) {
+                nst_shctx_lock(memory);
+
+                while(magazine->count < NST_MEMORY_MAGAZINE_BATCH) {
+                    p = _nst_memory_alloc_locked(memory,
+                            memory->class[chunk_idx].size);
+
+                    if(!p) {
+                        break;
+                    }
+
+                    magazine->chunk[magazine->count++] = p;
+                }
+
+                nst_shctx_unlock(memory);
+
+                if(!magazine->count) {
+                    return NULL;
+                }
+
+                parked->bytes += 1ULL * magazine->count
+                    * memory->class[chunk_idx].size;
+            }
+
+            parked->bytes -= memory->class[chunk_idx].size;
+
+            magazine->requested += size;
+
+            if(++magazine->allocs == NST_MEMORY_MAGAZINE_SIZE) {
+                HA_ATOMIC_ADD(&memory->class[chunk_idx].requested,
+                        magazine->requested);
+                HA_ATOMIC_ADD(&memory->class[chunk_idx].allocs,
+                        magazine->allocs);
+
+                magazine->requested = 0;
+                magazine->allocs    = 0;
+            }
+
+            return magazine->chunk[--magazine->count];
+        }
+    }
+
     nst_shctx_lock(memory);
     p = nst_memory_alloc_locked(memory, size);
     nst_shctx_unlock(memory);
@@ -329,41 +854,63 @@ void nst_memory_free_locked(struct nst_memory *memory, void *p) {
     block_idx  = ((uint8_t *)p - memory->data.begin) / memory->block_size;
     block      = &memory->block[block_idx];
     chunk_idx  = block->info & 0xFF;
+
+    if(chunk_idx == NST_MEMORY_TYPE_SPAN) {
+
+        if((uint8_t *)p == memory->data.begin
+                + 1ULL * block_idx * memory->block_size) {
+
+            _nst_memory_span_free(memory, block_idx);
+        }
+
+        return;
+    }
+
+    if(chunk_idx >= memory->chunks) {
+        return;
+    }
     chunk      = memory->chunk[chunk_idx];
-    chunk_size = 1<<(memory->chunk_shift + chunk_idx);
-    bits       = memory->block_size / chunk_size;
+    chunk_size = memory->class[chunk_idx].size;
+    bits       = memory->class[chunk_idx].per_block;
     bits_idx   = ((uint8_t *)p
             - (memory->data.begin + block_idx * memory->block_size))
         / chunk_size;
 
+    memory->used -= chunk_size;
+
     empty      = 0;
     full       = _nst_memory_block_is_full(block);
     _nst_memory_block_clear_full(block);
 
     /* info used */
-    if(chunk_size * NST_MEMORY_INFO_BITMAP_BITS >= memory->block_size) {
+    if(bits <= NST_MEMORY_INFO_BITMAP_BITS) {
         block->info &= ~(1ULL << (bits_idx + 32));
 
-        if(!(block->info & 0xFFFFFFFF00000000ULL)) {
+        if((block->info >> 32)
+                == (_nst_memory_block_padding(bits) & 0xFFFFFFFFULL)) {
+
             empty = 1;
         }
     }
     /* bitmap used */
     else {
-        int i;
+        int i, words = (bits + 63) / 64;
         *((uint64_t *)block->bitmap + bits_idx / 64 ) &=
             ~(1ULL<<(bits_idx % 64));
 
-        for(i = 0; i < bits / 64; i++) {
+        empty = 1;
+
+        for(i = 0; i < words - 1; i++) {
 
-            if(*((uint64_t *)block->bitmap + i) == 0) {
-                empty += 64;
+            if(*((uint64_t *)block->bitmap + i) != 0) {
+                empty = 0;
+                break;
             }
         }
 
-        if(empty == bits) {
-            empty = 1;
-        } else {
+        if(*((uint64_t *)block->bitmap + words - 1)
+                != _nst_memory_block_padding(bits)) {
+
             empty = 0;
         }
     }
@@ -456,8 +1003,296 @@ void nst_memory_free_locked(struct nst_memory *memory, void *p) {
 }
 
 void nst_memory_free(struct nst_memory *memory, void *p) {
+    struct nst_memory_magazine *magazine;
+    struct nst_memory_parked *parked;
+    int block_idx, chunk_idx;
+
+    /* data.free only grows, an allocated chunk is always below it */
+    if(memory->zone >= 0 && (parked = nst_memory_parked[memory->zone])
+            && (uint8_t *)p >= memory->data.begin
+            && (uint8_t *)p < memory->data.free) {
+
+        block_idx = ((uint8_t *)p - memory->data.begin) / memory->block_size;
+        chunk_idx = memory->block[block_idx].info & 0xFF;
+
+        if(chunk_idx < NST_MEMORY_MAGAZINE_CLASSES) {
+            magazine = &nst_memory_magazine[memory->zone][chunk_idx];
+
+            if(magazine->count == NST_MEMORY_MAGAZINE_SIZE) {
+                nst_shctx_lock(memory);
+
+                while(magazine->count > NST_MEMORY_MAGAZINE_SIZE
+                        - NST_MEMORY_MAGAZINE_BATCH) {
+
+                    nst_memory_free_locked(memory,
+                            magazine->chunk[--magazine->count]);
+                }
+
+                nst_shctx_unlock(memory);
+
+                parked->bytes -= 1ULL * NST_MEMORY_MAGAZINE_BATCH
+                    * memory->class[chunk_idx].size;
+            }
+
+            magazine->chunk[magazine->count++] = p;
+            parked->bytes += memory->class[chunk_idx].size;
+
+            return;
+        }
+    }
+
     nst_shctx_lock(memory);
     nst_memory_free_locked(memory, p);
     nst_shctx_unlock(memory);
 }
 
+/* chunks in use in a block of a size class */
+static int _nst_memory_block_used(struct nst_memory *memory,
+        struct nst_memory_ctrl *block) {
+
+    int bits = memory->class[_nst_memory_block_type(block)].per_block;
+    int i, used;
+
+    if(bits <= NST_MEMORY_INFO_BITMAP_BITS) {
+        return __builtin_popcount(block->info >> 32)
+            - __builtin_popcountll(_nst_memory_block_padding(bits)
+                    & 0xFFFFFFFFULL);
+    }
+
+    used = -__builtin_popcountll(_nst_memory_block_padding(bits));
+
+    for(i = 0; i < (bits + 63) / 64; i++) {
+        used += __builtin_popcountll(*((uint64_t *)block->bitmap + i));
+    }
+
+    return used;
+}
+
+/*
+ * Walk the blocks and report per size class: blocks, full blocks, blocks
+ * in the chunk list, bytes used by chunks, free in these blocks, wasted at
+ * the end of the blocks and lost to rounding, estimated from the average
+ * size asked. Chunks in magazines are used.
+ */
+void nst_memory_stats_dump(struct buffer *buf, struct nst_memory *memory,
+        const char *prefix) {
+
+    struct nst_memory_class *class;
+    struct nst_memory_ctrl *block;
+    uint64_t blocks[NST_MEMORY_CLASS_MAX]  = { 0 };
+    uint64_t full[NST_MEMORY_CLASS_MAX]    = { 0 };
+    uint64_t partial[NST_MEMORY_CLASS_MAX] = { 0 };
+    uint64_t used[NST_MEMORY_CLASS_MAX]    = { 0 };
+    uint64_t empty = 0, span = 0, run = 0, rounding;
+    int i, n, type;
+
+    nst_shctx_lock(memory);
+
+    n = (memory->data.free - memory->data.begin) / memory->block_size;
+
+    for(i = 0; i < n; i++) {
+        block = &memory->block[i];
+        type  = _nst_memory_block_type(block);
+
+        if(type < memory->chunks) {
+            int chunks = _nst_memory_block_used(memory, block);
+
+            /* in the empty list */
+            if(!chunks) {
+                continue;
+            }
+
+            blocks[type]++;
+            used[type] += chunks;
+
+            if(_nst_memory_block_is_full(block)) {
+                full[type]++;
+            }
+        } else if(type == NST_MEMORY_TYPE_SPAN) {
+            span += _nst_memory_block_len(block);
+            i    += _nst_memory_block_len(block) - 1;
+        } else if(type == NST_MEMORY_TYPE_RUN) {
+            run  += _nst_memory_block_len(block);
+            i    += _nst_memory_block_len(block) - 1;
+        }
+    }
+
+    for(i = 0; i < memory->chunks; i++) {
+
+        for(block = memory->chunk[i]; block; block = block->next) {
+            partial[i]++;
+        }
+    }
+
+    for(block = memory->empty; block; block = block->next) {
+        empty++;
+    }
+
+    for(i = 0; i < memory->chunks; i++) {
+        class = &memory->class[i];
+
+        if(!blocks[i]) {
+            continue;
+        }
+
+        rounding = 0;
+
+        if(class->allocs && class->requested < class->allocs * class->size) {
+            rounding = used[i] * class->size
+                - used[i] * class->requested / class->allocs;
+        }
+
+        chunk_appendf(buf, "%s.class.%u: blocks=%"PRIu64" full=%"PRIu64
+                " partial=%"PRIu64" used=%"PRIu64" free=%"PRIu64
+                " waste=%"PRIu64" rounding=%"PRIu64"\n", prefix, class->size,
+                blocks[i], full[i], partial[i], used[i] * class->size,
+                (blocks[i] * class->per_block - used[i]) * class->size,
+                blocks[i] * (memory->block_size
+                    - class->per_block * class->size), rounding);
+    }
+
+    chunk_appendf(buf, "%s.blocks: total=%d unused=%d empty=%"PRIu64
+            " span=%"PRIu64" run=%"PRIu64" moved=%"PRIu64"\n", prefix,
+            memory->blocks, memory->blocks - n, empty, span, run,
+            memory->moved);
+
+    nst_shctx_unlock(memory);
+}
+
+/*
+ * Move the chunk p out of its block if the block is sparse, into a fuller
+ * block of the same size class, so that the sparse block can become empty.
+ * The caller must make sure nobody else references p.
+ * Return the new address, or NULL if p stays.
+ */
+void *nst_memory_defrag(struct nst_memory *memory, void *p) {
+    struct nst_memory_ctrl *block, *target;
+    void *q = NULL;
+    int block_idx, chunk_idx, used, tries;
+
+    if((uint8_t *)p < memory->data.begin || (uint8_t *)p >= memory->data.free) {
+        return NULL;
+    }
+
+    nst_shctx_lock(memory);
+
+    block_idx = ((uint8_t *)p - memory->data.begin) / memory->block_size;
+    block     = &memory->block[block_idx];
+    chunk_idx = _nst_memory_block_type(block);
+
+    if(chunk_idx >= memory->chunks || _nst_memory_block_is_full(block)) {
+        goto out;
+    }
+
+    used = _nst_memory_block_used(memory, block);
+
+    if(used * NST_MEMORY_DEFRAG_SPARSE > memory->class[chunk_idx].per_block) {
+        goto out;
+    }
+
+    tries  = NST_MEMORY_DEFRAG_TRIES;
+    target = memory->chunk[chunk_idx];
+
+    while(target && tries--) {
+
+        if(target != block && _nst_memory_block_used(memory, target) > used) {
+            break;
+        }
+
+        target = target->next;
+    }
+
+    if(!target || tries < 0) {
+        goto out;
+    }
+
+    q = _nst_memory_block_alloc(memory, target, chunk_idx);
+
+    memory->used += memory->class[chunk_idx].size;
+
+    memcpy(q, p, memory->class[chunk_idx].size);
+    nst_memory_free_locked(memory, p);
+    memory->moved++;
+
+out:
+    nst_shctx_unlock(memory);
+
+    return q;
+}
+
+/*
+ * Take a parked slot in each zone, shared by all processes, a thread without
+ * one goes to the zone for each chunk.
+ */
+int nst_memory_magazine_init() {
+    int i, slot;
+
+    for(i = 0; i < nst_memory_zones; i++) {
+        slot = HA_ATOMIC_XADD(&nst_memory_zone[i]->parked_slots, 1);
+
+        if(slot < NST_MEMORY_MAGAZINE_THREADS) {
+            nst_memory_parked[i] = &nst_memory_zone[i]->parked[slot];
+        }
+    }
+
+    return 1;
+}
+
+/* bytes allocated, less the chunks parked in the magazines of all threads */
+uint64_t nst_memory_in_use(struct nst_memory *memory) {
+    uint64_t used = memory->used, parked = 0;
+    int i, slots = memory->parked_slots;
+
+    if(slots > NST_MEMORY_MAGAZINE_THREADS) {
+        slots = NST_MEMORY_MAGAZINE_THREADS;
+    }
+
+    for(i = 0; i < slots; i++) {
+        parked += memory->parked[i].bytes;
+    }
+
+    /* a flush may be done with used but not yet with parked */
+    return used > parked ? used - parked : 0;
+}
+
+/*
+ * Give the cached chunks back to their zones
+ */
+void nst_memory_magazine_flush() {
+    struct nst_memory_magazine *magazine;
+    int i, j;
+
+    for(i = 0; i < nst_memory_zones; i++) {
+        nst_shctx_lock(nst_memory_zone[i]);
+
+        for(j = 0; j < NST_MEMORY_MAGAZINE_CLASSES; j++) {
+            magazine = &nst_memory_magazine[i][j];
+
+            if(magazine->allocs) {
+                HA_ATOMIC_ADD(&nst_memory_zone[i]->class[j].requested,
+                        magazine->requested);
+                HA_ATOMIC_ADD(&nst_memory_zone[i]->class[j].allocs,
+                        magazine->allocs);
+
+                magazine->requested = 0;
+                magazine->allocs    = 0;
+            }
+
+            while(magazine->count) {
+                nst_memory_free_locked(nst_memory_zone[i],
+                        magazine->chunk[--magazine->count]);
+            }
+        }
+
+        nst_shctx_unlock(nst_memory_zone[i]);
+
+        if(nst_memory_parked[i]) {
+            nst_memory_parked[i]->bytes = 0;
+            nst_memory_parked[i]        = NULL;
+        }
+    }
+}
+
+REGISTER_PER_THREAD_INIT(nst_memory_magazine_init);
+REGISTER_PER_THREAD_DEINIT(nst_memory_magazine_flush);
+
@@ -48,22 +48,15 @@ static int _nst_nosql_dict_resize(uint64_t size) {
 static int _nst_nosql_dict_alloc(uint64_t size) {
     int i;
     int entry_size = sizeof(struct nst_nosql_entry*);
-    int block_size = global.nuster.nosql.memory->block_size;
 
     nuster.nosql->dict[0].size  = size / entry_size;
     nuster.nosql->dict[0].used  = 0;
-    nuster.nosql->dict[0].entry = nst_nosql_memory_alloc(block_size);
+    nuster.nosql->dict[0].entry = nst_nosql_memory_alloc(size);
 
     if(!nuster.nosql->dict[0].entry) {
         return NST_ERR;
     }
 
-    for(i = 1; i < size / block_size; i++) {
-        if(!nst_nosql_memory_alloc(block_size)) {
-            return NST_ERR;
-        }
-    }
-
     for(i = 0; i < nuster.nosql->dict[0].size; i++) {
         nuster.nosql->dict[0].entry[i] = NULL;
     }
@@ -79,6 +72,35 @@ int nst_nosql_dict_init() {
     return _nst_nosql_dict_alloc(size);
 }
 
+/*
+ * Create an entry with a copy of key right after it, and room for an inline
+ * value of len bytes after the key
+ */
+static struct nst_nosql_entry *_nst_nosql_entry_new(char *key, uint32_t key_len,
+        uint32_t len) {
+
+    struct nst_nosql_entry *entry;
+    uint64_t size = sizeof(*entry) + key_len + len;
+
+    if(key_len > UINT16_MAX || size > global.nuster.nosql.memory->block_size) {
+        return NULL;
+    }
+
+    entry = nst_nosql_memory_alloc(size);
+
+    if(entry) {
+        memset(entry, 0, sizeof(*entry));
+        memcpy(nst_nosql_entry_key(entry), key, key_len);
+        entry->key_len = key_len;
+    }
+
+    return entry;
+}
+
+static void _nst_nosql_entry_free(struct nst_nosql_entry *entry) {
+    nst_nosql_memory_free(entry);
+}
+
 static int _nst_nosql_dict_rehashing() {
     return 0;
     //return nuster.nosql->rehash_idx != -1;
@@ -162,6 +184,20 @@ void nst_nosql_dict_cleanup() {
 
     while(entry) {
 
+        /* keep disk only entries as the index of their files */
+        if(entry->state == NST_NOSQL_ENTRY_STATE_INVALID && entry->file
+                && !nst_nosql_dict_entry_expired(entry)) {
+
+            if(entry->data) {
+                entry->data->invalid = 1;
+                entry->data          = NULL;
+            }
+
+            prev  = entry;
+            entry = entry->next;
+            continue;
+        }
+
         if(nst_nosql_entry_invalid(entry)) {
             struct nst_nosql_entry *tmp = entry;
 
@@ -179,10 +215,7 @@ void nst_nosql_dict_cleanup() {
             }
 
             entry = entry->next;
-            nst_nosql_memory_free(tmp->key);
-            nst_nosql_memory_free(tmp->host.data);
-            nst_nosql_memory_free(tmp->path.data);
-            nst_nosql_memory_free(tmp);
+            _nst_nosql_entry_free(tmp);
             nuster.nosql->dict[0].used--;
         } else {
             prev  = entry;
@@ -211,15 +244,16 @@ struct nst_nosql_entry *nst_nosql_dict_set(struct nst_nosql_ctx *ctx) {
     dict = _nst_nosql_dict_rehashing()
         ? &nuster.nosql->dict[1] : &nuster.nosql->dict[0];
 
-    entry = nst_nosql_memory_alloc(sizeof(*entry));
-    if(!entry) {
+    data = nst_nosql_data_new();
+
+    if(!data) {
         return NULL;
     }
 
-    data = nst_nosql_data_new();
+    entry = _nst_nosql_entry_new(ctx->key->area, ctx->key->data, 0);
 
-    if(!data) {
-        nst_nosql_memory_free(entry);
+    if(!entry) {
+        data->invalid = 1;
         return NULL;
     }
 
@@ -232,22 +266,12 @@ struct nst_nosql_entry *nst_nosql_dict_set(struct nst_nosql_ctx *ctx) {
     /* init entry */
     entry->data   = data;
     entry->state  = NST_NOSQL_ENTRY_STATE_CREATING;
-    entry->key    = ctx->key;
     entry->hash   = ctx->hash;
-    ctx->key      = NULL;
     entry->expire = 0;
-    entry->rule   = ctx->rule;
-    entry->pid    = ctx->pid;
 
-    entry->header_len = ctx->header_len;
-
-    entry->host.data   = ctx->req.host.data;
-    entry->host.len    = ctx->req.host.len;
-    ctx->req.host.data = NULL;
-
-    entry->path.data   = ctx->req.path.data;
-    entry->path.len    = ctx->req.path.len;
-    ctx->req.path.data = NULL;
+    if(ctx->rule->disk == NST_DISK_ASYNC) {
+        entry->flags |= NST_NOSQL_ENTRY_FLAG_ASYNC;
+    }
 
     return entry;
 }
@@ -269,19 +293,24 @@ struct nst_nosql_entry *nst_nosql_dict_get(struct buffer *key, uint64_t hash) {
 
         while(entry) {
 
-            if(entry->hash == hash
-                    && entry->key->data == key->data
-                    && !memcmp(entry->key->area, key->area, key->data)) {
+            if(entry->hash == hash && entry->key_len == key->data
+                    && !memcmp(nst_nosql_entry_key(entry), key->area,
+                        key->data)) {
+
                 /* check expire
                  * change state only, leave the free stuff to cleanup
                  * */
                 if(entry->state == NST_NOSQL_ENTRY_STATE_VALID
                         && nst_nosql_dict_entry_expired(entry)) {
 
-                    entry->state         = NST_NOSQL_ENTRY_STATE_EXPIRED;
-                    entry->data->invalid = 1;
-                    entry->data          = NULL;
-                    entry->expire        = 0;
+                    entry->state  = NST_NOSQL_ENTRY_STATE_EXPIRED;
+                    entry->expire = 0;
+
+                    if(entry->data) {
+                        entry->data->invalid = 1;
+                        entry->data          = NULL;
+                    }
+
                     return NULL;
                 }
 
@@ -299,29 +328,99 @@ struct nst_nosql_entry *nst_nosql_dict_get(struct buffer *key, uint64_t hash) {
     return NULL;
 }
 
+/*
+ * Replace entry in its bucket by an inline copy with room for a value of len
+ * bytes, and its content type. Returns the new entry, or NULL if entry is no
+ * longer being created or there is no memory, entry is then left as is.
+ */
+struct nst_nosql_entry *nst_nosql_dict_inline(struct nst_nosql_entry *entry,
+        struct nst_str *type, uint32_t len) {
+
+    struct nst_nosql_entry *inl, **link = NULL;
+    uint8_t *p;
+    int i;
+
+    if(entry->state != NST_NOSQL_ENTRY_STATE_CREATING) {
+        return NULL;
+    }
+
+    for(i = 0; i <= 1 && !link; i++) {
+
+        if(!nuster.nosql->dict[i].size) {
+            continue;
+        }
+
+        link = &nuster.nosql->dict[i].entry[entry->hash
+            % nuster.nosql->dict[i].size];
+
+        while(*link && *link != entry) {
+            link = &(*link)->next;
+        }
+
+        if(!*link) {
+            link = NULL;
+        }
+    }
+
+    if(!link) {
+        return NULL;
+    }
+
+    inl = _nst_nosql_entry_new(nst_nosql_entry_key(entry), entry->key_len,
+            NST_NOSQL_ENTRY_INLINE_HEADER + type->len + len);
+
+    if(!inl) {
+        return NULL;
+    }
+
+    inl->next   = entry->next;
+    inl->hash   = entry->hash;
+    inl->expire = entry->expire;
+    inl->state  = NST_NOSQL_ENTRY_STATE_VALID;
+    inl->flags  = NST_NOSQL_ENTRY_FLAG_INLINE;
+
+    p    = nst_nosql_entry_inline(inl);
+    p[0] = len & 0xff;
+    p[1] = len >> 8;
+    p[2] = type->len;
+
+    memcpy(nst_nosql_entry_type(inl), type->data, type->len);
+
+    *link = inl;
+    _nst_nosql_entry_free(entry);
+
+    return inl;
+}
+
 int nst_nosql_dict_set_from_disk(char *file, char *meta, struct buffer *key) {
     struct nst_nosql_dict  *dict  = NULL;
     struct nst_nosql_entry *entry = NULL;
+    char *path;
     int idx;
     uint64_t hash = nst_persist_meta_get_hash(meta);
 
     dict = _nst_nosql_dict_rehashing()
         ? &nuster.nosql->dict[1] : &nuster.nosql->dict[0];
 
-    entry = nst_nosql_memory_alloc(sizeof(*entry));
+    path = nst_nosql_memory_alloc(strlen(file) + 1);
 
-    if(!entry) {
+    if(!path) {
         return NST_ERR;
     }
 
-    memset(entry, 0, sizeof(*entry));
-
-    entry->file = nst_nosql_memory_alloc(strlen(file));
+    entry = _nst_nosql_entry_new(key->area, key->data, 0);
 
-    if(!entry->file) {
+    if(!entry) {
+        nst_nosql_memory_free(path);
         return NST_ERR;
     }
 
+    nst_nosql_memory_free(key->area);
+    nst_nosql_memory_free(key);
+
+    memcpy(path, file, strlen(file) + 1);
+    entry->file = path;
+
     idx = hash % dict->size;
     /* prepend entry to dict->entry[idx] */
     entry->next      = dict->entry[idx];
@@ -330,12 +429,8 @@ int nst_nosql_dict_set_from_disk(char *file, char *meta, struct buffer *key) {
 
     /* init entry */
     entry->state  = NST_NOSQL_ENTRY_STATE_INVALID;
-    entry->key    = key;
     entry->hash   = hash;
     entry->expire = nst_persist_meta_get_expire(meta);
-    memcpy(entry->file, file, strlen(file));
-
-    entry->header_len = nst_persist_meta_get_header_len(meta);
 
     return NST_OK;
 }
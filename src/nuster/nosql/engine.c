@@ -57,6 +57,12 @@ static void nst_res_simple2(struct stream *s, int status) {
         case 507:
             code = ist("507");
             break;
+        case 502:
+            code = ist("502");
+            break;
+        case 504:
+            code = ist("504");
+            break;
         default:
             code = ist("500");
     }
@@ -87,32 +93,77 @@ fail:
     channel_htx_truncate(res, htx);
 }
 
-static int _nst_nosql_element_to_htx(struct nst_nosql_element *element,
-        struct htx *htx) {
+/*
+ * Pack a small value into one allocation: the elements first, followed by
+ * their payloads, instead of two allocations per element.
+ */
+static void _nst_nosql_data_pack(struct nst_nosql_data *data) {
+    struct nst_data_element *element, *packed;
+    char *p;
+    int n = 0, i = 0;
+    uint32_t size = 0;
+
+    element = data->element;
 
-    struct htx_blk *blk;
-    char *ptr;
-    uint32_t blksz, sz, info;
-    enum htx_blk_type type;
+    while(element) {
 
-    info = element->msg.len;
-    type = (info >> 28);
-    blksz = ((type == HTX_BLK_HDR || type == HTX_BLK_TLR)
-            ? (info & 0xff) + ((info >> 8) & 0xfffff)
-            : info & 0xfffffff);
+        if(!element->msg.data) {
+            return;
+        }
 
-    blk = htx_add_blk(htx, type, blksz);
+        size += sizeof(*element) + nst_data_element_size(element);
+        n++;
 
-    if(!blk) {
-        return NST_ERR;
+        element = element->next;
+    }
+
+    if(n < 2 || size > NST_NOSQL_DEFAULT_PACK_SIZE) {
+        return;
     }
 
-    blk->info = info;
-    ptr = htx_get_blk_ptr(htx, blk);
-    sz = htx_get_blksz(blk);
-    memcpy(ptr, element->msg.data, sz);
+    packed = nst_nosql_memory_alloc(size);
 
-    return NST_OK;
+    if(!packed) {
+        return;
+    }
+
+    p       = (char *)(packed + n);
+    element = data->element;
+
+    while(element) {
+        struct nst_data_element *tmp = element;
+        uint32_t sz = nst_data_element_size(element);
+
+        packed[i].msg.data = p;
+        packed[i].msg.len  = element->msg.len;
+        packed[i].next     = element->next ? &packed[i + 1] : NULL;
+
+        memcpy(p, element->msg.data, sz);
+
+        p += sz;
+        i++;
+        element = element->next;
+
+        nst_nosql_memory_free(tmp->msg.data);
+        nst_nosql_memory_free(tmp);
+    }
+
+    data->element     = packed;
+    data->info.flags |= NST_NOSQL_DATA_FLAG_PACKED;
+}
+
+/*
+ * The applet releases its reference exactly once, whichever of the
+ * disconnection or the release callback comes first
+ */
+static void _nst_nosql_engine_release_data(struct appctx *appctx) {
+
+    if(appctx->ctx.nuster.nosql_engine.data) {
+        nst_nosql_data_release(appctx->ctx.nuster.nosql_engine.data);
+
+        appctx->ctx.nuster.nosql_engine.data    = NULL;
+        appctx->ctx.nuster.nosql_engine.element = NULL;
+    }
 }
 
 static void nst_nosql_engine_handler(struct appctx *appctx) {
@@ -120,14 +171,14 @@ static void nst_nosql_engine_handler(struct appctx *appctx) {
     struct stream *s                  = si_strm(si);
     struct channel *req               = si_oc(si);
     struct channel *res               = si_ic(si);
-    struct nst_nosql_element *element = NULL;
+    struct nst_data_element *element  = NULL;
     struct htx *req_htx, *res_htx;
-    int ret;
     int total = 0;
     res_htx = htx_from_buf(&res->buf);
+    total = res_htx->data;
 
     if(unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO)) {
-        appctx->ctx.nuster.nosql_engine.data->clients--;
+        _nst_nosql_engine_release_data(appctx);
         return;
     }
 
@@ -137,8 +188,10 @@ static void nst_nosql_engine_handler(struct appctx *appctx) {
         return;
     }
 
-    /* check that the output is not closed */
-    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
+    /* check that the output is not closed, disk hits close their file */
+    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)
+            && appctx->st0 != NST_NOSQL_APPCTX_STATE_HIT_DISK) {
+
         appctx->st0 = NST_NOSQL_CTX_STATE_DONE;
     }
 
@@ -156,7 +209,7 @@ static void nst_nosql_engine_handler(struct appctx *appctx) {
                 element = appctx->ctx.nuster.nosql_engine.element;
 
                 while(element) {
-                    if(_nst_nosql_element_to_htx(element, res_htx) != NST_OK) {
+                    if(nst_data_element_to_htx(element, res_htx) != NST_OK) {
                         si_rx_room_blk(si);
                         goto out;
                     }
@@ -165,7 +218,10 @@ static void nst_nosql_engine_handler(struct appctx *appctx) {
 
                 }
 
-            } else {
+            }
+
+            /* all sent, do not wait for another wakeup to end the message */
+            if(!element) {
 
                 if (!htx_add_endof(res_htx, HTX_BLK_EOM)) {
                     si_rx_room_blk(si);
@@ -192,128 +248,18 @@ out:
             htx_to_buf(res_htx, &res->buf);
             break;
         case NST_NOSQL_APPCTX_STATE_HIT_DISK:
-            {
-                int max = b_room(&res->buf) - global.tune.maxrewrite;
-
-                int fd = appctx->ctx.nuster.nosql_engine.fd;
-                int header_len = appctx->ctx.nuster.nosql_engine.header_len;
-                uint64_t offset = appctx->ctx.nuster.nosql_engine.offset;
-
-                switch(appctx->st1) {
-                    case NST_PERSIST_APPLET_HEADER:
-                        {
-                        char *p = trash.area;
-                        ret = pread(fd, p, header_len, offset);
-
-                        if(ret != header_len) {
-                            appctx->st1 = NST_PERSIST_APPLET_ERROR;
-                            break;
-                        }
-
-                        while(header_len != 0) {
-                            struct htx_blk *blk;
-                            char *ptr;
-                            uint32_t blksz, sz, info;
-                            enum htx_blk_type type;
-
-                            info = *(uint32_t *)p;
-                            type = (info >> 28);
-                            blksz = (info & 0xff) + ((info >> 8) & 0xfffff);
-
-                            blk = htx_add_blk(res_htx, type, blksz);
-
-                            if(!blk) {
-                                appctx->st1 = NST_PERSIST_APPLET_ERROR;
-                                break;
-                            }
-
-                            blk->info = info;
-                            ptr = htx_get_blk_ptr(res_htx, blk);
-                            sz = htx_get_blksz(blk);
-                            p += 4;
-                            memcpy(ptr, p, sz);
-                            p += sz;
-
-                            header_len -= 4 + sz;
-                        }
-
-                        appctx->st1 = NST_PERSIST_APPLET_PAYLOAD;
-                        offset += ret;
-                        appctx->ctx.nuster.nosql_engine.offset += ret;
-                        }
-
-                        break;
-                    case NST_PERSIST_APPLET_PAYLOAD:
-                        max = htx_get_max_blksz(res_htx,
-                                channel_htx_recv_max(res, res_htx));
-
-                        ret = pread(fd, trash.area, max, offset);
-
-                        if(ret == -1) {
-                            appctx->st1 = NST_PERSIST_APPLET_ERROR;
-                            break;
-                        }
-
-                        if(ret > 0) {
-                            struct htx_blk *blk;
-                            char *ptr;
-                            uint32_t blksz, sz, info;
-                            enum htx_blk_type type;
-
-                            type = HTX_BLK_DATA;
-                            info = (type << 28) + ret;
-                            blksz = info & 0xfffffff;
-
-                            blk = htx_add_blk(res_htx, type, blksz);
 
-                            if(!blk) {
-                                appctx->st1 = NST_PERSIST_APPLET_ERROR;
-                                break;
-                            }
-
-                            blk->info = info;
-                            ptr = htx_get_blk_ptr(res_htx, blk);
-                            sz = htx_get_blksz(blk);
-                            memcpy(ptr, trash.area, sz);
-
-                            appctx->ctx.nuster.nosql_engine.offset += ret;
-                            break;
-                        }
-
-                        close(fd);
-
-                        appctx->st1 = NST_PERSIST_APPLET_EOM;
-                    case NST_PERSIST_APPLET_EOM:
-
-                        if (!htx_add_endof(res_htx, HTX_BLK_EOM)) {
-                            si_rx_room_blk(si);
-                            goto out2;
-                        }
-
-                        appctx->st1 = NST_PERSIST_APPLET_DONE;
-                    case NST_PERSIST_APPLET_DONE:
-
-                        if (!(res->flags & CF_SHUTR) ) {
-                            res->flags |= CF_READ_NULL;
-                            si_shutr(si);
-                        }
-
-                        if (co_data(req)) {
-                            req_htx = htx_from_buf(&req->buf);
-                            co_htx_skip(req, req_htx, co_data(req));
-                            htx_to_buf(req_htx, &req->buf);
-                        }
-
-                        break;
-                    case NST_PERSIST_APPLET_ERROR:
-                        si_shutr(si);
-                        res->flags |= CF_READ_NULL;
-                        close(fd);
-                        break;
-                }
+            if(appctx->st1 == NST_PERSIST_APPLET_ERROR) {
+                break;
             }
 
-out2:
+            nst_res_send_persist(si, res_htx, &appctx->st1,
+                    appctx->ctx.nuster.nosql_engine.fd,
+                    appctx->ctx.nuster.nosql_engine.header_len,
+                    &appctx->ctx.nuster.nosql_engine.offset,
+                    &appctx->ctx.nuster.nosql_engine.splice,
+                    NULL);
+
             total = res_htx->data - total;
             channel_add_input(res, total);
             htx_to_buf(res_htx, &res->buf);
@@ -343,20 +289,34 @@ out2:
             appctx->st0 = NST_NOSQL_APPCTX_STATE_DONE;
             nst_res_simple2(s, 200);
             break;
+        case NST_NOSQL_APPCTX_STATE_TIMEOUT:
+            appctx->st0 = NST_NOSQL_APPCTX_STATE_DONE;
+            nst_res_simple2(s, 504);
+            break;
+        case NST_NOSQL_APPCTX_STATE_NOT_REPLICATED:
+            appctx->st0 = NST_NOSQL_APPCTX_STATE_DONE;
+            nst_res_simple2(s, 502);
+            break;
         case NST_NOSQL_APPCTX_STATE_WAIT:
             break;
         case NST_NOSQL_APPCTX_STATE_DONE:
-            if (!(res->flags & CF_SHUTR) ) {
-                res->flags |= CF_READ_NULL;
-                si_shutr(si);
-            }
-
             /* eat the whole request */
             if (co_data(req)) {
                 req_htx = htx_from_buf(&req->buf);
                 co_htx_skip(req, req_htx, co_data(req));
                 htx_to_buf(req_htx, &req->buf);
             }
+
+            /* replied early, do not close before the body is received */
+            if(s->txn->req.msg_state < HTTP_MSG_DONE) {
+                break;
+            }
+
+            if (!(res->flags & CF_SHUTR) ) {
+                res->flags |= CF_READ_NULL;
+                si_shutr(si);
+            }
+
             break;
         default:
             co_skip(si_oc(si), co_data(si_oc(si)));
@@ -366,6 +326,10 @@ out2:
     return;
 }
 
+static void nst_nosql_engine_release_handler(struct appctx *appctx) {
+    _nst_nosql_engine_release_data(appctx);
+}
+
 struct nst_nosql_data *nst_nosql_data_new() {
     struct nst_nosql_data *data = nst_nosql_memory_alloc(sizeof(*data));
 
@@ -405,6 +369,121 @@ struct nst_nosql_data *nst_nosql_data_new() {
     return data;
 }
 
+/*
+ * Room for the response of an inline value: the data, 4 elements, the status
+ * line, the content-length header, the value and its content type.
+ */
+#define NST_NOSQL_DATA_COPY_SIZE  (sizeof(struct nst_nosql_data)             \
+        + 4 * sizeof(struct nst_data_element) + sizeof(struct htx_sl) + 13  \
+        + 14 + 16 + 1 + NST_NOSQL_ENTRY_INLINE_MAX)
+
+/*
+ * Build the response of an inline value, inl being a copy of the inline area
+ * of the entry taken under the dict lock. The copy is allocated from a pool
+ * of the process, it is not in the data list, its only client frees it on
+ * release.
+ */
+struct nst_nosql_data *nst_nosql_data_copy(uint8_t *inl) {
+    struct nst_nosql_data *data;
+    struct nst_data_element *element;
+    struct htx_sl *sl;
+    struct ist p1 = ist("HTTP/1.1");
+    struct ist p2 = ist("200");
+    struct ist p3 = ist("OK");
+    struct ist k  = ist("content-length");
+    uint32_t len      = inl[0] | (inl[1] << 8);
+    uint32_t type_len = inl[2];
+    char *type        = (char *)inl + NST_NOSQL_ENTRY_INLINE_HEADER;
+    char v[16];
+    uint32_t sl_size;
+    int v_len;
+    char *p;
+
+    v_len   = snprintf(v, sizeof(v), "%u", len);
+    sl_size = sizeof(*sl) + p1.len + p2.len + p3.len;
+
+    data = pool_alloc(global.nuster.nosql.pool.data);
+
+    if(!data) {
+        return NULL;
+    }
+
+    element = (struct nst_data_element *)(data + 1);
+
+    p  = (char *)(element + 4);
+    sl = (struct htx_sl *)p;
+
+    sl->hdrs_bytes = -1;
+    sl->flags      = (HTX_SL_F_IS_RESP | HTX_SL_F_VER_11 | HTX_SL_F_XFER_LEN
+            | HTX_SL_F_CLEN);
+
+    HTX_SL_P1_LEN(sl) = p1.len;
+    HTX_SL_P2_LEN(sl) = p2.len;
+    HTX_SL_P3_LEN(sl) = p3.len;
+    memcpy(HTX_SL_P1_PTR(sl), p1.ptr, p1.len);
+    memcpy(HTX_SL_P2_PTR(sl), p2.ptr, p2.len);
+    memcpy(HTX_SL_P3_PTR(sl), p3.ptr, p3.len);
+
+    element[0].msg.data = p;
+    element[0].msg.len  = (HTX_BLK_RES_SL << 28) + sl_size;
+    element[0].next     = &element[1];
+    p += sl_size;
+
+    memcpy(p, k.ptr, k.len);
+    memcpy(p + k.len, v, v_len);
+
+    element[1].msg.data = p;
+    element[1].msg.len  = (HTX_BLK_HDR << 28) + (v_len << 8) + k.len;
+    element[1].next     = &element[2];
+    p += k.len + v_len;
+
+    element[2].msg.data = p;
+    element[2].msg.len  = (HTX_BLK_EOH << 28) + 1;
+    element[2].next     = len ? &element[3] : NULL;
+    p += 1;
+
+    memcpy(p, type + type_len, len);
+
+    element[3].msg.data = p;
+    element[3].msg.len  = (HTX_BLK_DATA << 28) + len;
+    element[3].next     = NULL;
+    p += len;
+
+    memcpy(p, type, type_len);
+
+    data->clients = 1;
+    data->invalid = 1;
+    data->element = element;
+    data->next    = NULL;
+
+    data->info.content_type.data      = type_len ? p : NULL;
+    data->info.content_type.len       = type_len;
+    data->info.transfer_encoding.data = NULL;
+    data->info.transfer_encoding.len  = 0;
+    data->info.content_length         = len;
+    data->info.flags                  = (NST_NOSQL_DATA_FLAG_PACKED
+            | NST_NOSQL_DATA_FLAG_COPY);
+
+    return data;
+}
+
+/*
+ * Drop a reference taken on data, a copy has a single client and is freed
+ * right away, the others by the data cleaner
+ */
+void nst_nosql_data_release(struct nst_nosql_data *data) {
+
+    if(data->info.flags & NST_NOSQL_DATA_FLAG_COPY) {
+        pool_free(global.nuster.nosql.pool.data, data);
+
+        return;
+    }
+
+    nst_shctx_lock(&nuster.nosql->dict[0]);
+    data->clients--;
+    nst_shctx_unlock(&nuster.nosql->dict[0]);
+}
+
 static int _nst_nosql_data_invalid(struct nst_nosql_data *data) {
 
     if(data->invalid) {
@@ -444,14 +523,18 @@ static void _nst_nosql_data_cleanup() {
     }
 
     if(data) {
-        struct nst_nosql_element *element = data->element;
+        struct nst_data_element *element = data->element;
+
+        if(data->info.flags & NST_NOSQL_DATA_FLAG_PACKED) {
+            nst_nosql_memory_free(element);
+            element = NULL;
+        }
 
         while(element) {
-            struct nst_nosql_element *tmp = element;
+            struct nst_data_element *tmp = element;
             element                       = element->next;
 
             if(tmp->msg.data) {
-                nst_nosql_stats_update_used_mem(-tmp->msg.len);
                 nst_nosql_memory_free(tmp->msg.data);
             }
 
@@ -506,11 +589,18 @@ void nst_nosql_housekeeping() {
             nst_nosql_persist_async();
             nst_shctx_unlock(&nuster.nosql->dict[0]);
         }
+
+        if(global.nuster.nosql.root) {
+            nst_persist_sync(global.nuster.nosql.root, &nuster.nosql->disk,
+                    global.nuster.nosql.disk_sync,
+                    global.nuster.nosql.disk_sync_value);
+        }
     }
 }
 
 void nst_nosql_init() {
     nuster.applet.nosql_engine.fct = nst_nosql_engine_handler;
+    nuster.applet.nosql_engine.release = nst_nosql_engine_release_handler;
 
     if(global.nuster.nosql.status == NST_STATUS_ON) {
 
@@ -526,9 +616,13 @@ void nst_nosql_init() {
         global.nuster.nosql.pool.ctx   = create_pool("np.ctx",
                 sizeof(struct nst_nosql_ctx), MEM_F_SHARED);
 
+        global.nuster.nosql.pool.data  = create_pool("np.data",
+                NST_NOSQL_DATA_COPY_SIZE, MEM_F_SHARED);
+
         global.nuster.nosql.memory = nst_memory_create("nosql.shm",
                 global.nuster.nosql.dict_size + global.nuster.nosql.data_size,
-                global.tune.bufsize, NST_NOSQL_DEFAULT_CHUNK_SIZE);
+                global.tune.bufsize, NST_NOSQL_DEFAULT_CHUNK_SIZE,
+                &global.nuster.nosql.zone);
 
         if(!global.nuster.nosql.memory) {
             goto shm_err;
@@ -553,6 +647,10 @@ void nst_nosql_init() {
             if(!nuster.nosql->disk.file) {
                 goto err;
             }
+
+            if(nst_persist_bloom_init(&nuster.nosql->disk) != NST_OK) {
+                goto err;
+            }
         }
 
         if(nst_shctx_init(nuster.nosql) != NST_OK) {
@@ -567,6 +665,10 @@ void nst_nosql_init() {
             goto err;
         }
 
+        if(nst_nosql_replication_init() != NST_OK) {
+            goto err;
+        }
+
     }
 
     return;
@@ -658,6 +760,9 @@ int nst_nosql_check_applet(struct stream *s, struct channel *req,
             appctx->st1 = 0;
             appctx->st2 = 0;
 
+            memset(&appctx->ctx.nuster.nosql_engine, 0,
+                    sizeof(appctx->ctx.nuster.nosql_engine));
+
             htx = htxbuf(&req->buf);
 
             if(htx_handle_expect_hdr(s, htx, msg) == -1) {
@@ -782,6 +887,8 @@ int nst_nosql_build_key(struct nst_nosql_ctx *ctx, struct nst_rule_key **pck,
     struct http_txn *txn = s->txn;
 
     struct nst_rule_key *ck = NULL;
+    struct nst_key_value vals[NST_KEY_VALUES];
+    int nvals;
 
     ctx->key  = nst_nosql_key_init();
 
@@ -789,6 +896,9 @@ int nst_nosql_build_key(struct nst_nosql_ctx *ctx, struct nst_rule_key **pck,
         return NST_ERR;
     }
 
+    nvals = nst_key_collect(htxbuf(&s->req.buf), ctx->req.query.data,
+            ctx->req.query.len, pck, vals, NST_KEY_VALUES);
+
     nst_debug(s, "[nosql] Calculate key: ");
 
     while((ck = *pck++)) {
@@ -867,7 +977,23 @@ int nst_nosql_build_key(struct nst_nosql_ctx *ctx, struct nst_rule_key **pck,
             case NST_RULE_KEY_PARAM:
                 nst_debug2("param_%s.", ck->data);
 
-                if(ctx->req.query.data && ctx->req.query.len) {
+                if(nvals >= 0) {
+                    int i;
+
+                    for(i = 0; i < nvals; i++) {
+
+                        if(vals[i].idx == ck->idx) {
+                            break;
+                        }
+                    }
+
+                    if(i < nvals) {
+                        ret = nst_nosql_key_append(ctx->key,
+                                vals[i].value.ptr, vals[i].value.len);
+                        break;
+                    }
+
+                } else if(ctx->req.query.data && ctx->req.query.len) {
                     char *v = NULL;
                     int v_l = 0;
 
@@ -890,14 +1016,28 @@ int nst_nosql_build_key(struct nst_nosql_ctx *ctx, struct nst_rule_key **pck,
                     struct http_hdr_ctx hdr = { .blk = NULL };
                     struct ist h = {
                         .ptr = ck->data,
-                        .len = strlen(ck->data),
+                        .len = ck->len,
                     };
 
                     nst_debug2("header_%s.", ck->data);
 
-                    while (http_find_header(htx, h, &hdr, 0)) {
-                        ret = nst_nosql_key_append(ctx->key, hdr.value.ptr,
-                                hdr.value.len);
+                    if(nvals >= 0) {
+                        int i;
+
+                        for(i = 0; i < nvals; i++) {
+
+                            if(vals[i].idx == ck->idx) {
+                                ret = nst_nosql_key_append(ctx->key,
+                                        vals[i].value.ptr, vals[i].value.len);
+                            }
+                        }
+
+                    } else {
+
+                        while (http_find_header(htx, h, &hdr, 0)) {
+                            ret = nst_nosql_key_append(ctx->key,
+                                    hdr.value.ptr, hdr.value.len);
+                        }
                     }
 
                     ret = ret == NST_OK && nst_nosql_key_advance(ctx->key,
@@ -914,7 +1054,7 @@ int nst_nosql_build_key(struct nst_nosql_ctx *ctx, struct nst_rule_key **pck,
 
                     if(http_extract_cookie_value(ctx->req.cookie.data,
                                 ctx->req.cookie.data + ctx->req.cookie.len,
-                                ck->data, strlen(ck->data), 1, &v, &v_l)) {
+                                ck->data, ck->len, 1, &v, &v_l)) {
 
                         ret = nst_nosql_key_append(ctx->key, v, v_l);
                         break;
@@ -951,6 +1091,8 @@ int nst_nosql_build_key(struct nst_nosql_ctx *ctx, struct nst_rule_key **pck,
         }
     }
 
+    ctx->hash = nst_hash(ctx->key->area, ctx->key->data);
+
     nst_debug2("\n");
 
     return NST_OK;
@@ -1029,7 +1171,7 @@ void nst_res_header_create(struct nst_nosql_ctx *ctx, struct stream *s,
     struct ist p2;
     struct ist p3;
     uint32_t info;
-    struct nst_nosql_element *element = NULL;
+    struct nst_data_element *element = NULL;
     char *data = NULL;
 
     p1 = ist("HTTP/1.1");
@@ -1048,6 +1190,8 @@ void nst_res_header_create(struct nst_nosql_ctx *ctx, struct stream *s,
         return;
     }
 
+    element->next = NULL;
+
     data = nst_nosql_memory_alloc(size);
     ctx->header_len += 4 + size;
     ctx->cache_len2 += 4 + size;
@@ -1095,6 +1239,8 @@ void nst_res_header_create(struct nst_nosql_ctx *ctx, struct stream *s,
             return;
         }
 
+        element->next = NULL;
+
         data = nst_nosql_memory_alloc(size);
         ctx->header_len += 4 + size;
         ctx->cache_len2 += 4 + size;
@@ -1127,6 +1273,8 @@ void nst_res_header_create(struct nst_nosql_ctx *ctx, struct stream *s,
             return;
         }
 
+        element->next = NULL;
+
         data = nst_nosql_memory_alloc(size);
         ctx->header_len += 4 + size;
         ctx->cache_len2 += 4 + size;
@@ -1157,6 +1305,8 @@ void nst_res_header_create(struct nst_nosql_ctx *ctx, struct stream *s,
         return;
     }
 
+    element->next = NULL;
+
     data = nst_nosql_memory_alloc(size);
     ctx->header_len += 4 + size;
 
@@ -1172,11 +1322,266 @@ void nst_res_header_create(struct nst_nosql_ctx *ctx, struct stream *s,
 
 }
 
+static uint32_t _nst_nosql_extent_size() {
+    return global.tune.bufsize / 2;
+}
+
+static struct nst_data_element *_nst_nosql_extent_new(uint32_t size) {
+    struct nst_data_element *element;
+
+    element = nst_nosql_memory_alloc(sizeof(*element));
+
+    if(!element) {
+        return NULL;
+    }
+
+    element->next     = NULL;
+    element->msg.data = nst_nosql_memory_alloc(size);
+
+    if(!element->msg.data) {
+        nst_nosql_memory_free(element);
+        return NULL;
+    }
+
+    /* the capacity until the extent is complete */
+    element->msg.len = (HTX_BLK_DATA << 28) + size;
+
+    return element;
+}
+
+static void _nst_nosql_extent_free(struct nst_data_element *element) {
+
+    while(element) {
+        struct nst_data_element *tmp = element;
+        element                       = element->next;
+
+        nst_nosql_memory_free(tmp->msg.data);
+        nst_nosql_memory_free(tmp);
+    }
+}
+
+static void _nst_nosql_element_append(struct nst_nosql_ctx *ctx,
+        struct nst_data_element *element) {
+
+    if(ctx->element) {
+        ctx->element->next = element;
+    } else {
+        ctx->data->element = element;
+    }
+
+    ctx->element = element;
+}
+
+/*
+ * Reserve the whole body announced by Content-Length, so that a value
+ * which does not fit is refused before reading it.
+ */
+static int _nst_nosql_extent_reserve(struct nst_nosql_ctx *ctx) {
+    struct nst_memory *memory     = global.nuster.nosql.memory;
+    struct nst_data_element *prev = ctx->element;
+    uint64_t total = (uint64_t)memory->blocks * memory->block_size;
+    uint64_t used  = nst_memory_in_use(memory);
+    uint64_t left  = ctx->cache_len;
+    uint32_t size  = _nst_nosql_extent_size();
+
+    /* a body larger than the free memory is refused before taking any */
+    if(used >= total || left > total - used) {
+        return NST_ERR;
+    }
+
+    while(left) {
+        struct nst_data_element *element;
+        uint32_t sz = left > size ? size : left;
+
+        element = _nst_nosql_extent_new(sz);
+
+        if(!element) {
+
+            if(prev) {
+                _nst_nosql_extent_free(prev->next);
+                prev->next = NULL;
+            } else {
+                _nst_nosql_extent_free(ctx->data->element);
+                ctx->data->element = NULL;
+            }
+
+            ctx->element       = prev;
+            ctx->ingest.extent = NULL;
+
+            return NST_ERR;
+        }
+
+        _nst_nosql_element_append(ctx, element);
+
+        if(!ctx->ingest.extent) {
+            ctx->ingest.extent = element;
+            ctx->ingest.prev   = prev;
+        }
+
+        left -= sz;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Copy len bytes of body into the current extent, a complete extent is
+ * written to disk at once. Returns the number of bytes taken, which is
+ * less than len when there is no memory left.
+ */
+static uint32_t _nst_nosql_ingest(struct nst_nosql_ctx *ctx, char *p,
+        uint32_t len) {
+
+    int disk = (ctx->rule->disk == NST_DISK_SYNC
+            || ctx->rule->disk == NST_DISK_ONLY);
+
+    uint32_t done = 0;
+
+    while(done < len) {
+        struct nst_data_element *extent = ctx->ingest.extent;
+        uint32_t cap, n;
+        char *buf;
+
+        if(ctx->rule->disk == NST_DISK_ONLY) {
+
+            if(!ctx->ingest.stage) {
+                nst_persist_write(&ctx->disk, p + done, len - done);
+                nst_persist_flush(&ctx->disk);
+                ctx->cache_len2 += len - done;
+
+                return len;
+            }
+
+            buf = ctx->ingest.stage;
+            cap = _nst_nosql_extent_size();
+        } else {
+
+            if(!extent) {
+                extent = _nst_nosql_extent_new(_nst_nosql_extent_size());
+
+                if(!extent) {
+                    break;
+                }
+
+                ctx->ingest.prev = ctx->element;
+                _nst_nosql_element_append(ctx, extent);
+
+                ctx->ingest.extent = extent;
+                ctx->ingest.used   = 0;
+            }
+
+            buf = extent->msg.data;
+            cap = extent->msg.len & 0xfffffff;
+        }
+
+        n = cap - ctx->ingest.used;
+
+        if(n > len - done) {
+            n = len - done;
+        }
+
+        memcpy(buf + ctx->ingest.used, p + done, n);
+
+        ctx->ingest.used += n;
+        ctx->cache_len2  += n;
+        done             += n;
+
+        if(ctx->ingest.used == cap) {
+
+            if(disk) {
+                nst_persist_write(&ctx->disk, buf, cap);
+            }
+
+            if(extent) {
+                ctx->ingest.prev   = extent;
+                ctx->ingest.extent = extent->next;
+            }
+
+            ctx->ingest.used = 0;
+        }
+    }
+
+    if(disk) {
+        nst_persist_flush(&ctx->disk);
+    }
+
+    return done;
+}
+
+/*
+ * Flush the last extent, drop the reserved ones which were not used and
+ * shrink the last one to its size.
+ */
+static void _nst_nosql_ingest_end(struct nst_nosql_ctx *ctx) {
+    struct nst_data_element *extent = ctx->ingest.extent;
+    struct nst_data_element *cut;
+    uint32_t used = ctx->ingest.used;
+
+    if(ctx->rule->disk == NST_DISK_ONLY) {
+
+        if(ctx->ingest.stage) {
+
+            if(used) {
+                nst_persist_write(&ctx->disk, ctx->ingest.stage, used);
+                nst_persist_flush(&ctx->disk);
+            }
+
+            nst_nosql_memory_free(ctx->ingest.stage);
+            ctx->ingest.stage = NULL;
+        }
+
+        return;
+    }
+
+    if(!extent) {
+        return;
+    }
+
+    if(used == 0) {
+        cut = extent;
+
+        if(ctx->ingest.prev) {
+            ctx->ingest.prev->next = NULL;
+        } else {
+            ctx->data->element = NULL;
+        }
+
+        ctx->element = ctx->ingest.prev;
+    } else {
+
+        if(ctx->rule->disk == NST_DISK_SYNC) {
+            nst_persist_write(&ctx->disk, extent->msg.data, used);
+            nst_persist_flush(&ctx->disk);
+        }
+
+        if(used < (extent->msg.len & 0xfffffff)) {
+            char *data = nst_nosql_memory_alloc(used);
+
+            if(data) {
+                memcpy(data, extent->msg.data, used);
+                nst_nosql_memory_free(extent->msg.data);
+                extent->msg.data = data;
+            }
+
+            extent->msg.len = (HTX_BLK_DATA << 28) + used;
+        }
+
+        cut          = extent->next;
+        extent->next = NULL;
+        ctx->element = extent;
+    }
+
+    _nst_nosql_extent_free(cut);
+
+    ctx->ingest.extent = NULL;
+    ctx->ingest.used   = 0;
+}
+
 void nst_nosql_create(struct nst_nosql_ctx *ctx, struct stream *s,
         struct http_msg *msg) {
 
     struct nst_nosql_entry *entry = NULL;
-    struct nst_nosql_element *element = NULL;
+    struct nst_data_element *element = NULL;
 
     /* Check if nosql is full */
     if(nst_nosql_stats_full()) {
@@ -1198,6 +1603,22 @@ void nst_nosql_create(struct nst_nosql_ctx *ctx, struct stream *s,
                 entry->data->invalid = 1;
             }
 
+            /* the inline value is left unused until it is replaced */
+            entry->flags &= ~(NST_NOSQL_ENTRY_FLAG_INLINE
+                    | NST_NOSQL_ENTRY_FLAG_ASYNC);
+
+            if(ctx->rule->disk == NST_DISK_ASYNC) {
+                entry->flags |= NST_NOSQL_ENTRY_FLAG_ASYNC;
+            }
+
+            /* the old disk copy must not be loaded after restart */
+            if(entry->file) {
+                nst_persist_purge_by_path(entry->file,
+                        &nuster.nosql->disk);
+
+                entry->file = NULL;
+            }
+
             entry->data = nst_nosql_data_new();
             ctx->state  = NST_NOSQL_CTX_STATE_CREATE;
         }
@@ -1237,6 +1658,16 @@ void nst_nosql_create(struct nst_nosql_ctx *ctx, struct stream *s,
 
             nst_res_header_create(ctx, s, 200, hdr.value);
 
+            if(ctx->rule->disk == NST_DISK_ONLY) {
+                ctx->ingest.stage = nst_nosql_memory_alloc(
+                        _nst_nosql_extent_size());
+            } else if(ctx->cache_len
+                    && _nst_nosql_extent_reserve(ctx) != NST_OK) {
+
+                entry->state = NST_NOSQL_ENTRY_STATE_INVALID;
+                ctx->state   = NST_NOSQL_CTX_STATE_FULL;
+            }
+
         }
     }
 
@@ -1258,18 +1689,19 @@ void nst_nosql_create(struct nst_nosql_ctx *ctx, struct stream *s,
             return;
         }
 
-        ctx->disk.fd = nst_persist_create(ctx->disk.file);
+        nst_persist_create(&ctx->disk);
 
         nst_persist_meta_init(ctx->disk.meta, (char)ctx->rule->disk, ctx->hash,
-                0, 0, ctx->header_len, ctx->entry->key->data, 0, 0, 0, 0, 0);
+                0, 0, ctx->header_len, ctx->key->data, 0, 0, 0, 0, 0);
 
-        nst_persist_write_key(&ctx->disk, ctx->entry->key);
+        nst_persist_write_key(&ctx->disk, ctx->key);
 
-        ctx->disk.offset = NST_PERSIST_META_SIZE + ctx->entry->key->data;
+        ctx->disk.offset = NST_PERSIST_META_SIZE + ctx->key->data;
 
         element = ctx->data->element;
 
-        while(element) {
+        /* headers only, the reserved extents are written once filled */
+        while(element && element != ctx->ingest.extent) {
             int sz = ((element->msg.len & 0xff)
                     + ((element->msg.len >> 8) & 0xfffff));
 
@@ -1279,77 +1711,95 @@ void nst_nosql_create(struct nst_nosql_ctx *ctx, struct stream *s,
             element = element->next;
         }
 
+        nst_persist_flush(&ctx->disk);
     }
 
 err:
     return;
 }
 
+/*
+ * Take the body bytes from offset to offset + msg_len, returns the number
+ * of bytes taken, the remaining ones stay in the channel until there is
+ * some memory.
+ */
 int nst_nosql_update(struct nst_nosql_ctx *ctx, struct http_msg *msg,
         unsigned int offset, unsigned int msg_len) {
 
-    int pos;
     struct htx *htx = htxbuf(&msg->chn->buf);
+    struct htx_blk *blk;
+    unsigned int len = msg_len;
+
+    for(blk = htx_get_first_blk(htx); blk && len;
+            blk = htx_get_next_blk(htx, blk)) {
 
-    for (pos = htx_get_first(htx); pos != -1; pos = htx_get_next(htx, pos)) {
-        struct htx_blk *blk = htx_get_blk(htx, pos);
-        uint32_t        sz  = htx_get_blksz(blk);
+        uint32_t sz            = htx_get_blksz(blk);
         enum htx_blk_type type = htx_get_blk_type(blk);
-        struct nst_nosql_element *element;
-        char *data;
+        struct ist v;
+        uint32_t ret;
 
+        if(offset >= sz) {
+            offset -= sz;
+            continue;
+        }
+
+        /* only DATA blocks can be partially forwarded */
         if(type != HTX_BLK_DATA) {
+            len   -= sz > len ? len : sz;
+            offset = 0;
             continue;
         }
 
-        if(ctx->rule->disk == NST_DISK_ONLY)  {
-            nst_persist_write(&ctx->disk, htx_get_blk_ptr(htx, blk), sz);
-            ctx->cache_len2 += sz;
-        } else {
-            element = nst_nosql_memory_alloc(sizeof(*element));
+        v      = htx_get_blk_value(htx, blk);
+        v.ptr += offset;
+        v.len -= offset;
 
-            if(!element) {
-                goto err;
-            }
+        if(v.len > len) {
+            v.len = len;
+        }
 
-            data = nst_nosql_memory_alloc(sz);
+        ret  = _nst_nosql_ingest(ctx, v.ptr, v.len);
+        len -= ret;
 
-            if(!data) {
-                goto err;
-            }
+        if(ret != v.len) {
+            break;
+        }
 
-            memcpy(data, htx_get_blk_ptr(htx, blk), sz);
+        offset = 0;
+    }
 
-            element->msg.data = data;
-            element->msg.len  = blk->info;
+    return msg_len - len;
+}
 
-            if(ctx->element) {
-                ctx->element->next = element;
-            } else {
-                ctx->data->element = element;
-            }
+/*
+ * End the check of the file of the entry of ctx, which is verified only if
+ * the checksum matched, unless the file was replaced meanwhile.
+ */
+static void _nst_nosql_verified(struct nst_nosql_ctx *ctx, int ok) {
+    struct nst_nosql_entry *entry;
 
-            ctx->element = element;
+    nst_shctx_lock(&nuster.nosql->dict[0]);
+    entry = nst_nosql_dict_get(ctx->key, ctx->hash);
 
-            if(ctx->rule->disk == NST_DISK_SYNC) {
-                nst_persist_write(&ctx->disk, htx_get_blk_ptr(htx, blk), sz);
-            }
+    if(entry && (entry->flags & NST_NOSQL_ENTRY_FLAG_VERIFYING)
+            && entry->file == ctx->disk.file) {
 
-            ctx->cache_len2 += sz;
+        entry->flags &= ~NST_NOSQL_ENTRY_FLAG_VERIFYING;
 
+        if(ok) {
+            entry->flags |= NST_NOSQL_ENTRY_FLAG_VERIFIED;
         }
     }
 
-    return NST_OK;
-
-err:
-
-    return NST_ERR;
+    nst_shctx_unlock(&nuster.nosql->dict[0]);
 }
 
 int nst_nosql_exists(struct nst_nosql_ctx *ctx, int mode) {
     struct nst_nosql_entry *entry = NULL;
     int ret = NST_CACHE_CTX_STATE_INIT;
+    int verify = 0;
+    int copy = 0;
+    uint8_t inl[NST_NOSQL_ENTRY_INLINE_MAX];
 
     if(!ctx->key) {
         return ret;
@@ -1360,36 +1810,71 @@ int nst_nosql_exists(struct nst_nosql_ctx *ctx, int mode) {
 
     if(entry) {
         if(entry->state == NST_NOSQL_ENTRY_STATE_VALID) {
-            ctx->data = entry->data;
-            ctx->data->clients++;
-            ret = NST_NOSQL_CTX_STATE_HIT;
+
+            if(entry->data) {
+                ctx->data = entry->data;
+                ctx->data->clients++;
+                ret = NST_NOSQL_CTX_STATE_HIT;
+            } else {
+                /* the response is built once unlocked */
+                memcpy(inl, nst_nosql_entry_inline(entry),
+                        nst_nosql_entry_inline_len(entry));
+
+                copy = 1;
+            }
         }
 
-        if(entry->state == NST_NOSQL_ENTRY_STATE_INVALID && entry->file) {
+        /* the others miss while a hit checks the file */
+        if(entry->state == NST_NOSQL_ENTRY_STATE_INVALID && entry->file
+                && !(entry->flags & NST_NOSQL_ENTRY_FLAG_VERIFYING)) {
+
             ctx->disk.file = entry->file;
             ret = NST_NOSQL_CTX_STATE_CHECK_PERSIST;
+
+            /* loaded from disk, the first hit checks the file */
+            verify = !(entry->flags & NST_NOSQL_ENTRY_FLAG_VERIFIED);
+
+            if(verify) {
+                entry->flags |= NST_NOSQL_ENTRY_FLAG_VERIFYING;
+            }
         }
     } else {
         if(mode != NST_DISK_OFF) {
             ctx->disk.file = NULL;
-            //if(nuster.nosql->disk.loaded) {
-            //    ret = NST_NOSQL_CTX_STATE_INIT;
-            //} else {
+
+            if(nuster.nosql->disk.loaded
+                    || nst_persist_bloom_miss(&nuster.nosql->disk, ctx->hash)) {
+
+                ret = NST_NOSQL_CTX_STATE_INIT;
+            } else {
                 ret = NST_NOSQL_CTX_STATE_CHECK_PERSIST;
-            //}
+            }
         }
     }
 
     nst_shctx_unlock(&nuster.nosql->dict[0]);
 
+    if(copy) {
+        ctx->data = nst_nosql_data_copy(inl);
+
+        if(ctx->data) {
+            ret = NST_NOSQL_CTX_STATE_HIT;
+        }
+    }
+
     if(ret == NST_NOSQL_CTX_STATE_CHECK_PERSIST) {
         if(ctx->disk.file) {
-            if(nst_persist_valid(&ctx->disk, ctx->key, ctx->hash) == NST_OK) {
+            if(nst_persist_valid(&ctx->disk, ctx->key, ctx->hash) == NST_OK
+                    && (!verify || nst_persist_verify(&ctx->disk, &nuster.nosql->disk) == NST_OK)) {
 
                 ret = NST_NOSQL_CTX_STATE_HIT_DISK;
             } else {
                 ret = NST_NOSQL_CTX_STATE_INIT;
             }
+
+            if(verify) {
+                _nst_nosql_verified(ctx, ret == NST_NOSQL_CTX_STATE_HIT_DISK);
+            }
         } else {
             ctx->disk.file = nst_nosql_memory_alloc(
                     nst_persist_path_file_len(global.nuster.nosql.root) + 1);
@@ -1399,7 +1884,8 @@ int nst_nosql_exists(struct nst_nosql_ctx *ctx, int mode) {
             } else {
 
                 if(nst_persist_exists(global.nuster.nosql.root, &ctx->disk,
-                            ctx->key, ctx->hash) == NST_OK) {
+                            ctx->key, ctx->hash, &nuster.nosql->disk)
+                        == NST_OK) {
 
                     ret = NST_NOSQL_CTX_STATE_HIT_DISK;
                 } else {
@@ -1425,18 +1911,98 @@ int nst_nosql_delete(struct buffer *key, uint64_t hash) {
     entry = nst_nosql_dict_get(key, hash);
 
     if(entry) {
-        entry->state = NST_NOSQL_ENTRY_STATE_INVALID;
+
+        /* same as cache purge, the disk copy goes with it */
+        if(entry->file) {
+            nst_persist_purge_by_path(entry->file, &nuster.nosql->disk);
+        }
+
+        entry->state = NST_NOSQL_ENTRY_STATE_EXPIRED;
         ret = 1;
     }
 
     nst_shctx_unlock(&nuster.nosql->dict[0]);
 
+    if(!nuster.nosql->disk.loaded && global.nuster.nosql.root) {
+        struct persist disk;
+
+        disk.file = nst_nosql_memory_alloc(
+                nst_persist_path_file_len(global.nuster.nosql.root) + 1);
+
+        if(disk.file) {
+
+            if(nst_persist_purge_by_key(global.nuster.nosql.root,
+                        &disk, key, hash, &nuster.nosql->disk) == 200) {
+
+                ret = 1;
+            }
+
+            nst_nosql_memory_free(disk.file);
+        }
+    }
+
     return ret;
 }
 
+/*
+ * Move a small value of ctx into its entry, together with the content type,
+ * so that the item is a single allocation. The data is left to the cleaner.
+ */
+static int _nst_nosql_entry_inline(struct nst_nosql_ctx *ctx) {
+    struct nst_nosql_data *data = ctx->entry->data;
+    struct nst_nosql_entry *entry;
+    struct nst_data_element *element;
+    uint32_t len = 0;
+    char *p;
+
+    if((data->info.flags & NST_NOSQL_DATA_FLAG_CHUNKED)
+            || data->info.content_type.len > 255) {
+
+        return NST_ERR;
+    }
+
+    for(element = data->element; element; element = element->next) {
+
+        if((element->msg.len >> 28) == HTX_BLK_DATA) {
+            len += element->msg.len & 0xfffffff;
+
+            if(len > NST_NOSQL_DEFAULT_INLINE_SIZE) {
+                return NST_ERR;
+            }
+        }
+    }
+
+    nst_shctx_lock(&nuster.nosql->dict[0]);
+
+    entry = nst_nosql_dict_inline(ctx->entry, &data->info.content_type, len);
+
+    if(entry) {
+        p = nst_nosql_entry_value(entry);
+
+        for(element = data->element; element; element = element->next) {
+
+            if((element->msg.len >> 28) == HTX_BLK_DATA) {
+                memcpy(p, element->msg.data, element->msg.len & 0xfffffff);
+                p += element->msg.len & 0xfffffff;
+            }
+        }
+
+        data->invalid = 1;
+        ctx->entry    = entry;
+        ctx->data     = NULL;
+        ctx->element  = NULL;
+    }
+
+    nst_shctx_unlock(&nuster.nosql->dict[0]);
+
+    return entry ? NST_OK : NST_ERR;
+}
+
 void nst_nosql_finish(struct nst_nosql_ctx *ctx, struct stream *s,
         struct http_msg *msg) {
 
+    _nst_nosql_ingest_end(ctx);
+
     if(ctx->cache_len == 0 && ctx->cache_len2 == 0) {
         ctx->state = NST_NOSQL_CTX_STATE_INVALID;
         ctx->entry->state = NST_NOSQL_ENTRY_STATE_INVALID;
@@ -1474,8 +2040,27 @@ void nst_nosql_finish(struct nst_nosql_ctx *ctx, struct stream *s,
             ctx->entry->data->info.flags = 0;
         }
 
+        if(*ctx->rule->ttl == 0) {
+            ctx->entry->expire = 0;
+        } else {
+            uint64_t expire = get_current_timestamp() / 1000
+                + *ctx->rule->ttl;
+
+            ctx->entry->expire = expire > UINT32_MAX ? UINT32_MAX : expire;
+        }
+
         ctx->state = NST_NOSQL_CTX_STATE_DONE;
 
+        if(ctx->rule->disk == NST_DISK_OFF
+                && _nst_nosql_entry_inline(ctx) == NST_OK) {
+
+            return;
+        }
+
+        if(ctx->rule->disk != NST_DISK_ONLY) {
+            _nst_nosql_data_pack(ctx->entry->data);
+        }
+
         if(ctx->rule->disk == NST_DISK_ONLY) {
             ctx->entry->state = NST_NOSQL_ENTRY_STATE_INVALID;
         } else {
@@ -1483,13 +2068,6 @@ void nst_nosql_finish(struct nst_nosql_ctx *ctx, struct stream *s,
         }
 
 
-        if(*ctx->rule->ttl == 0) {
-            ctx->entry->expire = 0;
-        } else {
-            ctx->entry->expire = get_current_timestamp() / 1000
-                + *ctx->rule->ttl;
-        }
-
         if(ctx->rule->disk == NST_DISK_SYNC
                 || ctx->rule->disk == NST_DISK_ONLY) {
 
@@ -1503,7 +2081,15 @@ void nst_nosql_finish(struct nst_nosql_ctx *ctx, struct stream *s,
 
             nst_persist_write_meta(&ctx->disk);
 
-            ctx->entry->file = ctx->disk.file;
+            if(nst_persist_commit(&ctx->disk, &nuster.nosql->disk,
+                        global.nuster.nosql.disk_sync) == NST_OK) {
+
+                ctx->entry->file   = ctx->disk.file;
+                ctx->entry->flags |= NST_NOSQL_ENTRY_FLAG_VERIFIED;
+                ctx->entry->flags &= ~NST_NOSQL_ENTRY_FLAG_VERIFYING;
+            } else {
+                nst_nosql_memory_free(ctx->disk.file);
+            }
         }
     }
 }
@@ -1528,13 +2114,15 @@ void nst_nosql_persist_async() {
     while(entry) {
 
         if(entry->state == NST_NOSQL_ENTRY_STATE_VALID
-                && entry->rule->disk == NST_DISK_ASYNC
-                && entry->file == NULL) {
+                && (entry->flags & NST_NOSQL_ENTRY_FLAG_ASYNC)
+                && entry->file == NULL && entry->data) {
 
-            struct nst_nosql_element *element = entry->data->element;
+            struct nst_data_element *element = entry->data->element;
             uint64_t cache_len = 0;
             struct persist disk;
             uint64_t header_len = 0;
+            struct buffer key = b_make(nst_nosql_entry_key(entry),
+                    entry->key_len, 0, entry->key_len);
 
             entry->file = nst_nosql_memory_alloc(
                     nst_persist_path_file_len(global.nuster.nosql.root) + 1);
@@ -1548,13 +2136,14 @@ void nst_nosql_persist_async() {
                 return;
             }
 
-            disk.fd = nst_persist_create(entry->file);
+            disk.file = entry->file;
+            nst_persist_create(&disk);
 
-            nst_persist_meta_init(disk.meta, (char)entry->rule->disk,
+            nst_persist_meta_init(disk.meta, (char)NST_DISK_ASYNC,
                     entry->hash, entry->expire, 0, 0,
-                    entry->key->data, 0, 0, 0, 0, 0);
+                    entry->key_len, 0, 0, 0, 0, 0);
 
-            nst_persist_write_key(&disk, entry->key);
+            nst_persist_write_key(&disk, &key);
 
             while(element) {
                 uint32_t blksz, info;
@@ -1584,6 +2173,16 @@ void nst_nosql_persist_async() {
 
             nst_persist_write_meta(&disk);
 
+            if(nst_persist_commit(&disk, &nuster.nosql->disk,
+                        global.nuster.nosql.disk_sync) == NST_OK) {
+
+                entry->flags |= NST_NOSQL_ENTRY_FLAG_VERIFIED;
+                entry->flags &= ~NST_NOSQL_ENTRY_FLAG_VERIFYING;
+            } else {
+                nst_nosql_memory_free(entry->file);
+                entry->file = NULL;
+            }
+
             close(disk.fd);
         }
 
@@ -1600,152 +2199,95 @@ void nst_nosql_persist_async() {
 
 }
 
-void nst_nosql_persist_load() {
-
-    if(global.nuster.nosql.root && !nuster.nosql->disk.loaded) {
-        char *root;
-        char *file;
-        char meta[NST_PERSIST_META_SIZE];
-        struct buffer *key;
-        int fd;
-
-        root = global.nuster.nosql.root;
-        file = nuster.nosql->disk.file;
+static void _nst_nosql_persist_free(struct nst_persist_item *item) {
 
-        if(nuster.nosql->disk.dir) {
-            struct dirent *de = nst_persist_dir_next(nuster.nosql->disk.dir);
+    if(item->key) {
 
-            if(de) {
-                DIR *dir2;
-                struct dirent *de2;
-
-                if(strcmp(de->d_name, ".") == 0
-                        || strcmp(de->d_name, "..") == 0) {
-
-                    return;
-                }
+        if(item->key->area) {
+            nst_nosql_memory_free(item->key->area);
+        }
 
-                memcpy(file + nst_persist_path_base_len(root), "/", 1);
-                memcpy(file + nst_persist_path_base_len(root) + 1, de->d_name,
-                        strlen(de->d_name));
+        nst_nosql_memory_free(item->key);
+    }
 
-                dir2 = opendir(file);
+    item->key = NULL;
+}
 
-                if(!dir2) {
-                    return;
-                }
+/*
+ * Read the key of a file for the loader, out of memory keeps the file
+ * without adding it, a broken one is removed.
+ */
+static int _nst_nosql_persist_read(struct nst_persist_item *item, int fd) {
+    struct buffer *key;
 
-                while((de2 = readdir(dir2)) != NULL) {
-                    if(strcmp(de2->d_name, ".") == 0
-                            || strcmp(de2->d_name, "..") == 0) {
+    key = item->key = nst_nosql_memory_alloc(sizeof(*key));
 
-                        continue;
-                    }
+    if(!key) {
+        return NST_OK;
+    }
 
-                    memcpy(file + nst_persist_path_hash_len(root), "/", 1);
-                    memcpy(file + nst_persist_path_hash_len(root) + 1,
-                            de2->d_name, strlen(de2->d_name));
+    key->size = nst_persist_meta_get_key_len(item->meta);
+    key->area = nst_nosql_memory_alloc(key->size);
 
-                    fd = nst_persist_open(file);
+    if(!key->area) {
+        _nst_nosql_persist_free(item);
 
-                    if(fd == -1) {
-                        closedir(dir2);
-                        return;
-                    }
+        return NST_OK;
+    }
 
-                    if(nst_persist_get_meta(fd, meta) != NST_OK) {
-                        unlink(file);
-                        close(fd);
-                        closedir(dir2);
-                        return;
-                    }
+    if(nst_persist_get_key(fd, item->meta, key) != NST_OK) {
+        _nst_nosql_persist_free(item);
 
-                    key = nst_nosql_memory_alloc(sizeof(*key));
+        return NST_ERR;
+    }
 
-                    if(!key) {
-                        unlink(file);
-                        close(fd);
-                        closedir(dir2);
-                        return;
-                    }
+    return NST_OK;
+}
 
-                    key->size = nst_persist_meta_get_key_len(meta);
-                    key->area = nst_nosql_memory_alloc(key->size);
+/* add the files read by the loader under one lock, returns the number added */
+static int _nst_nosql_persist_add(struct nst_persist_item *item, int n) {
+    int added = 0;
 
-                    if(!key->area) {
-                        nst_nosql_memory_free(key);
-                        unlink(file);
-                        close(fd);
-                        closedir(dir2);
-                        return;
-                    }
+    nst_shctx_lock(&nuster.nosql->dict[0]);
 
-                    if(nst_persist_get_key(fd, meta, key) != NST_OK) {
-                        nst_nosql_memory_free(key->area);
+    for(; n--; item++) {
 
-                        nst_nosql_memory_free(key);
+        /* keep the one set after start, and the file if out of memory */
+        if(nst_nosql_dict_get(item->key, nst_persist_meta_get_hash(item->meta))
+                || nst_nosql_dict_set_from_disk(item->file, item->meta,
+                    item->key) != NST_OK) {
 
-                        unlink(file);
-                        close(fd);
-                        closedir(dir2);
-                        return;
-                    }
+            _nst_nosql_persist_free(item);
+            continue;
+        }
 
-                    nst_nosql_dict_set_from_disk(file, meta, key);
+        added++;
+    }
 
-                    close(fd);
-                }
+    nst_shctx_unlock(&nuster.nosql->dict[0]);
 
-                closedir(dir2);
-            } else {
-                nuster.nosql->disk.idx++;
-                closedir(nuster.nosql->disk.dir);
-                nuster.nosql->disk.dir = NULL;
-            }
-        } else {
-            nuster.nosql->disk.dir = nst_persist_opendir_by_idx(
-                    global.nuster.nosql.root, file, nuster.nosql->disk.idx);
+    return added;
+}
 
-            if(!nuster.nosql->disk.dir) {
-                nuster.nosql->disk.idx++;
-            }
-        }
+static struct nst_persist_loader_ops _nst_nosql_persist_loader = {
+    .read = _nst_nosql_persist_read,
+    .add  = _nst_nosql_persist_add,
+};
 
-        if(nuster.nosql->disk.idx == 16 * 16) {
-            nuster.nosql->disk.loaded = 1;
-            nuster.nosql->disk.idx    = 0;
-        }
+void nst_nosql_persist_load() {
 
+    if(global.nuster.nosql.root && !nuster.nosql->disk.loaded) {
+        nst_persist_disk_load(global.nuster.nosql.root, &nuster.nosql->disk,
+                &_nst_nosql_persist_loader,
+                global.nuster.nosql.disk_loader_threads,
+                global.nuster.nosql.disk_loader_rate);
     }
 }
 
 void nst_nosql_persist_cleanup() {
 
     if(global.nuster.nosql.root && nuster.nosql->disk.loaded) {
-        char *file = nuster.nosql->disk.file;
-
-        if(nuster.nosql->disk.dir) {
-            struct dirent *de = nst_persist_dir_next(nuster.nosql->disk.dir);
-
-            if(de) {
-                nst_persist_cleanup(global.nuster.nosql.root, file, de);
-            } else {
-                nuster.nosql->disk.idx++;
-                closedir(nuster.nosql->disk.dir);
-                nuster.nosql->disk.dir = NULL;
-            }
-        } else {
-            nuster.nosql->disk.dir = nst_persist_opendir_by_idx(
-                    global.nuster.nosql.root, file, nuster.nosql->disk.idx);
-
-            if(!nuster.nosql->disk.dir) {
-                nuster.nosql->disk.idx++;
-            }
-        }
-
-        if(nuster.nosql->disk.idx == 16 * 16) {
-            nuster.nosql->disk.idx = 0;
-        }
-
+        nst_persist_disk_cleanup(global.nuster.nosql.root,
+                &nuster.nosql->disk);
     }
 }
@@ -13,6 +13,7 @@
 #include <common/cfgparse.h>
 #include <common/standard.h>
 
+#include <proto/applet.h>
 #include <proto/filters.h>
 #include <proto/log.h>
 #include <proto/stream.h>
@@ -91,6 +92,14 @@ static void _nst_nosql_filter_detach(struct stream *s, struct filter *filter) {
             nst_nosql_memory_free(ctx->req.transfer_encoding.data);
         }
 
+        if(ctx->replication.uri.data) {
+            nst_nosql_memory_free(ctx->replication.uri.data);
+        }
+
+        if(ctx->ingest.stage) {
+            nst_nosql_memory_free(ctx->ingest.stage);
+        }
+
         if(ctx->key) {
             nst_nosql_memory_free(ctx->key->area);
             nst_nosql_memory_free(ctx->key);
@@ -106,6 +115,8 @@ static int _nst_nosql_filter_http_headers(struct stream *s,
     struct stream_interface *si = &s->si[1];
     struct nst_nosql_ctx *ctx   = filter->ctx;
     struct nst_rule *rule       = NULL;
+    struct nst_rule_key **key   = NULL;
+    struct server *srv          = NULL;
     struct proxy *px            = s->be;
     struct appctx *appctx       = si_appctx(si);
     struct channel *req         = msg->chn;
@@ -130,25 +141,54 @@ static int _nst_nosql_filter_http_headers(struct stream *s,
             return 1;
         }
 
-        list_for_each_entry(rule, &px->nuster.rules, list) {
-            nst_debug(s, "[nosql] ==== Check rule: %s ====\n", rule->name);
+        if(s->txn->meth != HTTP_METH_GET
+                && nst_nosql_replication_prepare(ctx, s) != NST_OK) {
 
-            /* build key */
-            if(ctx->key) {
-                nst_nosql_memory_free(ctx->key);
-            }
+            appctx->st0 = NST_NOSQL_APPCTX_STATE_ERROR;
+            return 1;
+        }
+
+        /* first rule key decides the owner in shard mode */
+        rule = nst_shard_rule(px);
+
+        if(rule) {
 
             if(nst_nosql_build_key(ctx, rule->key, s, msg) != NST_OK) {
                 appctx->st0 = NST_NOSQL_APPCTX_STATE_ERROR;
                 return 1;
             }
 
-            nst_debug(s, "[nosql] Key: ");
-            nst_debug_key(ctx->key);
+            key = rule->key;
+            srv = nst_shard_owner(s, msg, ctx->hash);
 
-            ctx->hash = nst_hash(ctx->key->area, ctx->key->data);
+            if(srv && nst_shard_forward(s, msg, srv) == NST_OK) {
+                nst_debug(s, "[nosql] Forward to shard %s\n", srv->id);
+                ctx->state = NST_NOSQL_CTX_STATE_BYPASS;
+                return 1;
+            }
+        }
 
-            nst_debug(s, "[nosql] Hash: %"PRIu64"\n", ctx->hash);
+        list_for_each_entry(rule, &px->nuster.rules, list) {
+            nst_debug(s, "[nosql] ==== Check rule: %s ====\n", rule->name);
+
+            /* build key, rules sharing a key definition reuse the last one */
+            if(rule->key != key) {
+
+                if(ctx->key) {
+                    nst_key_free(global.nuster.nosql.memory, ctx->key);
+                }
+
+                if(nst_nosql_build_key(ctx, rule->key, s, msg) != NST_OK) {
+                    appctx->st0 = NST_NOSQL_APPCTX_STATE_ERROR;
+                    return 1;
+                }
+
+                nst_debug(s, "[nosql] Key: ");
+                nst_debug_key(ctx->key);
+                nst_debug(s, "[nosql] Hash: %"PRIu64"\n", ctx->hash);
+
+                key = rule->key;
+            }
 
             if(s->txn->meth == HTTP_METH_GET) {
                 nst_debug(s, "[nosql] Check key existence: ");
@@ -196,6 +236,9 @@ static int _nst_nosql_filter_http_headers(struct stream *s,
                 if(nst_nosql_delete(ctx->key, ctx->hash)) {
                     nst_debug(s, "[nosql] EXIST, to delete\n");
                     ctx->state = NST_NOSQL_CTX_STATE_DELETE;
+                    ctx->replication.seq = nst_nosql_replication_append(ctx,
+                            NST_NOSQL_JOURNAL_DELETE, ctx->key);
+
                     break;
                 }
 
@@ -266,6 +309,13 @@ static int _nst_nosql_filter_http_headers(struct stream *s,
 
     if(ctx->state == NST_NOSQL_CTX_STATE_DELETE) {
         appctx->st0 = NST_NOSQL_APPCTX_STATE_END;
+
+        /* replied in http_end once replicated */
+        if(ctx->replication.seq && global.nuster.nosql.replication_mode
+                == NST_REPLICATION_SYNC) {
+
+            appctx->st0 = NST_NOSQL_APPCTX_STATE_WAIT;
+        }
     }
 
     if(ctx->state == NST_NOSQL_CTX_STATE_FULL) {
@@ -279,9 +329,8 @@ static int _nst_nosql_filter_http_payload(struct stream *s,
         struct filter *filter, struct http_msg *msg,
         unsigned int offset, unsigned int len) {
 
-    struct stream_interface *si = &s->si[1];
-    struct appctx *appctx       = si_appctx(si);
-    struct nst_nosql_ctx *ctx   = filter->ctx;
+    struct nst_nosql_ctx *ctx = filter->ctx;
+    unsigned int ret;
 
     if(len <= 0) {
         return 0;
@@ -290,11 +339,41 @@ static int _nst_nosql_filter_http_payload(struct stream *s,
     if(ctx->state == NST_NOSQL_CTX_STATE_CREATE
             && !(msg->chn->flags & CF_ISRESP)) {
 
-        if(nst_nosql_update(ctx, msg, offset, len) != NST_OK) {
-            ctx->entry->state = NST_NOSQL_ENTRY_STATE_INVALID;
-            appctx->st0       = NST_NOSQL_APPCTX_STATE_FULL;
-            ctx->state        = NST_NOSQL_CTX_STATE_INVALID;
+        ret = nst_nosql_update(ctx, msg, offset, len);
+
+        if(ret == len) {
+
+            if(tick_isset(ctx->ingest.exp)) {
+                ctx->ingest.exp       = TICK_ETERNITY;
+                msg->chn->analyse_exp = TICK_ETERNITY;
+                msg->chn->flags      &= ~CF_ANA_TIMEOUT;
+            }
+
+            return len;
+        }
+
+        /*
+         * No memory left: leave the rest in the channel, which stops
+         * reading from the client, and retry until expired or deleted
+         * data is released.
+         */
+        if(!tick_isset(ctx->ingest.exp)) {
+            ctx->ingest.exp = tick_add(now_ms,
+                    MS_TO_TICKS(NST_NOSQL_INGEST_TIMEOUT));
         }
+
+        if(!tick_is_expired(ctx->ingest.exp, now_ms)) {
+            msg->chn->analyse_exp = tick_first(ctx->ingest.exp,
+                    tick_add(now_ms, MS_TO_TICKS(NST_NOSQL_INGEST_POLL)));
+
+            return ret;
+        }
+
+        /* the rest of the body is dropped, replied in http_end */
+        ctx->entry->state     = NST_NOSQL_ENTRY_STATE_INVALID;
+        ctx->state            = NST_NOSQL_CTX_STATE_FULL;
+        msg->chn->analyse_exp = TICK_ETERNITY;
+        msg->chn->flags      &= ~CF_ANA_TIMEOUT;
     }
 
     return len;
@@ -314,11 +393,55 @@ static int _nst_nosql_filter_http_end(struct stream *s, struct filter *filter,
 
         if(ctx->state == NST_NOSQL_CTX_STATE_DONE) {
             appctx->st0 = NST_NOSQL_APPCTX_STATE_END;
+            ctx->replication.seq = nst_nosql_replication_append(ctx,
+                    NST_NOSQL_JOURNAL_SET, ctx->key);
+
         } else {
             appctx->st0 = NST_NOSQL_APPCTX_STATE_EMPTY;
         }
     }
 
+    if(ctx->state == NST_NOSQL_CTX_STATE_FULL
+            && appctx->st0 == NST_NOSQL_APPCTX_STATE_CREATE) {
+
+        appctx->st0 = NST_NOSQL_APPCTX_STATE_FULL;
+        appctx_wakeup(appctx);
+    }
+
+    /* sync replication: hold the reply until all replicas acked */
+    if(ctx->replication.seq
+            && global.nuster.nosql.replication_mode == NST_REPLICATION_SYNC) {
+
+        int replicated = nst_nosql_replicated(ctx->replication.seq);
+
+        if(!replicated) {
+
+            if(!tick_isset(ctx->replication.exp)) {
+                ctx->replication.exp = tick_add(now_ms,
+                        MS_TO_TICKS(global.nuster.nosql.replication_timeout));
+            }
+
+            if(!tick_is_expired(ctx->replication.exp, now_ms)) {
+                appctx->st0 = NST_NOSQL_APPCTX_STATE_WAIT;
+                msg->chn->analyse_exp = tick_first(ctx->replication.exp,
+                        tick_add(now_ms,
+                            MS_TO_TICKS(NST_NOSQL_REPLICATION_POLL)));
+
+                return 0;
+            }
+
+            appctx->st0 = NST_NOSQL_APPCTX_STATE_TIMEOUT;
+        } else if(replicated < 0) {
+            appctx->st0 = NST_NOSQL_APPCTX_STATE_NOT_REPLICATED;
+        } else {
+            appctx->st0 = NST_NOSQL_APPCTX_STATE_END;
+        }
+
+        ctx->replication.seq  = 0;
+        msg->chn->analyse_exp = TICK_ETERNITY;
+        appctx_wakeup(appctx);
+    }
+
     return 1;
 }
 
@@ -0,0 +1,758 @@
+/*
+ * nuster nosql replication functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include <common/cfgparse.h>
+
+#include <types/global.h>
+
+#include <proto/applet.h>
+#include <proto/channel.h>
+#include <proto/frontend.h>
+#include <proto/http_htx.h>
+#include <proto/log.h>
+#include <proto/proxy.h>
+#include <proto/server.h>
+#include <proto/session.h>
+#include <proto/stream.h>
+#include <proto/stream_interface.h>
+#include <proto/task.h>
+
+#include <nuster/memory.h>
+#include <nuster/shctx.h>
+#include <nuster/nuster.h>
+
+static struct proxy              nst_nosql_replication_fe;
+static struct proxy             *nst_nosql_replication_be   = NULL;
+static struct task              *nst_nosql_replication_task = NULL;
+static struct nst_nosql_replica *nst_nosql_replicas         = NULL;
+static int                       nst_nosql_replica_count    = 0;
+
+/*
+ * set journal->acked to the smallest replica cursor, journal must be locked
+ */
+static void _nst_nosql_journal_ack(struct nst_nosql_journal *journal) {
+    uint64_t acked = journal->head;
+    int i;
+
+    for(i = 0; i < nst_nosql_replica_count; i++) {
+
+        if(nst_nosql_replicas[i].cursor < acked) {
+            acked = nst_nosql_replicas[i].cursor;
+        }
+    }
+
+    journal->acked = acked;
+}
+
+/*
+ * seq will never reach a replica, either too large or rejected by it.
+ * journal must be locked
+ */
+static void _nst_nosql_journal_fail(struct nst_nosql_journal *journal,
+        uint64_t seq) {
+
+    struct nst_nosql_journal_record *record;
+
+    record = &journal->record[seq % journal->size];
+
+    if(record->seq == seq) {
+        record->failed = 1;
+    }
+
+    journal->failed++;
+}
+
+static uint64_t _nst_nosql_journal_append(int op, struct buffer *key,
+        uint64_t hash, struct nst_str *host, struct nst_str *uri) {
+
+    struct nst_nosql_journal *journal = nuster.nosql->journal;
+    struct nst_nosql_journal_record *record;
+    uint64_t seq;
+    char *buf, *old;
+
+    buf = nst_nosql_memory_alloc(key->data + host->len + uri->len);
+
+    if(!buf) {
+        nst_shctx_lock(journal);
+        journal->lost++;
+        nst_shctx_unlock(journal);
+
+        return 0;
+    }
+
+    memcpy(buf, key->area, key->data);
+    memcpy(buf + key->data, host->data, host->len);
+    memcpy(buf + key->data + host->len, uri->data, uri->len);
+
+    nst_shctx_lock(journal);
+
+    seq    = ++journal->head;
+    record = &journal->record[seq % journal->size];
+    old    = record->buf;
+
+    record->seq      = seq;
+    record->hash     = hash;
+    record->op       = op;
+    record->key_len  = key->data;
+    record->host_len = host->len;
+    record->uri_len  = uri->len;
+    record->failed   = 0;
+    record->buf      = buf;
+
+    nst_shctx_unlock(journal);
+
+    if(old) {
+        nst_nosql_memory_free(old);
+    }
+
+    /* other processes are caught up by the periodic run */
+    if(relative_pid == 1) {
+        task_wakeup(nst_nosql_replication_task, TASK_WOKEN_MSG);
+    }
+
+    return seq;
+}
+
+static void _nst_nosql_replica_release_data(struct nst_nosql_replica *replica) {
+
+    if(replica->data) {
+        nst_nosql_data_release(replica->data);
+
+        replica->data    = NULL;
+        replica->element = NULL;
+    }
+}
+
+static int _nst_nosql_replica_connect(struct nst_nosql_replica *replica) {
+    struct appctx  *appctx;
+    struct session *sess;
+    struct stream  *strm;
+
+    appctx = appctx_new(&nuster.applet.nosql_replication, tid_bit);
+
+    if(!appctx) {
+        goto err;
+    }
+
+    appctx->st0 = NST_NOSQL_REPLICATION_APPCTX_STATE_HEADER;
+    appctx->ctx.nuster.nosql_replication.replica = replica;
+
+    sess = session_new(&nst_nosql_replication_fe, NULL, &appctx->obj_type);
+
+    if(!sess) {
+        goto out_free_appctx;
+    }
+
+    strm = stream_new(sess, &appctx->obj_type);
+
+    if(!strm) {
+        goto out_free_sess;
+    }
+
+    stream_set_backend(strm, replica->srv->proxy);
+
+    /* always to this replica, regardless of the balance algorithm */
+    strm->target = &replica->srv->obj_type;
+    strm->flags |= SF_DIRECT | SF_ASSIGNED;
+
+    /* applet is waiting for data */
+    si_cant_get(&strm->si[0]);
+    appctx_wakeup(appctx);
+
+    strm->do_log     = NULL;
+    strm->res.flags |= CF_READ_DONTWAIT;
+
+    replica->busy     = 1;
+    replica->status   = 0;
+    replica->rejected = 0;
+
+    task_wakeup(strm->task, TASK_WOKEN_INIT);
+
+    return NST_OK;
+
+out_free_sess:
+    session_free(sess);
+out_free_appctx:
+    appctx_free(appctx);
+err:
+    return NST_ERR;
+}
+
+/*
+ * Send the record next to replica->cursor, records whose value has
+ * been deleted or replaced meanwhile are skipped, the later record
+ * carries the change.
+ */
+static void _nst_nosql_replica_send(struct nst_nosql_replica *replica) {
+    struct nst_nosql_journal *journal = nuster.nosql->journal;
+    struct nst_nosql_journal_record *record;
+    struct nst_nosql_entry *entry;
+    struct nst_data_element *element;
+    uint64_t len;
+    char *host, *uri;
+    int valid, copy;
+    uint8_t inl[NST_NOSQL_ENTRY_INLINE_MAX];
+
+    while(1) {
+        nst_shctx_lock(journal);
+
+        if(replica->cursor >= journal->head) {
+            nst_shctx_unlock(journal);
+            return;
+        }
+
+        if(journal->head - replica->cursor > journal->size) {
+            journal->lost += journal->head - journal->size - replica->cursor;
+            replica->cursor = journal->head - journal->size;
+
+            if(replica->cursor > journal->lost_seq) {
+                journal->lost_seq = replica->cursor;
+            }
+        }
+
+        replica->seq = replica->cursor + 1;
+        record       = &journal->record[replica->seq % journal->size];
+
+        /* the request channel keeps maxrewrite of the buffer free */
+        if(record->key_len > replica->key.size
+                || record->host_len + record->uri_len + 256
+                > global.tune.bufsize - global.tune.maxrewrite) {
+
+            _nst_nosql_journal_fail(journal, replica->seq);
+            replica->cursor = replica->seq;
+            _nst_nosql_journal_ack(journal);
+            nst_shctx_unlock(journal);
+            continue;
+        }
+
+        replica->op   = record->op;
+        replica->hash = record->hash;
+
+        memcpy(replica->key.area, record->buf, record->key_len);
+        replica->key.data = record->key_len;
+
+        host = record->buf + record->key_len;
+        uri  = host + record->host_len;
+
+        chunk_reset(&replica->req);
+        chunk_appendf(&replica->req, "%s %.*s HTTP/1.1\r\n",
+                replica->op == NST_NOSQL_JOURNAL_SET ? "POST" : "DELETE",
+                record->uri_len, uri);
+
+        if(record->host_len) {
+            chunk_appendf(&replica->req, "host: %.*s\r\n",
+                    record->host_len, host);
+        }
+
+        nst_shctx_unlock(journal);
+
+        if(replica->op == NST_NOSQL_JOURNAL_SET) {
+            nst_shctx_lock(&nuster.nosql->dict[0]);
+            entry = nst_nosql_dict_get(&replica->key, replica->hash);
+
+            valid = entry && entry->state == NST_NOSQL_ENTRY_STATE_VALID;
+            copy  = valid && !entry->data;
+
+            if(copy) {
+                memcpy(inl, nst_nosql_entry_inline(entry),
+                        nst_nosql_entry_inline_len(entry));
+            } else if(valid) {
+                replica->data = entry->data;
+                replica->data->clients++;
+            }
+
+            nst_shctx_unlock(&nuster.nosql->dict[0]);
+
+            if(copy) {
+                replica->data = nst_nosql_data_copy(inl);
+            }
+
+            if(!replica->data) {
+                nst_shctx_lock(journal);
+
+                /* no memory to copy an inline value */
+                if(valid) {
+                    _nst_nosql_journal_fail(journal, replica->seq);
+                }
+                replica->cursor = replica->seq;
+                _nst_nosql_journal_ack(journal);
+                nst_shctx_unlock(journal);
+                continue;
+            }
+
+            len     = 0;
+            element = replica->data->element;
+
+            while(element) {
+
+                if((element->msg.len >> 28) == HTX_BLK_DATA) {
+                    len += element->msg.len & 0xfffffff;
+                }
+
+                element = element->next;
+            }
+
+            chunk_appendf(&replica->req, "content-length: %"PRIu64"\r\n",
+                    len);
+
+            if(replica->data->info.content_type.len
+                    && replica->req.data
+                    + replica->data->info.content_type.len + 128
+                    < global.tune.bufsize - global.tune.maxrewrite) {
+
+                chunk_appendf(&replica->req, "content-type: %.*s\r\n",
+                        replica->data->info.content_type.len,
+                        replica->data->info.content_type.data);
+            }
+
+            replica->element = replica->data->element;
+            replica->offset  = 0;
+        }
+
+        chunk_appendf(&replica->req, "%s: 1\r\nconnection: close\r\n\r\n",
+                NST_NOSQL_REPLICATION_HEADER);
+
+        if(_nst_nosql_replica_connect(replica) != NST_OK) {
+            _nst_nosql_replica_release_data(replica);
+            replica->retry = tick_add(now_ms,
+                    MS_TO_TICKS(NST_NOSQL_REPLICATION_RETRY));
+        }
+
+        return;
+    }
+}
+
+static struct task *_nst_nosql_replication_process(struct task *t,
+        void *context, unsigned short state) {
+
+    int i;
+
+    /* only the first worker replicates */
+    if(master || relative_pid != 1) {
+        t->expire = TICK_ETERNITY;
+        return t;
+    }
+
+    for(i = 0; i < nst_nosql_replica_count; i++) {
+        struct nst_nosql_replica *replica = &nst_nosql_replicas[i];
+
+        if(replica->busy) {
+            continue;
+        }
+
+        if(tick_isset(replica->retry)) {
+
+            if(!tick_is_expired(replica->retry, now_ms)) {
+                continue;
+            }
+
+            replica->retry = TICK_ETERNITY;
+        }
+
+        _nst_nosql_replica_send(replica);
+    }
+
+    t->expire = tick_add(now_ms, MS_TO_TICKS(NST_NOSQL_REPLICATION_INTERVAL));
+
+    return t;
+}
+
+static void _nst_nosql_replication_handler(struct appctx *appctx) {
+    struct nst_nosql_replica *replica;
+    struct nst_data_element *element;
+    struct stream_interface *si = appctx->owner;
+    struct channel *req         = si_ic(si);
+    struct channel *res         = si_oc(si);
+    char line[64];
+    uint32_t sz;
+    int ret, max;
+
+    replica = appctx->ctx.nuster.nosql_replication.replica;
+
+    if(unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO)) {
+        return;
+    }
+
+    switch(appctx->st0) {
+        case NST_NOSQL_REPLICATION_APPCTX_STATE_HEADER:
+            ret = ci_putblk(req, replica->req.area, replica->req.data);
+
+            if(ret == -1) {
+                si_rx_room_blk(si);
+                return;
+            }
+
+            /* larger than the channel accepts, retrying will not help */
+            if(ret == -3) {
+                replica->rejected = 1;
+            }
+
+            if(ret < 0) {
+                goto end;
+            }
+
+            appctx->st0 = NST_NOSQL_REPLICATION_APPCTX_STATE_BODY;
+            /* fall through */
+        case NST_NOSQL_REPLICATION_APPCTX_STATE_BODY:
+
+            while((element = replica->element)) {
+
+                if((element->msg.len >> 28) != HTX_BLK_DATA) {
+                    replica->element = element->next;
+                    continue;
+                }
+
+                sz  = (element->msg.len & 0xfffffff) - replica->offset;
+                max = channel_recv_max(req);
+
+                if(max <= 0) {
+                    si_rx_room_blk(si);
+                    return;
+                }
+
+                if(sz > (uint32_t)max) {
+                    sz = max;
+                }
+
+                ret = ci_putblk(req, element->msg.data + replica->offset, sz);
+
+                if(ret == -1) {
+                    si_rx_room_blk(si);
+                    return;
+                }
+
+                if(ret < 0) {
+                    goto end;
+                }
+
+                replica->offset += sz;
+
+                if(replica->offset == (element->msg.len & 0xfffffff)) {
+                    replica->element = element->next;
+                    replica->offset  = 0;
+                }
+            }
+
+            appctx->st0 = NST_NOSQL_REPLICATION_APPCTX_STATE_STATUS;
+            /* fall through */
+        case NST_NOSQL_REPLICATION_APPCTX_STATE_STATUS:
+            ret = co_getline(res, line, sizeof(line));
+
+            if(ret == 0) {
+                return;
+            }
+
+            /* HTTP/1.x NNN */
+            if(ret > 12 && !memcmp(line, "HTTP/1.", 7)) {
+                replica->status = strl2ui(line + 9, 3);
+            }
+
+            appctx->st0 = NST_NOSQL_REPLICATION_APPCTX_STATE_END;
+            goto end;
+        default:
+            co_skip(res, co_data(res));
+            return;
+    }
+
+end:
+    co_skip(res, co_data(res));
+    si_shutw(si);
+    si_shutr(si);
+    req->flags |= CF_READ_NULL;
+}
+
+static void _nst_nosql_replication_release(struct appctx *appctx) {
+    struct nst_nosql_journal *journal = nuster.nosql->journal;
+    struct nst_nosql_replica *replica;
+
+    replica = appctx->ctx.nuster.nosql_replication.replica;
+
+    _nst_nosql_replica_release_data(replica);
+
+    nst_shctx_lock(journal);
+
+    if(replica->status >= 200 && replica->status < 300) {
+        journal->sent++;
+        replica->cursor = replica->seq;
+    } else if(replica->op == NST_NOSQL_JOURNAL_DELETE
+            && replica->status == 404) {
+
+        /* already gone */
+        journal->sent++;
+        replica->cursor = replica->seq;
+    } else if(replica->status || replica->rejected) {
+        /* rejected by the replica, retrying will not help */
+        _nst_nosql_journal_fail(journal, replica->seq);
+        replica->cursor = replica->seq;
+    } else {
+        journal->failed++;
+        replica->retry = tick_add(now_ms,
+                MS_TO_TICKS(NST_NOSQL_REPLICATION_RETRY));
+    }
+
+    _nst_nosql_journal_ack(journal);
+
+    nst_shctx_unlock(journal);
+
+    replica->busy = 0;
+
+    task_wakeup(nst_nosql_replication_task, TASK_WOKEN_MSG);
+}
+
+/*
+ * The replication backend is checked with the configuration, it must exist
+ * and be in mode tcp. Returns the number of errors.
+ */
+static int _nst_nosql_replication_check() {
+    struct proxy *be;
+
+    if(!global.nuster.nosql.replication) {
+        return 0;
+    }
+
+    be = proxy_be_by_name(global.nuster.nosql.replication);
+
+    if(!be) {
+        ha_alert("nuster nosql replication: no such backend `%s`.\n",
+                global.nuster.nosql.replication);
+
+        return 1;
+    }
+
+    if(be->mode != PR_MODE_TCP) {
+        ha_alert("nuster nosql replication: backend `%s` should be mode "
+                "tcp.\n", be->id);
+
+        return 1;
+    }
+
+    nst_nosql_replication_be = be;
+
+    return 0;
+}
+
+int nst_nosql_replication_init() {
+    struct nst_nosql_journal *journal;
+    struct proxy *be;
+    struct server *srv;
+    size_t size;
+    int i;
+
+    nuster.applet.nosql_replication.fct     = _nst_nosql_replication_handler;
+    nuster.applet.nosql_replication.release = _nst_nosql_replication_release;
+
+    if(!global.nuster.nosql.replication) {
+        return NST_OK;
+    }
+
+    be = nst_nosql_replication_be;
+
+    for(srv = be->srv; srv; srv = srv->next) {
+        nst_nosql_replica_count++;
+    }
+
+    if(!nst_nosql_replica_count) {
+        ha_warning("nuster nosql replication: backend `%s` has no server.\n",
+                be->id);
+
+        return NST_OK;
+    }
+
+    nst_nosql_replicas = calloc(nst_nosql_replica_count,
+            sizeof(*nst_nosql_replicas));
+
+    if(!nst_nosql_replicas) {
+        return NST_ERR;
+    }
+
+    for(i = 0, srv = be->srv; srv; srv = srv->next, i++) {
+        struct nst_nosql_replica *replica = &nst_nosql_replicas[i];
+
+        replica->srv   = srv;
+        replica->retry = TICK_ETERNITY;
+
+        replica->key = b_make(malloc(global.tune.bufsize),
+                global.tune.bufsize, 0, 0);
+
+        replica->req = b_make(malloc(global.tune.bufsize),
+                global.tune.bufsize, 0, 0);
+
+        if(!replica->key.area || !replica->req.area) {
+            return NST_ERR;
+        }
+    }
+
+    /* journal and records are shared by all processes */
+    size = sizeof(*journal) + global.nuster.nosql.replication_journal
+        * sizeof(struct nst_nosql_journal_record);
+
+    journal = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED,
+            -1, 0);
+
+    if(journal == MAP_FAILED) {
+        return NST_ERR;
+    }
+
+    memset(journal, 0, size);
+
+    journal->size   = global.nuster.nosql.replication_journal;
+    journal->record = (struct nst_nosql_journal_record *)(journal + 1);
+
+    if(nst_shctx_init(journal) != NST_OK) {
+        return NST_ERR;
+    }
+
+    nuster.nosql->journal = journal;
+
+    memset(&nst_nosql_replication_fe, 0, sizeof(nst_nosql_replication_fe));
+    init_new_proxy(&nst_nosql_replication_fe);
+
+    nst_nosql_replication_fe.id              = "<NUSTER.NOSQL.REPLICATION>";
+    nst_nosql_replication_fe.last_change     = now.tv_sec;
+    nst_nosql_replication_fe.cap             = PR_CAP_FE;
+    nst_nosql_replication_fe.mode            = PR_MODE_TCP;
+    nst_nosql_replication_fe.options2       |= PR_O2_INDEPSTR;
+    nst_nosql_replication_fe.conn_retries    = CONN_RETRIES;
+    nst_nosql_replication_fe.accept          = frontend_accept;
+    nst_nosql_replication_fe.timeout.client  = TICK_ETERNITY;
+    nst_nosql_replication_fe.fe_req_ana      = AN_REQ_SWITCHING_RULES;
+
+    nst_nosql_replication_task = task_new(1);
+
+    if(!nst_nosql_replication_task) {
+        return NST_ERR;
+    }
+
+    nst_nosql_replication_task->process = _nst_nosql_replication_process;
+    nst_nosql_replication_task->context = NULL;
+
+    task_wakeup(nst_nosql_replication_task, TASK_WOKEN_INIT);
+
+    return NST_OK;
+}
+
+/*
+ * Called for POST and DELETE before the rules are checked, uri is
+ * copied as it is needed after the start line has been forwarded.
+ */
+int nst_nosql_replication_prepare(struct nst_nosql_ctx *ctx,
+        struct stream *s) {
+
+    struct htx *htx = htxbuf(&s->req.buf);
+    struct http_hdr_ctx hdr = { .blk = NULL };
+
+    if(!nuster.nosql->journal) {
+        return NST_OK;
+    }
+
+    ctx->replication.exp = TICK_ETERNITY;
+
+    /*
+     * sent by a primary, do not replicate again. Only the replicas are
+     * trusted with the header, it is removed from the other clients.
+     */
+    if(http_find_header(htx, ist(NST_NOSQL_REPLICATION_HEADER), &hdr, 0)) {
+
+        if(nst_trusted_source(s, nst_nosql_replication_be)) {
+            ctx->replication.skip = 1;
+            return NST_OK;
+        }
+
+        nst_strip_header(&s->txn->req, NST_NOSQL_REPLICATION_HEADER);
+    }
+
+    ctx->replication.uri.data = nst_nosql_memory_alloc(ctx->req.uri.len);
+
+    if(!ctx->replication.uri.data) {
+        return NST_ERR;
+    }
+
+    memcpy(ctx->replication.uri.data, ctx->req.uri.data, ctx->req.uri.len);
+    ctx->replication.uri.len = ctx->req.uri.len;
+
+    return NST_OK;
+}
+
+/*
+ * return the journal seq, 0 if not journaled
+ */
+uint64_t nst_nosql_replication_append(struct nst_nosql_ctx *ctx, int op,
+        struct buffer *key) {
+
+    if(!nuster.nosql->journal || ctx->replication.skip
+            || !ctx->replication.uri.data) {
+
+        return 0;
+    }
+
+    return _nst_nosql_journal_append(op, key, ctx->hash, &ctx->req.host,
+            &ctx->replication.uri);
+}
+
+/*
+ * Return 1 once all replicas have accepted seq, 0 while it is pending, -1 if
+ * a replica dropped or rejected it. A record overwritten in the journal is
+ * only reported accepted if it was acked before any record got lost.
+ */
+int nst_nosql_replicated(uint64_t seq) {
+    struct nst_nosql_journal *journal = nuster.nosql->journal;
+    struct nst_nosql_journal_record *record;
+    int ret;
+
+    nst_shctx_lock(journal);
+
+    record = &journal->record[seq % journal->size];
+
+    if(record->seq == seq && record->failed) {
+        ret = -1;
+    } else if(journal->acked < seq) {
+        ret = record->seq == seq ? 0 : -1;
+    } else {
+        ret = record->seq == seq || seq > journal->lost_seq ? 1 : -1;
+    }
+
+    nst_shctx_unlock(journal);
+
+    return ret;
+}
+
+void nst_nosql_replication_dump(struct buffer *buf) {
+    struct nst_nosql_journal *journal = nuster.nosql->journal;
+
+    if(!journal) {
+        return;
+    }
+
+    chunk_appendf(buf, "global.nuster.nosql.replication.journal.size: %d\n",
+            journal->size);
+
+    chunk_appendf(buf, "global.nuster.nosql.replication.journal.head: "
+            "%"PRIu64"\n", journal->head);
+
+    chunk_appendf(buf, "global.nuster.nosql.replication.journal.acked: "
+            "%"PRIu64"\n", journal->acked);
+
+    chunk_appendf(buf, "global.nuster.nosql.replication.sent: %"PRIu64"\n",
+            journal->sent);
+
+    chunk_appendf(buf, "global.nuster.nosql.replication.failed: %"PRIu64"\n",
+            journal->failed);
+
+    chunk_appendf(buf, "global.nuster.nosql.replication.lost: %"PRIu64"\n",
+            journal->lost);
+}
+
+REGISTER_CONFIG_POSTPARSER("nuster nosql replication",
+        _nst_nosql_replication_check);
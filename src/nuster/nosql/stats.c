@@ -21,20 +21,54 @@
 #include <nuster/memory.h>
 #include <nuster/shctx.h>
 
-void nst_nosql_stats_update_used_mem(int i) {
-    nst_shctx_lock(global.nuster.nosql.stats);
-    global.nuster.nosql.stats->used_mem += i;
-    nst_shctx_unlock(global.nuster.nosql.stats);
+/*
+ * memory used by items, that is entries, keys and data, in chunk size
+ */
+uint64_t nst_nosql_stats_used_mem() {
+    uint64_t used = nst_memory_in_use(global.nuster.nosql.memory);
+    uint64_t base = global.nuster.nosql.stats->base_mem;
+
+    return used > base ? used - base : 0;
 }
 
 int nst_nosql_stats_full() {
-    int i;
+    return global.nuster.nosql.data_size <= nst_nosql_stats_used_mem();
+}
+
+void nst_nosql_stats_dump(struct buffer *buf) {
+    uint64_t items = nuster.nosql->dict[0].used;
+    uint64_t used  = nst_nosql_stats_used_mem();
+
+    chunk_appendf(buf, "global.nuster.nosql.data.size: %"PRIu64"\n",
+            global.nuster.nosql.data_size);
+
+    chunk_appendf(buf, "global.nuster.nosql.dict.size: %"PRIu64"\n",
+            global.nuster.nosql.dict_size);
 
-    nst_shctx_lock(global.nuster.nosql.stats);
-    i =  global.nuster.nosql.data_size <= global.nuster.nosql.stats->used_mem;
-    nst_shctx_unlock(global.nuster.nosql.stats);
+    chunk_appendf(buf, "global.nuster.nosql.page.size: %"PRIu64"\n",
+            global.nuster.nosql.memory->page_size);
+
+    chunk_appendf(buf, "global.nuster.nosql.page.hugepage: %s\n",
+            nst_memory_hugepage_str(global.nuster.nosql.memory));
+
+    chunk_appendf(buf, "global.nuster.nosql.stats.used_mem: %"PRIu64"\n",
+            used);
+
+    chunk_appendf(buf, "global.nuster.nosql.stats.items: %"PRIu64"\n",
+            items);
+
+    chunk_appendf(buf, "global.nuster.nosql.stats.bytes_per_item: %"PRIu64"\n",
+            items ? used / items : 0);
+
+    nst_memory_stats_dump(buf, global.nuster.nosql.memory,
+            "global.nuster.nosql.memory");
+
+    if(global.nuster.nosql.root) {
+        nst_persist_stats_dump(buf, &nuster.nosql->disk,
+                "global.nuster.nosql.disk");
+    }
 
-    return i;
+    nst_nosql_replication_dump(buf);
 }
 
 int nst_nosql_stats_init() {
@@ -49,7 +83,8 @@ int nst_nosql_stats_init() {
         return NST_ERR;
     }
 
-    global.nuster.nosql.stats->used_mem = 0;
+    /* everything allocated so far is not used by items */
+    global.nuster.nosql.stats->base_mem = global.nuster.nosql.memory->used;
 
     return NST_OK;
 }
@@ -12,10 +12,16 @@
 
 #include <types/global.h>
 
+#include <types/backend.h>
+
+#include <proto/connection.h>
+#include <proto/stream.h>
 #include <proto/stream_interface.h>
 #include <proto/proxy.h>
 #include <proto/log.h>
 #include <proto/acl.h>
+#include <proto/http_htx.h>
+#include <proto/lb_chash.h>
 
 #include <nuster/memory.h>
 #include <nuster/nuster.h>
@@ -45,9 +51,56 @@ struct nuster nuster = {
             .obj_type = OBJ_TYPE_APPLET,
             .name     = "<NUSTER.CACHE.ENGINE2>",
         },
+        .nosql_replication = {
+            .obj_type = OBJ_TYPE_APPLET,
+            .name     = "<NUSTER.NOSQL.REPLICATION>",
+        },
     },
 };
 
+static void _nst_shard_init(struct proxy *p) {
+    struct proxy *be;
+    struct server *srv;
+
+    if(!p->nuster.shard.name) {
+        return;
+    }
+
+    be = proxy_be_by_name(p->nuster.shard.name);
+
+    if(!be) {
+        ha_alert("Proxy [%s]: nuster shard backend `%s` not found.\n",
+                p->id, p->nuster.shard.name);
+
+        exit(1);
+    }
+
+    if(be->mode != PR_MODE_HTTP
+            || (be->lbprm.algo & BE_LB_LKUP) != BE_LB_LKUP_CHTREE) {
+
+        ha_alert("Proxy [%s]: nuster shard backend `%s` should be mode http "
+                "with a hash balance and hash-type consistent.\n", p->id,
+                be->id);
+
+        exit(1);
+    }
+
+    for(srv = be->srv; srv; srv = srv->next) {
+
+        if(!strcmp(srv->id, global.node)) {
+            p->nuster.shard.self = srv;
+        }
+    }
+
+    if(!p->nuster.shard.self) {
+        ha_warning("Proxy [%s]: no server named `%s` (global node) in shard "
+                "backend `%s`, all requests will be forwarded.\n", p->id,
+                global.node, be->id);
+    }
+
+    p->nuster.shard.be = be;
+}
+
 void nuster_init() {
     int i, uuid;
     struct proxy *p;
@@ -76,6 +129,8 @@ void nuster_init() {
         uint32_t ttl;
         struct nst_memory *m  = NULL;
 
+        _nst_shard_init(p);
+
         list_for_each_entry(rule, &p->nuster.rules, list) {
             struct proxy *pt;
 
@@ -138,6 +193,146 @@ err:
     exit(1);
 }
 
+/*
+ * Whether the client of s connects from the address of one of the servers of
+ * be, only these nodes are trusted with the nuster internal headers.
+ */
+int nst_trusted_source(struct stream *s, struct proxy *be) {
+    struct connection *conn = objt_conn(strm_sess(s)->origin);
+    struct server *srv;
+
+    if(!be || !conn || !conn_get_src(conn)) {
+        return 0;
+    }
+
+    for(srv = be->srv; srv; srv = srv->next) {
+
+        if(ipcmp(conn->src, &srv->addr) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* remove all the occurrences of header name from the request */
+void nst_strip_header(struct http_msg *msg, const char *name) {
+    struct htx *htx = htxbuf(&msg->chn->buf);
+    struct http_hdr_ctx hdr = { .blk = NULL };
+
+    while(http_find_header(htx, ist(name), &hdr, 1)) {
+        http_remove_header(htx, &hdr);
+    }
+}
+
+/*
+ * Return the first rule of p which is not disabled, its key decides the
+ * owner in shard mode.
+ */
+struct nst_rule *nst_shard_rule(struct proxy *p) {
+    struct nst_rule *rule;
+
+    if(!p->nuster.shard.be) {
+        return NULL;
+    }
+
+    list_for_each_entry(rule, &p->nuster.rules, list) {
+
+        if(*rule->state != NST_RULE_DISABLED) {
+            return rule;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the node owning hash in the shard ring of the backend, NULL if
+ * sharding is not enabled, or it is this node, or the request has already
+ * been forwarded by another node. The shard header of a client which is not
+ * a node is removed.
+ */
+struct server *nst_shard_owner(struct stream *s, struct http_msg *msg,
+        uint64_t hash) {
+
+    struct proxy *be = s->be->nuster.shard.be;
+    struct htx *htx;
+    struct http_hdr_ctx hdr = { .blk = NULL };
+    struct server *srv;
+    unsigned int h;
+
+    if(!be) {
+        return NULL;
+    }
+
+    htx = htxbuf(&msg->chn->buf);
+
+    if(http_find_header(htx, ist(NST_SHARD_HEADER), &hdr, 0)) {
+
+        if(nst_trusted_source(s, be)) {
+            return NULL;
+        }
+
+        nst_strip_header(msg, NST_SHARD_HEADER);
+    }
+
+    h = (unsigned int)(hash ^ (hash >> 32));
+
+    if((be->lbprm.algo & BE_LB_HASH_MOD) == BE_LB_HMOD_AVAL) {
+        h = full_hash(h);
+    }
+
+    srv = chash_get_server_hash(be, h, NULL);
+
+    if(srv == s->be->nuster.shard.self) {
+        return NULL;
+    }
+
+    return srv;
+}
+
+/*
+ * Send the request to srv instead of the origin or the nosql applet. The
+ * backend is already assigned so stream_set_backend() cannot be used, the
+ * stream is moved to the shard backend the same way, leaving its filters
+ * and request rules out.
+ */
+int nst_shard_forward(struct stream *s, struct http_msg *msg,
+        struct server *srv) {
+
+    struct htx *htx = htxbuf(&msg->chn->buf);
+    struct proxy *be = srv->proxy;
+
+    if(!http_add_header(htx, ist(NST_SHARD_HEADER), ist(global.node))) {
+        return NST_ERR;
+    }
+
+    /* nosql registers its applet before the filter runs */
+    si_release_endpoint(&s->si[1]);
+
+    HA_ATOMIC_SUB(&s->be->beconn, 1);
+
+    s->be = be;
+    HA_ATOMIC_UPDATE_MAX(&be->be_counters.conn_max,
+            HA_ATOMIC_ADD(&be->beconn, 1));
+    proxy_inc_be_ctr(be);
+
+    s->si[1].flags &= ~SI_FL_INDEP_STR;
+
+    if(be->options2 & PR_O2_INDEPSTR) {
+        s->si[1].flags |= SI_FL_INDEP_STR;
+    }
+
+    if(tick_isset(be->timeout.serverfin)) {
+        s->si[1].hcto = be->timeout.serverfin;
+    }
+
+    s->target = &srv->obj_type;
+    s->flags |= SF_DIRECT | SF_ASSIGNED;
+
+    return NST_OK;
+}
+
 int nst_test_rule(struct nst_rule *rule, struct stream *s, int res) {
     int ret;
 
@@ -167,6 +362,42 @@ int nst_test_rule(struct nst_rule *rule, struct stream *s, int res) {
     return NST_ERR;
 }
 
+/*
+ * Per-thread buffer the request keys are built in, so that a lookup does not
+ * need any allocation. Keys are copied out with nst_key_copy() when they must
+ * outlive the current call.
+ */
+static THREAD_LOCAL struct buffer nst_key_scratch_buf = BUF_NULL;
+
+static int nst_key_scratch_alloc() {
+    nst_key_scratch_buf.area = malloc(global.tune.bufsize);
+
+    if(!nst_key_scratch_buf.area) {
+        ha_alert("Out of memory when initializing nuster key buffer.\n");
+        return 0;
+    }
+
+    nst_key_scratch_buf.size = global.tune.bufsize;
+    nst_key_scratch_buf.data = 0;
+    nst_key_scratch_buf.head = 0;
+
+    return 1;
+}
+
+static void nst_key_scratch_free() {
+    free(nst_key_scratch_buf.area);
+    nst_key_scratch_buf = BUF_NULL;
+}
+
+REGISTER_PER_THREAD_INIT(nst_key_scratch_alloc);
+REGISTER_PER_THREAD_DEINIT(nst_key_scratch_free);
+
+struct buffer *nst_key_scratch() {
+    nst_key_scratch_buf.data = 0;
+
+    return &nst_key_scratch_buf;
+}
+
 struct buffer *nst_key_init(struct nst_memory *memory) {
     struct buffer *key  = nst_memory_alloc(memory, sizeof(*key));
 
@@ -184,14 +415,62 @@ struct buffer *nst_key_init(struct nst_memory *memory) {
     key->size = NST_CACHE_DEFAULT_KEY_SIZE;
     key->data = 0;
     key->head = 0;
-    memset(key->area, 0, key->size);
 
     return key;
 }
 
+/*
+ * Copy key into an exactly sized buffer, allocated from memory, or from the
+ * process heap if memory is NULL
+ */
+struct buffer *nst_key_copy(struct nst_memory *memory, struct buffer *key) {
+    struct buffer *copy;
+
+    copy = memory ? nst_memory_alloc(memory, sizeof(*copy))
+        : malloc(sizeof(*copy));
+
+    if(!copy) {
+        return NULL;
+    }
+
+    copy->area = memory ? nst_memory_alloc(memory, key->data)
+        : malloc(key->data);
+
+    if(!copy->area) {
+        nst_key_free(memory, copy);
+        return NULL;
+    }
+
+    memcpy(copy->area, key->area, key->data);
+    copy->size = key->data;
+    copy->data = key->data;
+    copy->head = 0;
+
+    return copy;
+}
+
+void nst_key_free(struct nst_memory *memory, struct buffer *key) {
+
+    if(memory) {
+        nst_memory_free(memory, key->area);
+        nst_memory_free(memory, key);
+    } else {
+        free(key->area);
+        free(key);
+    }
+}
+
+/*
+ * Grow a key allocated by nst_key_init(). The scratch key (memory is NULL)
+ * already has the maximum size.
+ */
 static int
 _nst_key_expand(struct nst_memory *memory, struct buffer *key, int need) {
 
+    if(!memory) {
+        return NST_ERR;
+    }
+
     if(key->size >= global.tune.bufsize) {
         goto err;
     } else {
@@ -210,8 +489,7 @@ _nst_key_expand(struct nst_memory *memory, struct buffer *key, int need) {
             goto err;
         }
 
-        memset(p, 0, new_size);
-        memcpy(p, key->area, key->size);
+        memcpy(p, key->area, key->data);
         nst_memory_free(memory, key->area);
         key->area = p;
         key->size = new_size;
@@ -236,6 +514,7 @@ int nst_key_advance(struct nst_memory *memory, struct buffer *key, int step) {
 
     }
 
+    memset(key->area + key->data, 0, step);
     key->data += step;
 
     return NST_OK;
@@ -253,11 +532,108 @@ int nst_key_append(struct nst_memory *memory, struct buffer *key, char *str,
     }
 
     memcpy(key->area + key->data, str, str_len);
+    key->area[key->data + str_len] = 0;
     key->data += str_len + 1;
 
     return NST_OK;
 }
 
+static int _nst_key_value_find(struct nst_key_value *vals, int n, int idx) {
+    int i;
+
+    for(i = 0; i < n; i++) {
+
+        if(vals[i].idx == idx) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Collect the values of the header_ and param_ components of a rule key with
+ * a single pass over the request headers and one over the query, instead of
+ * looking each of them up. Header values are split on commas the way
+ * http_find_header() does, a param keeps its first value the way
+ * nst_req_find_param() does. Returns the number of values, or -1 if there are
+ * more than max of them.
+ */
+int nst_key_collect(struct htx *htx, char *query, int query_len,
+        struct nst_rule_key **pck, struct nst_key_value *vals, int max) {
+
+    struct http_hdr_ctx hdr = { .blk = NULL };
+    struct nst_rule_key **p, *ck;
+    int headers = 0, params = 0;
+    int n = 0;
+
+    for(p = pck; (ck = *p); p++) {
+        headers |= ck->type == NST_RULE_KEY_HEADER;
+        params  |= ck->type == NST_RULE_KEY_PARAM;
+    }
+
+    while(headers && http_find_header(htx, ist(""), &hdr, 0)) {
+        struct ist name = htx_get_blk_name(htx, hdr.blk);
+
+        for(p = pck; (ck = *p); p++) {
+
+            if(ck->type == NST_RULE_KEY_HEADER
+                    && isteqi(name, ist2(ck->data, ck->len))) {
+
+                if(n == max) {
+                    return -1;
+                }
+
+                vals[n].idx   = ck->idx;
+                vals[n].value = hdr.value;
+                n++;
+                break;
+            }
+        }
+    }
+
+    if(params && query && query_len) {
+        char *ptr = query;
+        char *end = query + query_len;
+
+        while(ptr < end) {
+            char *next = memchr(ptr, '&', end - ptr);
+
+            for(p = pck; (ck = *p); p++) {
+                char *v, *v_end;
+
+                if(ck->type != NST_RULE_KEY_PARAM
+                        || ptr + ck->len + 1 >= end
+                        || memcmp(ptr, ck->data, ck->len)
+                        || ptr[ck->len] != '='
+                        || _nst_key_value_find(vals, n, ck->idx) >= 0) {
+
+                    continue;
+                }
+
+                if(n == max) {
+                    return -1;
+                }
+
+                v     = ptr + ck->len + 1;
+                v_end = memchr(v, '&', end - v);
+
+                vals[n].idx   = ck->idx;
+                vals[n].value = ist2(v, (v_end ? v_end : end) - v);
+                n++;
+            }
+
+            if(!next) {
+                break;
+            }
+
+            ptr = next + 1;
+        }
+    }
+
+    return n;
+}
+
 int nst_ci_send(struct channel *chn, int len) {
     if(unlikely(channel_input_closed(chn))) {
         return -2;
@@ -20,6 +20,8 @@
 #include <proto/log.h>
 
 #include <nuster/nuster.h>
+#include <nuster/memory.h>
+#include <nuster/persist.h>
 
 const char *nst_cache_flt_id = "cache filter id";
 static const char *nst_nosql_flt_id = "nosql filter id";
@@ -73,14 +75,69 @@ static struct nst_rule_key *_nst_parse_rule_key_cast(char *str) {
         key->data = NULL;
     }
 
+    if(key) {
+        key->len = key->data ? strlen(key->data) : 0;
+        key->idx = -1;
+    }
+
     return key;
 }
 
+/*
+ * Give each distinct header and param of a key its own slot, so that their
+ * values can be collected in one pass by nst_key_collect()
+ */
+static void _nst_parse_rule_key_slots(struct nst_rule_key **pk) {
+    int i, j, n = 0;
+
+    for(i = 0; pk[i]; i++) {
+
+        if(pk[i]->type != NST_RULE_KEY_HEADER
+                && pk[i]->type != NST_RULE_KEY_PARAM) {
+
+            continue;
+        }
+
+        for(j = 0; j < i; j++) {
+
+            if(pk[j]->type == pk[i]->type && pk[j]->len == pk[i]->len
+                    && (pk[i]->type == NST_RULE_KEY_HEADER
+                        ? !strncasecmp(pk[j]->data, pk[i]->data, pk[i]->len)
+                        : !memcmp(pk[j]->data, pk[i]->data, pk[i]->len))) {
+
+                break;
+            }
+        }
+
+        pk[i]->idx = j < i ? pk[j]->idx : n++;
+    }
+}
+
+/*
+ * Rules with the same key definition share the parsed key, so the filters
+ * build the key only once for all of them
+ */
+static struct nst_rule_key_def {
+    struct nst_rule_key_def  *next;
+    char                     *str;
+    struct nst_rule_key     **key;
+} *nst_rule_key_defs = NULL;
+
 static struct nst_rule_key **_nst_parse_rule_key(char *str) {
+    struct nst_rule_key_def *def;
     struct nst_rule_key **pk = NULL;
-    char *m, *tmp = strdup(str);
+    char *m, *tmp;
     int i = 0;
 
+    for(def = nst_rule_key_defs; def; def = def->next) {
+
+        if(!strcmp(def->str, str)) {
+            return def->key;
+        }
+    }
+
+    tmp = strdup(str);
+
     m = strtok(tmp, ".");
 
     while(m) {
@@ -103,6 +160,19 @@ static struct nst_rule_key **_nst_parse_rule_key(char *str) {
     pk[i] = NULL;
     free(tmp);
 
+    _nst_parse_rule_key_slots(pk);
+
+    /* not sharing it is fine if this fails */
+    def = malloc(sizeof(*def));
+
+    if(def && (def->str = strdup(str))) {
+        def->key  = pk;
+        def->next = nst_rule_key_defs;
+        nst_rule_key_defs = def;
+    } else {
+        free(def);
+    }
+
     return pk;
 
 err:
@@ -297,6 +367,142 @@ const char *nst_parse_time(const char *text, int len, unsigned *ret) {
     return NULL;
 }
 
+/*
+ * hugepage on|off|thp, prefault on|off, numa bind|interleave nodes
+ * return 1 if args[*cur_arg] is one of them
+ */
+static int _nst_parse_global_memory(const char *file, int linenum, char **args,
+        int *cur_arg, struct nst_memory_conf *conf, int *err_code) {
+
+    char *name = args[*cur_arg];
+    char *value;
+
+    if(strcmp(name, "hugepage") && strcmp(name, "prefault")
+            && strcmp(name, "numa")) {
+
+        return 0;
+    }
+
+    (*cur_arg)++;
+    value = args[*cur_arg];
+
+    if(!strcmp(name, "hugepage")) {
+
+        if(!strcmp(value, "off")) {
+            conf->hugepage = NST_MEMORY_HUGEPAGE_OFF;
+        } else if(!strcmp(value, "on")) {
+            conf->hugepage = NST_MEMORY_HUGEPAGE_ON;
+        } else if(!strcmp(value, "thp")) {
+            conf->hugepage = NST_MEMORY_HUGEPAGE_THP;
+        } else {
+            ha_alert("parsing [%s:%d]: '%s' hugepage only supports 'on', "
+                    "'off' and 'thp'.\n", file, linenum, args[0]);
+
+            *err_code |= ERR_ALERT | ERR_FATAL;
+            return 1;
+        }
+    } else if(!strcmp(name, "prefault")) {
+
+        if(!strcmp(value, "off")) {
+            conf->prefault = 0;
+        } else if(!strcmp(value, "on")) {
+            conf->prefault = 1;
+        } else {
+            ha_alert("parsing [%s:%d]: '%s' prefault only supports 'on' and "
+                    "'off'.\n", file, linenum, args[0]);
+
+            *err_code |= ERR_ALERT | ERR_FATAL;
+            return 1;
+        }
+    } else {
+
+        if(!strcmp(value, "bind")) {
+            conf->numa = NST_MEMORY_NUMA_BIND;
+        } else if(!strcmp(value, "interleave")) {
+            conf->numa = NST_MEMORY_NUMA_INTERLEAVE;
+        } else {
+            ha_alert("parsing [%s:%d]: '%s' numa only supports 'bind' and "
+                    "'interleave'.\n", file, linenum, args[0]);
+
+            *err_code |= ERR_ALERT | ERR_FATAL;
+            return 1;
+        }
+
+        (*cur_arg)++;
+
+        if(nst_memory_parse_nodes(args[*cur_arg], &conf->nodes) != NST_OK) {
+            ha_alert("parsing [%s:%d]: '%s' numa expects a node list like "
+                    "'0,2-3'.\n", file, linenum, args[0]);
+
+            *err_code |= ERR_ALERT | ERR_FATAL;
+            return 1;
+        }
+    }
+
+    (*cur_arg)++;
+
+    return 1;
+}
+
+/*
+ * disk-sync off|on|every n|interval time
+ * return 1 if args[*cur_arg] is disk-sync
+ */
+static int _nst_parse_global_disk_sync(const char *file, int linenum,
+        char **args, int *cur_arg, int *sync, unsigned *value, int *err_code) {
+
+    char *mode;
+
+    if(strcmp(args[*cur_arg], "disk-sync")) {
+        return 0;
+    }
+
+    (*cur_arg)++;
+    mode = args[*cur_arg];
+
+    if(!strcmp(mode, "off")) {
+        *sync = NST_PERSIST_SYNC_OFF;
+    } else if(!strcmp(mode, "on")) {
+        *sync = NST_PERSIST_SYNC_ON;
+    } else if(!strcmp(mode, "every")) {
+        (*cur_arg)++;
+        *sync  = NST_PERSIST_SYNC_EVERY;
+        *value = atoi(args[*cur_arg]);
+
+        if((int)*value <= 0) {
+            ha_alert("parsing [%s:%d]: '%s' disk-sync every expects a "
+                    "number.\n", file, linenum, args[0]);
+
+            *err_code |= ERR_ALERT | ERR_FATAL;
+            return 1;
+        }
+    } else if(!strcmp(mode, "interval")) {
+        const char *res;
+
+        (*cur_arg)++;
+        *sync = NST_PERSIST_SYNC_INTERVAL;
+        res   = parse_time_err(args[*cur_arg], value, TIME_UNIT_MS);
+
+        if(*args[*cur_arg] == 0 || res || *value == 0) {
+            ha_alert("parsing [%s:%d]: '%s' disk-sync interval expects a "
+                    "time.\n", file, linenum, args[0]);
+
+            *err_code |= ERR_ALERT | ERR_FATAL;
+            return 1;
+        }
+    } else {
+        ha_alert("parsing [%s:%d]: '%s' disk-sync only supports 'off', 'on', "
+                "'every' and 'interval'.\n", file, linenum, args[0]);
+
+        *err_code |= ERR_ALERT | ERR_FATAL;
+        return 1;
+    }
+
+    (*cur_arg)++;
+
+    return 1;
+}
+
 int nuster_parse_global_cache(const char *file, int linenum, char **args) {
 
     int err_code = 0;
@@ -345,6 +551,7 @@ int nuster_parse_global_cache(const char *file, int linenum, char **args) {
     memcpy(global.nuster.cache.purge_method + 5, " ", 1);
     cur_arg++;
     global.nuster.cache.uri = NULL;
+    global.nuster.cache.tag_header = NULL;
 
     while(*(args[cur_arg]) !=0) {
         if(!strcmp(args[cur_arg], "data-size")) {
@@ -396,6 +603,31 @@ int nuster_parse_global_cache(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "disk-size")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' disk-size expects a size.\n",
+                        file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            if(nst_parse_size(args[cur_arg],
+                        &global.nuster.cache.disk_size)) {
+
+                ha_alert("parsing [%s:%d]: '%s' invalid disk-size, expects "
+                        "[m|M|g|G].\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "purge-method")) {
             cur_arg++;
 
@@ -448,6 +680,22 @@ int nuster_parse_global_cache(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "tag-header")) {
+            cur_arg++;
+
+            if(*(args[cur_arg]) == 0) {
+                ha_alert("parsing [%s:%d]: '%s': `tag-header` expects a header "
+                        "name.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.cache.tag_header = strdup(args[cur_arg]);
+            cur_arg++;
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "dir")) {
             cur_arg++;
 
@@ -548,6 +796,48 @@ int nuster_parse_global_cache(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "disk-loader-threads")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' disk-loader-threads expects a "
+                        "number.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.cache.disk_loader_threads = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.disk_loader_threads < 0) {
+                global.nuster.cache.disk_loader_threads = 0;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-loader-rate")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' disk-loader-rate expects a "
+                        "number.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.cache.disk_loader_rate = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.disk_loader_rate < 0) {
+                global.nuster.cache.disk_loader_rate = 0;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "disk-saver")) {
             cur_arg++;
 
@@ -569,6 +859,88 @@ int nuster_parse_global_cache(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "defragger")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' defragger expects a number."
+                        "\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.cache.defragger = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.defragger < 0) {
+                global.nuster.cache.defragger = 0;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-fds")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' disk-fds expects a number."
+                        "\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.cache.disk_fds = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.disk_fds < 0) {
+                global.nuster.cache.disk_fds = 0;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-mmap")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "on")) {
+                global.nuster.cache.disk_mmap = 1;
+            } else if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.cache.disk_mmap = 0;
+            } else {
+                ha_alert("parsing [%s:%d]: '%s' disk-mmap only supports 'on' "
+                        "and 'off'.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(_nst_parse_global_disk_sync(file, linenum, args, &cur_arg,
+                    &global.nuster.cache.disk_sync,
+                    &global.nuster.cache.disk_sync_value, &err_code)) {
+
+            if(err_code & ERR_FATAL) {
+                goto out;
+            }
+
+            continue;
+        }
+
+        if(_nst_parse_global_memory(file, linenum, args, &cur_arg,
+                    &global.nuster.cache.zone, &err_code)) {
+
+            if(err_code & ERR_FATAL) {
+                goto out;
+            }
+
+            continue;
+        }
+
         ha_alert("parsing [%s:%d]: '%s' Unrecognized .\n", file, linenum,
                 args[cur_arg]);
 
@@ -766,6 +1138,48 @@ int nuster_parse_global_nosql(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "disk-loader-threads")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' disk-loader-threads expects a "
+                        "number.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.nosql.disk_loader_threads = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.disk_loader_threads < 0) {
+                global.nuster.nosql.disk_loader_threads = 0;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-loader-rate")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' disk-loader-rate expects a "
+                        "number.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.nosql.disk_loader_rate = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.disk_loader_rate < 0) {
+                global.nuster.nosql.disk_loader_rate = 0;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "disk-saver")) {
             cur_arg++;
 
@@ -787,6 +1201,114 @@ int nuster_parse_global_nosql(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "replication")) {
+            cur_arg++;
+
+            if(*(args[cur_arg]) == 0) {
+                ha_alert("parsing [%s:%d]: '%s': `replication` expects a "
+                        "backend as an argument.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.nosql.replication = strdup(args[cur_arg]);
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "replication-mode")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "async")) {
+                global.nuster.nosql.replication_mode = NST_REPLICATION_ASYNC;
+            } else if(!strcmp(args[cur_arg], "sync")) {
+                global.nuster.nosql.replication_mode = NST_REPLICATION_SYNC;
+            } else {
+                ha_alert("parsing [%s:%d]: '%s' replication-mode only "
+                        "supports 'async' and 'sync'.\n", file, linenum,
+                        args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "replication-journal")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' replication-journal expects "
+                        "a number.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.nosql.replication_journal = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.replication_journal <= 0) {
+                global.nuster.nosql.replication_journal =
+                    NST_DEFAULT_REPLICATION_JOURNAL;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "replication-timeout")) {
+            const char *res;
+            unsigned timeout;
+
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' replication-timeout expects "
+                        "a time.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            res = parse_time_err(args[cur_arg], &timeout, TIME_UNIT_MS);
+
+            if(res || timeout == 0) {
+                ha_alert("parsing [%s:%d]: '%s' invalid replication-timeout."
+                        "\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.nosql.replication_timeout = timeout;
+            cur_arg++;
+            continue;
+        }
+
+        if(_nst_parse_global_disk_sync(file, linenum, args, &cur_arg,
+                    &global.nuster.nosql.disk_sync,
+                    &global.nuster.nosql.disk_sync_value, &err_code)) {
+
+            if(err_code & ERR_FATAL) {
+                goto out;
+            }
+
+            continue;
+        }
+
+        if(_nst_parse_global_memory(file, linenum, args, &cur_arg,
+                    &global.nuster.nosql.zone, &err_code)) {
+
+            if(err_code & ERR_FATAL) {
+                goto out;
+            }
+
+            continue;
+        }
+
         ha_alert("parsing [%s:%d]: '%s' Unrecognized .\n", file, linenum,
                 args[cur_arg]);
 
@@ -798,6 +1320,38 @@ out:
     return err_code;
 }
 
+/*
+ * [shard backend]
+ */
+static int _nst_parse_proxy_shard(char **args, int cur_arg, struct proxy *px,
+        char **err) {
+
+    while(*(args[cur_arg]) != 0) {
+
+        if(!strcmp(args[cur_arg], "shard")) {
+            cur_arg++;
+
+            if(*(args[cur_arg]) == 0) {
+                memprintf(err, "'%s %s': shard expects a backend.", args[0],
+                        args[1]);
+
+                return NST_ERR;
+            }
+
+            px->nuster.shard.name = strdup(args[cur_arg]);
+            cur_arg++;
+            continue;
+        }
+
+        memprintf(err, "'%s %s': unknown option `%s`.", args[0], args[1],
+                args[cur_arg]);
+
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
 int nst_parse_proxy_cache(char **args, int section, struct proxy *px,
         struct proxy *defpx, const char *file, int line, char **err) {
 
@@ -844,6 +1398,10 @@ int nst_parse_proxy_cache(char **args, int section, struct proxy *px,
         cur_arg++;
     }
 
+    if(_nst_parse_proxy_shard(args, cur_arg, px, err) != NST_OK) {
+        return -1;
+    }
+
     fconf->id   = nst_cache_flt_id;
     fconf->conf = conf;
     fconf->ops  = &nst_cache_filter_ops;
@@ -859,6 +1417,8 @@ int nst_parse_proxy_nosql(char **args, int section, struct proxy *px,
         struct proxy *defpx, const char *file, int line, char **err) {
 
     struct flt_conf *fconf;
+    int cur_arg = 2;
+
     fconf = calloc(1, sizeof(*fconf));
 
     if(!fconf) {
@@ -867,6 +1427,16 @@ int nst_parse_proxy_nosql(char **args, int section, struct proxy *px,
     }
 
     memset(fconf, 0, sizeof(*fconf));
+
+    /* on|off is accepted but ignored */
+    if(!strcmp(args[cur_arg], "on") || !strcmp(args[cur_arg], "off")) {
+        cur_arg++;
+    }
+
+    if(_nst_parse_proxy_shard(args, cur_arg, px, err) != NST_OK) {
+        return -1;
+    }
+
     fconf->id   = nst_nosql_flt_id;
     fconf->ops  = &nst_nosql_filter_ops;
 
@@ -999,7 +1569,7 @@ int nst_parse_proxy_rule(char **args, int section, struct proxy *proxy,
 
             cur_arg++;
             if(*args[cur_arg] == 0) {
-                memprintf(err, "'%s %s': expects [off|only|sync|async], "
+                memprintf(err, "'%s %s': expects [off|only|sync|async|tier], "
                         "default off.", args[0], name);
 
                 goto out;
@@ -1013,8 +1583,13 @@ int nst_parse_proxy_rule(char **args, int section, struct proxy *proxy,
                 disk = NST_DISK_SYNC;
             } else if(!strcmp(args[cur_arg], "async")) {
                 disk = NST_DISK_ASYNC;
+            } else if(!strcmp(args[cur_arg], "tier")
+                    && proxy->nuster.mode == NST_MODE_CACHE) {
+
+                disk = NST_DISK_TIER;
+                global.nuster.cache.tier = 1;
             } else {
-                memprintf(err, "'%s %s': expects [off|only|sync|async], "
+                memprintf(err, "'%s %s': expects [off|only|sync|async|tier], "
                         "default off.", args[0], name);
 
                 goto out;
@@ -10,7 +10,19 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <common/chunk.h>
+#include <common/hathreads.h>
+#include <common/initcall.h>
+#include <common/time.h>
 
 #include <types/global.h>
 
@@ -68,63 +80,854 @@ int nst_persist_init(char *root, char *path, uint64_t hash) {
     return NST_OK;
 }
 
+/*
+ * crc32c, with the sse4.2 instruction when the cpu has it
+ */
+static uint32_t nst_persist_crc_table[256];
+
+static uint32_t _nst_persist_crc32c_sw(uint32_t crc, const char *buf,
+        size_t len) {
+
+    const unsigned char *p = (const unsigned char *)buf;
+
+    while(len--) {
+        crc = (crc >> 8) ^ nst_persist_crc_table[(crc ^ *p++) & 0xff];
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t _nst_persist_crc32c_hw(uint32_t crc, const char *buf,
+        size_t len) {
+
+    uint64_t c;
+
+    while(len && ((uintptr_t)buf & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+        len--;
+    }
+
+    c = crc;
+
+    while(len >= 8) {
+        c = __builtin_ia32_crc32di(c, *(const uint64_t *)buf);
+        buf += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t)c;
+
+    while(len--) {
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+    }
+
+    return crc;
+}
+#endif
+
+static uint32_t (*_nst_persist_crc32c)(uint32_t crc, const char *buf,
+        size_t len) = _nst_persist_crc32c_sw;
+
+static void _nst_persist_crc32c_init() {
+    uint32_t i, j, c;
+
+    for(i = 0; i < 256; i++) {
+        c = i;
+
+        for(j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        }
+
+        nst_persist_crc_table[i] = c;
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if(__builtin_cpu_supports("sse4.2")) {
+        _nst_persist_crc32c = _nst_persist_crc32c_hw;
+    }
+#endif
+}
+
+INITCALL0(STG_PREPARE, _nst_persist_crc32c_init);
+
+/* the meta with expire and checksum zeroed, after the crc of the rest */
+static uint32_t _nst_persist_crc_meta(uint32_t crc, char *meta) {
+    char p[NST_PERSIST_META_SIZE];
+
+    memcpy(p, meta, NST_PERSIST_META_SIZE);
+    nst_persist_meta_set_expire(p, 0);
+    nst_persist_meta_set_checksum(p, 0);
+
+    return _nst_persist_crc32c(crc, p, NST_PERSIST_META_SIZE);
+}
+
+static void _nst_persist_tmp(char *tmp, const char *file) {
+    snprintf(tmp, PATH_MAX, "%s" NST_PERSIST_TMP_SUFFIX, file);
+}
+
+/*
+ * Open a temporary file for disk->file, it is renamed to disk->file by
+ * nst_persist_commit, so an incomplete file is never seen under its name.
+ */
+int nst_persist_create(struct persist *disk) {
+    char tmp[PATH_MAX];
+
+    _nst_persist_tmp(tmp, disk->file);
+
+    disk->offset  = 0;
+    disk->crc     = 0xffffffff;
+    disk->crc_len = 0;
+    disk->fd      = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    disk->error   = (disk->fd == -1);
+
+    return disk->fd;
+}
+
+/*
+ * Pending writes of the file being written by this thread, they are
+ * contiguous and start at offset. Writers flush before they return, so
+ * it never holds data of a file across two calls.
+ */
+static THREAD_LOCAL struct {
+    int      fd;
+    int      len;
+    off_t    offset;
+    char     buf[NST_PERSIST_BUF_SIZE];
+} nst_persist_wbuf;
+
+static int _nst_persist_writev(struct iovec *iov, int cnt, ssize_t len) {
+    ssize_t ret = pwritev(nst_persist_wbuf.fd, iov, cnt,
+            nst_persist_wbuf.offset);
+
+    nst_persist_wbuf.len = 0;
+
+    if(ret != len) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+static int _nst_persist_flush() {
+    struct iovec iov;
+
+    if(nst_persist_wbuf.len == 0) {
+        return NST_OK;
+    }
+
+    iov.iov_base = nst_persist_wbuf.buf;
+    iov.iov_len  = nst_persist_wbuf.len;
+
+    return _nst_persist_writev(&iov, 1, nst_persist_wbuf.len);
+}
+
+int nst_persist_flush(struct persist *disk) {
+
+    if(nst_persist_wbuf.fd != disk->fd) {
+        return NST_OK;
+    }
+
+    if(_nst_persist_flush() != NST_OK) {
+        disk->error = 1;
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Append len bytes at disk->offset. Small writes are copied to the thread
+ * buffer, a write which does not fit is sent along with the buffer in one
+ * pwritev, so buf can be reused as soon as this returns.
+ */
+int nst_persist_write(struct persist *disk, char *buf, int len) {
+    struct iovec iov[2];
+    int ret = NST_OK;
+
+    if(len <= 0) {
+        return NST_OK;
+    }
+
+    disk->crc      = _nst_persist_crc32c(disk->crc, buf, len);
+    disk->crc_len += len;
+
+    if(nst_persist_wbuf.len && (nst_persist_wbuf.fd != disk->fd
+                || nst_persist_wbuf.offset + nst_persist_wbuf.len
+                != disk->offset)) {
+
+        ret = _nst_persist_flush();
+    }
+
+    if(nst_persist_wbuf.len == 0) {
+        nst_persist_wbuf.fd     = disk->fd;
+        nst_persist_wbuf.offset = disk->offset;
+    }
+
+    disk->offset += len;
+
+    if(nst_persist_wbuf.len + len <= NST_PERSIST_BUF_SIZE) {
+        memcpy(nst_persist_wbuf.buf + nst_persist_wbuf.len, buf, len);
+        nst_persist_wbuf.len += len;
+
+        if(ret != NST_OK) {
+            disk->error = 1;
+        }
+
+        return ret;
+    }
+
+    iov[0].iov_base = nst_persist_wbuf.buf;
+    iov[0].iov_len  = nst_persist_wbuf.len;
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = len;
+
+    if(_nst_persist_writev(iov, 2, nst_persist_wbuf.len + len) != NST_OK) {
+        ret = NST_ERR;
+    }
+
+    if(ret != NST_OK) {
+        disk->error = 1;
+    }
+
+    return ret;
+}
+
+/*
+ * The meta is written last, with the checksum of everything written
+ * before, so whatever is still buffered goes out first.
+ */
+int nst_persist_write_meta(struct persist *disk) {
+    uint32_t crc;
+
+    if(nst_persist_flush(disk) != NST_OK) {
+        return NST_ERR;
+    }
+
+    nst_persist_meta_set_check_len(disk->meta, disk->crc_len);
+    crc = _nst_persist_crc_meta(disk->crc, disk->meta);
+    nst_persist_meta_set_checksum(disk->meta, crc ^ 0xffffffff);
+
+    if(pwrite(disk->fd, disk->meta, NST_PERSIST_META_SIZE, 0)
+            != NST_PERSIST_META_SIZE) {
+
+        disk->error = 1;
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * The bloom filter counts the files of each hash, it is filled by a scan of
+ * the directories before the files are loaded, and by each file written. A
+ * saturated counter or a file counted twice only costs a disk lookup.
+ */
+int nst_persist_bloom_init(struct nst_persist_disk *shared) {
+    shared->bloom = mmap(NULL, NST_PERSIST_BLOOM_SIZE, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+    if(shared->bloom == MAP_FAILED) {
+        shared->bloom = NULL;
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+static inline uint8_t *_nst_persist_bloom_counter(
+        struct nst_persist_disk *shared, uint64_t hash, int i) {
+
+    uint32_t h1 = hash;
+    uint32_t h2 = (hash >> 32) | 1;
+
+    return &shared->bloom[(h1 + i * h2) & (NST_PERSIST_BLOOM_SIZE - 1)];
+}
+
+static void _nst_persist_bloom_update(struct nst_persist_disk *shared,
+        uint64_t hash, int add) {
+
+    uint8_t *counter, old;
+    int i;
+
+    if(!shared->bloom) {
+        return;
+    }
+
+    for(i = 0; i < NST_PERSIST_BLOOM_HASHES; i++) {
+        counter = _nst_persist_bloom_counter(shared, hash, i);
+        old     = *counter;
+
+        do {
+
+            if(old == 0xff || (!add && old == 0)) {
+                break;
+            }
+
+        } while(!HA_ATOMIC_CAS(counter, &old, add ? old + 1 : old - 1));
+    }
+}
+
+/*
+ * Whether there is surely no file for the hash, once its directory was
+ * scanned.
+ */
+int nst_persist_bloom_miss(struct nst_persist_disk *shared, uint64_t hash) {
+    int i;
+
+    if(!shared->bloom
+            || !(shared->prefix[hash >> 56] & NST_PERSIST_PREFIX_SCANNED)) {
+        return 0;
+    }
+
+    for(i = 0; i < NST_PERSIST_BLOOM_HASHES; i++) {
+
+        if(!*_nst_persist_bloom_counter(shared, hash, i)) {
+            HA_ATOMIC_ADD(&shared->bloom_skipped, 1);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Count the files of the hash directories of prefix idx, only directories are
+ * read so it goes well ahead of the loader.
+ */
+static void _nst_persist_bloom_scan(char *root,
+        struct nst_persist_disk *shared, int idx) {
+
+    char path[PATH_MAX];
+    struct dirent *de, *de2;
+    DIR *dir, *dir2;
+    uint64_t hash;
+    int len;
+
+    dir = nst_persist_opendir_by_idx(root, path, idx);
+
+    if(dir) {
+        len = strlen(path);
+
+        while((de = readdir(dir)) != NULL) {
+
+            if(de->d_name[0] == '.') {
+                continue;
+            }
+
+            hash = strtoull(de->d_name, NULL, 16);
+            snprintf(path + len, sizeof(path) - len, "/%s", de->d_name);
+
+            dir2 = opendir(path);
+
+            if(!dir2) {
+                continue;
+            }
+
+            while((de2 = readdir(dir2)) != NULL) {
+
+                if(de2->d_name[0] != '.' && !nst_persist_is_tmp(de2->d_name)) {
+                    _nst_persist_bloom_update(shared, hash, 1);
+                }
+            }
+
+            closedir(dir2);
+        }
+
+        closedir(dir);
+    }
+
+    HA_ATOMIC_OR(&shared->prefix[idx], NST_PERSIST_PREFIX_SCANNED);
+    HA_ATOMIC_ADD(&shared->bloom_scanned, 1);
+}
+
+/*
+ * Called once the meta of a file is written, with disk-sync on the data is
+ * synced here, otherwise the file is left to nst_persist_sync. The file
+ * gets its name last, a file which could not be written is removed.
+ */
+int nst_persist_commit(struct persist *disk, struct nst_persist_disk *shared,
+        int sync) {
+
+    char tmp[PATH_MAX];
+
+    _nst_persist_tmp(tmp, disk->file);
+
+    if(disk->error) {
+        goto err;
+    }
+
+    if(sync == NST_PERSIST_SYNC_ON) {
+        fdatasync(disk->fd);
+    } else if(sync != NST_PERSIST_SYNC_OFF) {
+        HA_ATOMIC_ADD(&shared->dirty, 1);
+    }
+
+    /* counted first, a file must never be missing from the bloom filter */
+    _nst_persist_bloom_update(shared, nst_persist_meta_get_hash(disk->meta), 1);
+
+    if(rename(tmp, disk->file) != 0) {
+        goto err;
+    }
+
+    HA_ATOMIC_ADD(&shared->used, NST_PERSIST_META_SIZE + disk->crc_len);
+    HA_ATOMIC_ADD(&shared->files, 1);
+
+    return NST_OK;
+
+err:
+    unlink(tmp);
+    HA_ATOMIC_ADD(&shared->errors, 1);
+
+    return NST_ERR;
+}
+
+/* creation time of a file, in ms, from its name */
+static uint64_t _nst_persist_ctime(const char *name) {
+    const char *p = strrchr(name, '-');
+
+    return p ? strtoull(p + 1, NULL, 16) : 0;
+}
+
+static uint64_t _nst_persist_started() {
+    return start_date.tv_sec * 1000ULL + start_date.tv_usec / 1000;
+}
+
+/* hash of a file, from the name of its directory */
+static uint64_t _nst_persist_path_hash(const char *path, const char *name) {
+    const char *p = name;
+
+    while(p > path && *(p - 1) != '/') {
+        p--;
+    }
+
+    return strtoull(p, NULL, 16);
+}
+
+/*
+ * Whether a file is in the disk usage: written since the start, or
+ * loaded, the loader flags each prefix directory once done.
+ */
+static int _nst_persist_counted(struct nst_persist_disk *shared,
+        const char *path) {
+
+    const char *name = strrchr(path, '/');
+
+    if(shared->loaded) {
+        return 1;
+    }
+
+    if(!name || _nst_persist_ctime(name) >= _nst_persist_started()) {
+        return 1;
+    }
+
+    return shared->prefix[_nst_persist_path_hash(path, name) >> 56]
+        & NST_PERSIST_PREFIX_LOADED;
+}
+
+/*
+ * Remove a file and take it out of the disk usage, returns unlink() result.
+ */
+int nst_persist_unlink(struct nst_persist_disk *shared, const char *path) {
+    struct stat st;
+    int counted;
+    int ret;
+
+    if(stat(path, &st) != 0) {
+        return -1;
+    }
+
+    counted = _nst_persist_counted(shared, path);
+    ret     = unlink(path);
+
+    if(ret == 0) {
+        const char *name = strrchr(path, '/');
+
+        HA_ATOMIC_ADD(&shared->unlinked, 1);
+
+        /* a file of a directory not scanned yet was not counted */
+        if(name && !nst_persist_is_tmp(name)) {
+            uint64_t hash = _nst_persist_path_hash(path, name);
+
+            if(shared->prefix[hash >> 56] & NST_PERSIST_PREFIX_SCANNED) {
+                _nst_persist_bloom_update(shared, hash, 0);
+            }
+        }
+    }
+
+    if(ret == 0 && counted) {
+        HA_ATOMIC_SUB(&shared->used, st.st_size);
+        HA_ATOMIC_SUB(&shared->files, 1);
+    }
+
+    return ret;
+}
+
+void nst_persist_stats_dump(struct buffer *buf,
+        struct nst_persist_disk *shared, const char *name) {
+
+    chunk_appendf(buf, "%s.used: %"PRId64"\n", name,
+            shared->used > 0 ? shared->used : 0);
+    chunk_appendf(buf, "%s.files: %"PRId64"\n", name,
+            shared->files > 0 ? shared->files : 0);
+    chunk_appendf(buf, "%s.evicted: %"PRIu64"\n", name, shared->evicted);
+    chunk_appendf(buf, "%s.errors: %"PRIu64"\n", name, shared->errors);
+    chunk_appendf(buf, "%s.bloom: scanned=%d/256 skipped=%"PRIu64"\n", name,
+            shared->bloom_scanned, shared->bloom_skipped);
+    chunk_appendf(buf, "%s.loader: dirs=%d/256 files=%"PRIu64" loaded=%"PRIu64
+            " errors=%"PRIu64"\n", name, shared->load_dirs, shared->load_files,
+            shared->load_entries, shared->load_errors);
+}
+
+/*
+ * Check the checksum of a v5 file opened by nst_persist_valid, which reads
+ * the whole file, so the files checked are remembered in shared->verified
+ * and not read again. A broken file is removed.
+ */
+int nst_persist_verify(struct persist *disk, struct nst_persist_disk *shared) {
+    struct stat st;
+    uint64_t len, pos, id, *verified;
+    uint32_t crc;
+    char *buf;
+    ssize_t ret;
+
+    if(disk->meta[7] != NST_PERSIST_VERSION) {
+        return NST_OK;
+    }
+
+    id       = nst_hash(disk->file, strlen(disk->file)) | 1;
+    verified = &shared->verified[id & (NST_PERSIST_VERIFIED - 1)];
+
+    if(HA_ATOMIC_LOAD(verified) == id) {
+        return NST_OK;
+    }
+
+    len = nst_persist_meta_get_check_len(disk->meta);
+
+    if(fstat(disk->fd, &st) != 0 || st.st_size != NST_PERSIST_META_SIZE + len) {
+        goto err;
+    }
+
+    buf = malloc(NST_PERSIST_VERIFY_SIZE);
+
+    if(!buf) {
+        close(disk->fd);
+        return NST_ERR;
+    }
+
+    crc = 0xffffffff;
+    pos = 0;
+
+    while(pos < len) {
+        ret = len - pos;
+
+        if(ret > NST_PERSIST_VERIFY_SIZE) {
+            ret = NST_PERSIST_VERIFY_SIZE;
+        }
+
+        ret = pread(disk->fd, buf, ret, NST_PERSIST_META_SIZE + pos);
+
+        if(ret <= 0) {
+            break;
+        }
+
+        crc  = _nst_persist_crc32c(crc, buf, ret);
+        pos += ret;
+    }
+
+    free(buf);
+
+    crc = _nst_persist_crc_meta(crc, disk->meta) ^ 0xffffffff;
+
+    if(pos == len && crc == nst_persist_meta_get_checksum(disk->meta)) {
+        HA_ATOMIC_STORE(verified, id);
+        return NST_OK;
+    }
+
+err:
+    nst_persist_unlink(shared, disk->file);
+    close(disk->fd);
+    return NST_ERR;
+}
+
+/*
+ * Run by the master, sync the filesystem of root once value files were
+ * written, or value ms after the last sync if any file was written.
+ */
+void nst_persist_sync(char *root, struct nst_persist_disk *shared, int sync,
+        unsigned int value) {
+
+    uint64_t now;
+    unsigned int dirty;
+    int fd;
+
+    if(sync != NST_PERSIST_SYNC_EVERY && sync != NST_PERSIST_SYNC_INTERVAL) {
+        return;
+    }
+
+    dirty = shared->dirty;
+
+    if(dirty == 0) {
+        return;
+    }
+
+    now = get_current_timestamp();
+
+    if(sync == NST_PERSIST_SYNC_EVERY && dirty < value) {
+        return;
+    }
+
+    if(sync == NST_PERSIST_SYNC_INTERVAL && now - shared->synced < value) {
+        return;
+    }
+
+    fd = open(root, O_RDONLY | O_DIRECTORY);
+
+    if(fd == -1) {
+        return;
+    }
+
+    HA_ATOMIC_SUB(&shared->dirty, dirty);
+
+#ifdef __linux__
+    syncfs(fd);
+#else
+    sync();
+#endif
+
+    close(fd);
+
+    shared->synced = now;
+    shared->syncs++;
+}
+
 int nst_persist_valid(struct persist *disk, struct buffer *key, uint64_t hash) {
     char *buf;
     int ret;
 
     disk->fd = nst_persist_open(disk->file);
 
-    if(disk->fd == -1) {
-        goto err;
-    }
+    if(disk->fd == -1) {
+        goto err;
+    }
+
+    ret = pread(disk->fd, disk->meta, NST_PERSIST_META_SIZE, 0);
+
+    if(ret != NST_PERSIST_META_SIZE) {
+        goto err;
+    }
+
+    if(memcmp(disk->meta, "NUSTER", 6) !=0) {
+        goto err;
+    }
+
+    if(nst_persist_meta_check_expire(disk->meta) != NST_OK) {
+        goto err;
+    }
+
+    if(nst_persist_meta_get_hash(disk->meta) != hash
+            || nst_persist_meta_get_key_len(disk->meta) != key->data) {
+
+        goto err;
+    }
+
+    buf = malloc(key->data);
+
+    if(!buf) {
+        goto err;
+    }
+
+    ret = pread(disk->fd, buf, key->data, NST_PERSIST_POS_KEY);
+
+    if(ret != key->data) {
+        goto err;
+    }
+
+    if(memcmp(key->area, buf, key->data) != 0) {
+        goto err;
+    }
+
+    free(buf);
+    return NST_OK;
+
+err:
+    close(disk->fd);
+    return NST_ERR;
+}
+
+
+static THREAD_LOCAL struct nst_persist_file *nst_persist_files = NULL;
+static THREAD_LOCAL uint64_t nst_persist_file_stamp = 0;
+
+static void _nst_persist_file_drop(struct nst_persist_file *file) {
+
+    if(file->addr) {
+        munmap(file->addr, file->size);
+        file->addr = NULL;
+    }
+
+    close(file->fd);
+    free(file->file);
+    file->file = NULL;
+}
+
+/*
+ * Whether an open file can still be served: files removed since it was
+ * checked are detected with its link count. The expire can be extended in
+ * place, the mapping sees it, the copied meta reads it again once expired.
+ */
+static int _nst_persist_file_valid(struct nst_persist_file *file,
+        struct nst_persist_disk *shared) {
+
+    struct stat st;
+    uint64_t unlinked = shared->unlinked;
+    uint64_t expire;
+
+    if(file->unlinked != unlinked) {
+
+        if(fstat(file->fd, &st) != 0 || st.st_nlink == 0) {
+            return NST_ERR;
+        }
+
+        file->unlinked = unlinked;
+    }
+
+    if(file->addr) {
+        return nst_persist_meta_check_expire(file->addr);
+    }
+
+    if(nst_persist_meta_check_expire(file->meta) == NST_OK) {
+        return NST_OK;
+    }
+
+    if(pread(file->fd, &expire, sizeof(expire), NST_PERSIST_META_POS_EXPIRE)
+            != sizeof(expire)) {
+
+        return NST_ERR;
+    }
+
+    nst_persist_meta_set_expire(file->meta, expire);
+
+    return nst_persist_meta_check_expire(file->meta);
+}
+
+/*
+ * Like nst_persist_valid, then verify if asked, but the file is looked up in
+ * the open files of this thread first, and kept open on a miss when a slot
+ * is free, mapped too with disk-mmap. On success disk->cached is set if the
+ * file is kept open, disk->fd then belongs to it, release it with
+ * nst_persist_file_put.
+ */
+int nst_persist_file_get(struct persist *disk, struct buffer *key,
+        uint64_t hash, int verify, struct nst_persist_disk *shared) {
+
+    struct nst_persist_file *file = NULL;
+    uint64_t unlinked = shared->unlinked;
+    struct stat st;
+    int i;
 
-    ret = pread(disk->fd, disk->meta, NST_PERSIST_META_SIZE, 0);
+    disk->cached = NULL;
 
-    if(ret != NST_PERSIST_META_SIZE) {
-        goto err;
+    if(!nst_persist_files) {
+        nst_persist_files = calloc(global.nuster.cache.disk_fds,
+                sizeof(*nst_persist_files));
     }
 
-    if(memcmp(disk->meta, "NUSTER", 6) !=0) {
-        goto err;
+    if(!nst_persist_files) {
+        goto valid;
     }
 
-    if(nst_persist_meta_check_expire(disk->meta) != NST_OK) {
-        goto err;
+    for(i = 0; i < global.nuster.cache.disk_fds; i++) {
+        struct nst_persist_file *f = &nst_persist_files[i];
+
+        if(f->file && f->hash == hash && !strcmp(f->file, disk->file)) {
+
+            if(_nst_persist_file_valid(f, shared) != NST_OK) {
+
+                if(f->users) {
+                    return NST_ERR;
+                }
+
+                _nst_persist_file_drop(f);
+                file = f;
+                break;
+            }
+
+            memcpy(disk->meta, f->addr ? f->addr : f->meta,
+                    NST_PERSIST_META_SIZE);
+
+            f->stamp = ++nst_persist_file_stamp;
+            f->users++;
+
+            disk->cached = f;
+            disk->fd     = f->fd;
+
+            return NST_OK;
+        }
+
+        if(f->users) {
+            continue;
+        }
+
+        if(!file || !f->file || (file->file && f->stamp < file->stamp)) {
+            file = f;
+        }
     }
 
-    if(nst_persist_meta_get_hash(disk->meta) != hash
-            || nst_persist_meta_get_key_len(disk->meta) != key->data) {
+valid:
+    if(nst_persist_valid(disk, key, hash) != NST_OK
+            || (verify && nst_persist_verify(disk, shared) != NST_OK)) {
 
-        goto err;
+        return NST_ERR;
     }
 
-    buf = malloc(key->data);
+    if(!file || fstat(disk->fd, &st) != 0) {
+        return NST_OK;
+    }
 
-    if(!buf) {
-        goto err;
+    if(file->file) {
+        _nst_persist_file_drop(file);
     }
 
-    ret = pread(disk->fd, buf, key->data, NST_PERSIST_POS_KEY);
+    file->file = strdup(disk->file);
 
-    if(ret != key->data) {
-        goto err;
+    if(!file->file) {
+        return NST_OK;
     }
 
-    if(memcmp(key->area, buf, key->data) != 0) {
-        goto err;
+    if(global.nuster.cache.disk_mmap && st.st_size) {
+        file->addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, disk->fd,
+                0);
+
+        if(file->addr == MAP_FAILED) {
+            file->addr = NULL;
+        } else {
+            madvise(file->addr, st.st_size, MADV_SEQUENTIAL);
+            madvise(file->addr, st.st_size, MADV_WILLNEED);
+        }
     }
 
-    free(buf);
-    return NST_OK;
+    memcpy(file->meta, disk->meta, NST_PERSIST_META_SIZE);
 
-err:
-    close(disk->fd);
-    return NST_ERR;
+    file->size     = st.st_size;
+    file->hash     = hash;
+    file->fd       = disk->fd;
+    file->unlinked = unlinked;
+    file->stamp    = ++nst_persist_file_stamp;
+    file->users    = 1;
+
+    disk->cached = file;
+
+    return NST_OK;
 }
 
+void nst_persist_file_put(struct nst_persist_file *file) {
+    file->users--;
+}
 
 int nst_persist_exists(char *root, struct persist *disk, struct buffer *key,
-        uint64_t hash) {
+        uint64_t hash, struct nst_persist_disk *shared) {
 
     struct dirent *de;
     DIR *dirp;
@@ -140,12 +943,16 @@ int nst_persist_exists(char *root, struct persist *disk, struct buffer *key,
 
     while((de = readdir(dirp)) != NULL) {
 
-        if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+        if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0
+                && !nst_persist_is_tmp(de->d_name)) {
+
             memcpy(disk->file + nst_persist_path_hash_len(root), "/", 1);
             memcpy(disk->file + nst_persist_path_hash_len(root) + 1,
                     de->d_name, strlen(de->d_name));
 
-            if(nst_persist_valid(disk, key, hash) == NST_OK) {
+            if(nst_persist_valid(disk, key, hash) == NST_OK
+                    && nst_persist_verify(disk, shared) == NST_OK) {
+
                 closedir(dirp);
                 return NST_OK;
             }
@@ -254,7 +1061,25 @@ int nst_persist_get_last_modified(int fd, char *meta,
     return NST_OK;
 }
 
-void nst_persist_cleanup(char *root, char *path, struct dirent *de1) {
+int nst_persist_get_tags(int fd, char *meta, struct nst_str *tags) {
+
+    int ret = pread(fd, tags->data, tags->len,
+            NST_PERSIST_POS_KEY
+            + nst_persist_meta_get_key_len(meta)
+            + nst_persist_meta_get_host_len(meta)
+            + nst_persist_meta_get_path_len(meta)
+            + nst_persist_meta_get_etag_len(meta)
+            + nst_persist_meta_get_last_modified_len(meta));
+
+    if(ret != tags->len) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+void nst_persist_cleanup(char *root, char *path, struct dirent *de1,
+        struct nst_persist_disk *shared) {
     DIR *dir2;
     struct dirent *de2;
     int fd, ret;
@@ -277,6 +1102,20 @@ void nst_persist_cleanup(char *root, char *path, struct dirent *de1) {
 
     while((de2 = readdir(dir2)) != NULL) {
 
+        if(nst_persist_is_tmp(de2->d_name)) {
+            struct stat st;
+
+            /* left by a crash, a file being written is renamed quickly */
+            if(fstatat(dirfd(dir2), de2->d_name, &st, 0) == 0
+                    && st.st_mtime + NST_PERSIST_TMP_TTL
+                    < get_current_timestamp() / 1000) {
+
+                unlinkat(dirfd(dir2), de2->d_name, 0);
+            }
+
+            continue;
+        }
+
         if(strcmp(de2->d_name, ".") != 0
                 && strcmp(de2->d_name, "..") != 0) {
 
@@ -294,20 +1133,20 @@ void nst_persist_cleanup(char *root, char *path, struct dirent *de1) {
             ret = pread(fd, meta, NST_PERSIST_META_SIZE, 0);
 
             if(ret != NST_PERSIST_META_SIZE) {
-                unlink(path);
+                nst_persist_unlink(shared, path);
                 close(fd);
                 continue;
             }
 
             if(memcmp(meta, "NUSTER", 6) !=0) {
-                unlink(path);
+                nst_persist_unlink(shared, path);
                 close(fd);
                 continue;
             }
 
             /* persist is complete */
             if(nst_persist_meta_check_expire(meta) != NST_OK) {
-                unlink(path);
+                nst_persist_unlink(shared, path);
                 close(fd);
                 continue;
             }
@@ -321,8 +1160,399 @@ void nst_persist_cleanup(char *root, char *path, struct dirent *de1) {
 
 }
 
+static uint64_t _nst_persist_load_sec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec & 0xffffffff;
+}
+
+/* whether disk-loader-rate lets the loader read more files this second */
+static int _nst_persist_load_allowed(struct nst_persist_disk *disk, int rate) {
+    uint64_t window;
+
+    if(!rate) {
+        return 1;
+    }
+
+    window = HA_ATOMIC_LOAD(&disk->load_window);
+
+    return (window >> 32) != _nst_persist_load_sec()
+        || (window & 0xffffffff) < rate;
+}
+
+/*
+ * Take one file of disk-loader-rate, the window is reset and counted in a
+ * single CAS so that the loader threads never read more than rate files a
+ * second.
+ */
+static int _nst_persist_load_take(struct nst_persist_disk *disk, int rate) {
+    uint64_t sec, window, next;
+
+    if(!rate) {
+        return 1;
+    }
+
+    sec    = _nst_persist_load_sec();
+    window = HA_ATOMIC_LOAD(&disk->load_window);
+
+    do {
+
+        if((window >> 32) != sec) {
+            next = sec << 32 | 1;
+        } else if((window & 0xffffffff) < rate) {
+            next = window + 1;
+        } else {
+            return 0;
+        }
+
+    } while(!HA_ATOMIC_CAS(&disk->load_window, &window, next));
+
+    return 1;
+}
+
+/*
+ * Load the files of an open hash directory, the keys are read without lock
+ * and added to the dict NST_PERSIST_LOAD_BATCH at a time. A broken file is
+ * removed. Each file takes one of disk-loader-rate, once they are all taken
+ * the loader threads wait for the next second. Without wait, it returns
+ * NST_ERR instead and goes on from the same file on the next call.
+ */
+static int _nst_persist_load_dir(struct nst_persist_disk *disk, DIR *dir,
+        char *path, struct nst_persist_loader_ops *ops, int rate, int wait) {
+
+    struct nst_persist_item batch[NST_PERSIST_LOAD_BATCH];
+    struct nst_persist_item *item;
+    uint64_t started = _nst_persist_started();
+    struct dirent *de;
+    struct stat st;
+    long pos;
+    int fd, n = 0, ret = NST_OK;
+
+    for(pos = telldir(dir); (de = readdir(dir)) != NULL; pos = telldir(dir)) {
+
+        if(strcmp(de->d_name, ".") == 0
+                || strcmp(de->d_name, "..") == 0
+                || nst_persist_is_tmp(de->d_name)) {
+
+            continue;
+        }
+
+        if(!_nst_persist_load_take(disk, rate)) {
+
+            if(!wait) {
+                seekdir(dir, pos);
+                ret = NST_ERR;
+                break;
+            }
+
+            do {
+                usleep(10000);
+            } while(!_nst_persist_load_take(disk, rate));
+        }
+
+        item = &batch[n];
+        snprintf(item->file, sizeof(item->file), "%s/%s", path, de->d_name);
+
+        HA_ATOMIC_ADD(&disk->load_files, 1);
+
+        fd = nst_persist_open(item->file);
+
+        if(fd == -1) {
+            HA_ATOMIC_ADD(&disk->load_errors, 1);
+            continue;
+        }
+
+        if(nst_persist_get_meta(fd, item->meta) != NST_OK
+                || ops->read(item, fd) != NST_OK) {
+
+            nst_persist_unlink(disk, item->file);
+            HA_ATOMIC_ADD(&disk->load_errors, 1);
+            close(fd);
+            continue;
+        }
+
+        /* the files written since the start are already counted */
+        if(_nst_persist_ctime(de->d_name) < started
+                && fstat(fd, &st) == 0) {
+
+            HA_ATOMIC_ADD(&disk->used, st.st_size);
+            HA_ATOMIC_ADD(&disk->files, 1);
+        }
+
+        close(fd);
+
+        if(item->key && ++n == NST_PERSIST_LOAD_BATCH) {
+            HA_ATOMIC_ADD(&disk->load_entries, ops->add(batch, n));
+            n = 0;
+        }
+    }
+
+    if(n) {
+        HA_ATOMIC_ADD(&disk->load_entries, ops->add(batch, n));
+    }
+
+    return ret;
+}
+
+static void _nst_persist_load_done(struct nst_persist_disk *disk, int idx) {
+    HA_ATOMIC_OR(&disk->prefix[idx], NST_PERSIST_PREFIX_LOADED);
+    HA_ATOMIC_ADD(&disk->load_dirs, 1);
+}
+
+/* load the hash directories of prefix idx, within disk-loader-rate */
+static void _nst_persist_load_prefix(struct nst_persist_loader *loader,
+        int idx) {
+
+    struct nst_persist_disk *disk = loader->disk;
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dir, *sub;
+    int len;
+
+    dir = nst_persist_opendir_by_idx(loader->root, path, idx);
+
+    if(dir) {
+        len = strlen(path);
+
+        while((de = readdir(dir)) != NULL) {
+
+            if(de->d_name[0] == '.') {
+                continue;
+            }
+
+            snprintf(path + len, sizeof(path) - len, "/%s", de->d_name);
+            sub = opendir(path);
+
+            if(sub) {
+                _nst_persist_load_dir(disk, sub, path, loader->ops,
+                        loader->rate, 1);
+
+                closedir(sub);
+            }
+        }
+
+        closedir(dir);
+    }
+
+    _nst_persist_load_done(disk, idx);
+}
+
+/*
+ * A loader thread takes the prefixes one by one, first to scan them into the
+ * bloom filter, then to load them.
+ */
+static void *_nst_persist_loader_run(void *arg) {
+    struct nst_persist_loader *loader = arg;
+    struct nst_persist_disk *disk = loader->disk;
+    int idx;
+
+    while(disk->bloom
+            && (idx = HA_ATOMIC_XADD(&disk->bloom_idx, 1)) < 16 * 16) {
+
+        _nst_persist_bloom_scan(loader->root, disk, idx);
+    }
+
+    while((idx = HA_ATOMIC_XADD(&disk->idx, 1)) < 16 * 16) {
+        _nst_persist_load_prefix(loader, idx);
+    }
+
+    HA_ATOMIC_SUB(&loader->running, 1);
+
+    return NULL;
+}
+
+/*
+ * Start the loader threads, with the signals blocked so that they are left
+ * to master process. Returns NST_ERR if no thread could be started.
+ */
+static int _nst_persist_loader_start(char *root, struct nst_persist_disk *disk,
+        struct nst_persist_loader_ops *ops, int threads, int rate) {
+
+    struct nst_persist_loader *loader;
+    sigset_t blocked, old;
+    int i;
+
+    if(threads > 16 * 16) {
+        threads = 16 * 16;
+    }
+
+    loader = calloc(1, sizeof(*loader) + threads * sizeof(pthread_t));
+
+    if(!loader) {
+        return NST_ERR;
+    }
+
+    loader->root    = root;
+    loader->disk    = disk;
+    loader->ops     = ops;
+    loader->rate    = rate;
+    loader->running = threads;
+
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_SETMASK, &blocked, &old);
+
+    for(i = 0; i < threads; i++) {
+
+        if(pthread_create(&loader->thread[i], NULL, _nst_persist_loader_run,
+                    loader) != 0) {
+
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    loader->threads = i;
+    HA_ATOMIC_SUB(&loader->running, threads - i);
+
+    if(!i) {
+        free(loader);
+        return NST_ERR;
+    }
+
+    disk->loader = loader;
+
+    return NST_OK;
+}
+
+/*
+ * With disk-loader-threads, the threads are started on the first call and
+ * joined once done. Otherwise one directory of the disk is walked per call,
+ * after all of them are scanned into the bloom filter, and a hash directory
+ * stops at disk-loader-rate to go on at the next call, the master never
+ * sleeps.
+ */
+void nst_persist_disk_load(char *root, struct nst_persist_disk *disk,
+        struct nst_persist_loader_ops *ops, int threads, int rate) {
+
+    struct dirent *de;
+    int i;
+
+    if(disk->loader) {
+
+        if(disk->loader->running) {
+            return;
+        }
+
+        for(i = 0; i < disk->loader->threads; i++) {
+            pthread_join(disk->loader->thread[i], NULL);
+        }
+
+        free(disk->loader);
+        disk->loader = NULL;
+        disk->loaded = 1;
+        disk->idx    = 0;
+
+        return;
+    }
+
+    if(threads && disk->idx == 0
+            && _nst_persist_loader_start(root, disk, ops, threads, rate)
+            == NST_OK) {
+
+        return;
+    }
+
+    if(disk->bloom && disk->bloom_idx < 16 * 16) {
+        int n = NST_PERSIST_BLOOM_SCAN;
+
+        while(n-- && disk->bloom_idx < 16 * 16) {
+            _nst_persist_bloom_scan(root, disk, disk->bloom_idx++);
+        }
+
+        return;
+    }
+
+    if(!_nst_persist_load_allowed(disk, rate)) {
+        return;
+    }
+
+    if(disk->load_dir) {
+
+        if(_nst_persist_load_dir(disk, disk->load_dir, disk->load_path, ops,
+                    rate, 0) == NST_OK) {
+
+            closedir(disk->load_dir);
+            disk->load_dir = NULL;
+        }
+
+        return;
+    }
+
+    if(disk->dir) {
+        de = nst_persist_dir_next(disk->dir);
+
+        if(de) {
+
+            if(strcmp(de->d_name, ".") == 0
+                    || strcmp(de->d_name, "..") == 0) {
+
+                return;
+            }
+
+            /* left open at the rate, the next calls go on with it */
+            snprintf(disk->load_path, sizeof(disk->load_path), "%s/%s",
+                    disk->file, de->d_name);
+
+            disk->load_dir = opendir(disk->load_path);
+
+            if(disk->load_dir && _nst_persist_load_dir(disk, disk->load_dir,
+                        disk->load_path, ops, rate, 0) == NST_OK) {
+
+                closedir(disk->load_dir);
+                disk->load_dir = NULL;
+            }
+        } else {
+            closedir(disk->dir);
+            disk->dir = NULL;
+            _nst_persist_load_done(disk, disk->idx++);
+        }
+    } else {
+        disk->dir = nst_persist_opendir_by_idx(root, disk->file, disk->idx);
+
+        if(!disk->dir) {
+            _nst_persist_load_done(disk, disk->idx++);
+        }
+    }
+
+    if(disk->idx == 16 * 16) {
+        disk->loaded = 1;
+        disk->idx    = 0;
+    }
+}
+
+/*
+ * Remove invalid and expired files, one directory per call.
+ */
+void nst_persist_disk_cleanup(char *root, struct nst_persist_disk *disk) {
+
+    if(disk->dir) {
+        struct dirent *de = nst_persist_dir_next(disk->dir);
+
+        if(de) {
+            nst_persist_cleanup(root, disk->file, de, disk);
+        } else {
+            disk->idx++;
+            closedir(disk->dir);
+            disk->dir = NULL;
+        }
+    } else {
+        disk->dir = nst_persist_opendir_by_idx(root, disk->file, disk->idx);
+
+        if(!disk->dir) {
+            disk->idx++;
+        }
+    }
+
+    if(disk->idx == 16 * 16) {
+        disk->idx = 0;
+    }
+}
+
 int nst_persist_purge_by_key(char *root, struct persist *disk,
-        struct buffer *key, uint64_t hash) {
+        struct buffer *key, uint64_t hash, struct nst_persist_disk *shared) {
 
     struct dirent *de;
     DIR *dirp;
@@ -354,7 +1584,9 @@ int nst_persist_purge_by_key(char *root, struct persist *disk,
 
     while((de = readdir(dirp)) != NULL) {
 
-        if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+        if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0
+                && !nst_persist_is_tmp(de->d_name)) {
+
             memcpy(disk->file + nst_persist_path_hash_len(root), "/", 1);
             memcpy(disk->file + nst_persist_path_hash_len(root) + 1,
                     de->d_name, strlen(de->d_name));
@@ -369,7 +1601,7 @@ int nst_persist_purge_by_key(char *root, struct persist *disk,
                 ret = pread(disk->fd, buf, key->data, NST_PERSIST_POS_KEY);
 
                 if(ret == key->data && memcmp(key->area, buf, key->data) == 0) {
-                    unlink(disk->file);
+                    nst_persist_unlink(shared, disk->file);
                     ret = 200;
                     goto done;
                 }
@@ -385,8 +1617,8 @@ done:
     return ret;
 }
 
-int nst_persist_purge_by_path(char *path) {
-    int ret = unlink(path);
+int nst_persist_purge_by_path(char *path, struct nst_persist_disk *shared) {
+    int ret = nst_persist_unlink(shared, path);
 
     if(ret == 0) {
         return 200;
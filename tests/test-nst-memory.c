@@ -0,0 +1,137 @@
+/*
+ * Microbenchmark of the nuster shared memory allocator, with and without the
+ * per-thread magazines in front of the zone lock.
+ *
+ * Build with :
+ *   gcc -O2 -Iinclude -Iebtree -DUSE_THREAD -DUSE_PTHREAD_PSHARED \
+ *       -o test-nst-memory tests/test-nst-memory.c -lpthread
+ *
+ * Run with :
+ *   ./test-nst-memory [threads] [rounds]
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "../src/nuster/memory.c"
+
+#define BENCH_ZONE_SIZE   64 * 1024 * 1024
+#define BENCH_BATCH       64
+
+/* the allocator only needs these from the rest of haproxy */
+void hap_register_per_thread_init(int (*fct)()) { }
+void hap_register_per_thread_deinit(void (*fct)()) { }
+
+int chunk_appendf(struct buffer *chk, const char *fmt, ...) {
+	return 0;
+}
+
+int strlcpy2(char *dst, const char *src, int size) {
+	snprintf(dst, size, "%s", src);
+	return strlen(dst);
+}
+
+static struct nst_memory *zone;
+static int rounds = 200000;
+static int magazine;
+
+/* the sizes allocated by a cache request: key, key area, entry, element */
+static const int sizes[] = { 32, 128, 200, 24, 48, 96, 256, 512 };
+
+static double bench_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1.0e-6;
+}
+
+static void *worker(void *arg)
+{
+	void *p[BENCH_BATCH];
+	int i, j;
+
+	if (magazine)
+		nst_memory_magazine_init();
+
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < BENCH_BATCH; j++) {
+			p[j] = nst_memory_alloc(zone, sizes[(i + j) & 7]);
+
+			if (!p[j]) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+
+		for (j = 0; j < BENCH_BATCH; j++)
+			nst_memory_free(zone, p[j]);
+	}
+
+	if (magazine)
+		nst_memory_magazine_flush();
+
+	return NULL;
+}
+
+static double run(int threads)
+{
+	pthread_t tid[64];
+	double start;
+	int i;
+
+	start = bench_now();
+
+	for (i = 0; i < threads; i++)
+		pthread_create(&tid[i], NULL, worker, NULL);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+
+	return bench_now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	int threads = 4;
+	double t0, t1, ops;
+
+	if (argc > 1)
+		threads = atoi(argv[1]);
+
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	if (threads < 1 || threads > 64 || rounds < 1) {
+		fprintf(stderr, "usage: %s [threads 1-64] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	zone = nst_memory_create("bench", BENCH_ZONE_SIZE, 16384, 32, NULL);
+
+	if (!zone || nst_shctx_init(zone) != NST_OK) {
+		fprintf(stderr, "cannot create zone\n");
+		return 1;
+	}
+
+	ops = 2.0 * threads * rounds * BENCH_BATCH;
+
+	magazine = 0;
+	t0 = run(threads);
+	printf("lock per call : %8.3fs %12.0f ops/s\n", t0, ops / t0);
+
+	magazine = 1;
+	t1 = run(threads);
+	printf("magazines     : %8.3fs %12.0f ops/s (x%.2f)\n",
+	       t1, ops / t1, t0 / t1);
+
+	if (zone->used) {
+		fprintf(stderr, "leak: %llu bytes still used\n",
+			(unsigned long long)zone->used);
+		return 1;
+	}
+
+	return 0;
+}